@@ -0,0 +1,185 @@
+#!/usr/bin/env python
+"""Generate a synthetic pool of Arch-style packages.
+
+Packages carry a realistic .PKGINFO and file list: most have a few
+dozen to a few hundred files, with a long tail of large packages that
+ship thousands. File contents are left empty, so even a 50k package
+pool stays small on disk while still looking the same to repose.
+"""
+
+import argparse
+import io
+import os
+import random
+import tarfile
+import time
+
+SYLLABLES = ['lib', 'py', 'gtk', 'qt', 'x', 'font', 'perl', 'ruby', 'go',
+             'av', 'gst', 'kde', 'net', 'ssl', 'zip', 'core', 'media',
+             'tools', 'utils', 'data', 'sdl', 'gl', 'vk', 'sys', 'cfg']
+
+LOCALES = ['de', 'es', 'fr', 'it', 'ja', 'ko', 'nl', 'pl', 'pt_BR', 'ru',
+           'sv', 'tr', 'uk', 'zh_CN', 'zh_TW']
+
+BUILDDATE = 1500000000
+
+
+class Package(object):
+    def __init__(self, rng, idx, names):
+        self.name = names[idx]
+        self.version = '{}.{}.{}-{}'.format(rng.randint(0, 30), rng.randint(0, 99),
+                                            rng.randint(0, 20), rng.randint(1, 5))
+        self.desc = 'Synthetic package number {} for benchmarking'.format(idx)
+        self.arch = 'any' if rng.random() < 0.2 else 'x86_64'
+        self.builddate = BUILDDATE + rng.randint(0, 10 ** 8)
+        self.isize = rng.randint(10 ** 4, 10 ** 8)
+        self.depends = sorted(set(rng.choice(names) for _ in range(rng.randint(0, 8)))
+                              - {self.name})
+        self.makedepends = sorted(set(rng.choice(names) for _ in range(rng.randint(0, 3)))
+                                  - {self.name})
+        self.provides = ['{}-provider={}'.format(self.name, self.version.split('-')[0])] \
+            if rng.random() < 0.1 else []
+        self.files = make_files(rng, self.name)
+
+    @property
+    def filename(self):
+        return '{}-{}-{}.pkg.tar.gz'.format(self.name, self.version, self.arch)
+
+    def pkginfo(self):
+        lines = [
+            '# Generated by genpool.py',
+            'pkgname = {}'.format(self.name),
+            'pkgbase = {}'.format(self.name),
+            'pkgver = {}'.format(self.version),
+            'pkgdesc = {}'.format(self.desc),
+            'url = https://example.org/{}'.format(self.name),
+            'builddate = {}'.format(self.builddate),
+            'packager = Bench Builder <bench@example.org>',
+            'size = {}'.format(self.isize),
+            'arch = {}'.format(self.arch),
+            'license = GPL',
+        ]
+        lines += ['provides = {}'.format(p) for p in self.provides]
+        lines += ['depend = {}'.format(d) for d in self.depends]
+        lines += ['makedepend = {}'.format(d) for d in self.makedepends]
+        return '\n'.join(lines) + '\n'
+
+    def desc_entry(self, csize=0):
+        """The package as repose would write it into a database"""
+        fields = [
+            ('FILENAME', [self.filename]),
+            ('NAME', [self.name]),
+            ('BASE', [self.name]),
+            ('VERSION', [self.version]),
+            ('DESC', [self.desc]),
+            ('CSIZE', [str(csize)]),
+            ('ISIZE', [str(self.isize)]),
+            ('SHA256SUM', ['0' * 64]),
+            ('URL', ['https://example.org/{}'.format(self.name)]),
+            ('LICENSE', ['GPL']),
+            ('ARCH', [self.arch]),
+            ('BUILDDATE', [str(self.builddate)]),
+            ('PACKAGER', ['Bench Builder <bench@example.org>']),
+            ('PROVIDES', self.provides),
+            ('DEPENDS', self.depends),
+            ('MAKEDEPENDS', self.makedepends),
+            ('FILES', self.files),
+        ]
+        return ''.join('%{}%\n{}\n\n'.format(key, '\n'.join(values))
+                       for key, values in fields if values)
+
+
+def make_names(rng, count):
+    names = set()
+    while len(names) < count:
+        parts = [rng.choice(SYLLABLES) for _ in range(rng.randint(1, 3))]
+        names.add('-'.join(parts) + str(rng.randint(0, count)))
+    return sorted(names)
+
+
+def file_count(rng):
+    # Long tail: a few packages (think firmware, texlive, icon themes)
+    # ship thousands of files
+    if rng.random() < 0.02:
+        return rng.randint(2000, 10000)
+    return int(rng.lognormvariate(3.5, 1.0)) + 1
+
+
+def make_files(rng, name):
+    dirs = {'usr/', 'usr/bin/', 'usr/lib/', 'usr/share/',
+            'usr/lib/{}/'.format(name), 'usr/share/doc/', 'usr/share/doc/{}/'.format(name)}
+    files = []
+
+    for i in range(file_count(rng)):
+        kind = rng.random()
+        if kind < 0.1:
+            path = 'usr/bin/{}-{}'.format(name, i)
+        elif kind < 0.3:
+            locale = rng.choice(LOCALES)
+            base = 'usr/share/locale/{}/LC_MESSAGES/'.format(locale)
+            dirs.update({'usr/share/locale/', 'usr/share/locale/{}/'.format(locale), base})
+            path = '{}{}-{}.mo'.format(base, name, i)
+        elif kind < 0.4:
+            path = 'usr/share/doc/{}/page{}.html'.format(name, i)
+        else:
+            sub = 'usr/lib/{}/module{}/'.format(name, i // 50)
+            dirs.add(sub)
+            path = '{}file{}.so'.format(sub, i)
+        files.append(path)
+
+    return sorted(dirs | set(files))
+
+
+def write_package(pool, pkg):
+    path = os.path.join(pool, pkg.filename)
+    with tarfile.open(path, 'w:gz', compresslevel=1, format=tarfile.GNU_FORMAT) as tar:
+        def add(name, data=b'', dirent=False):
+            info = tarfile.TarInfo(name.rstrip('/'))
+            info.mtime = pkg.builddate
+            if dirent:
+                info.type = tarfile.DIRTYPE
+                info.mode = 0o755
+                tar.addfile(info)
+            else:
+                info.size = len(data)
+                info.mode = 0o644
+                tar.addfile(info, io.BytesIO(data))
+
+        add('.PKGINFO', pkg.pkginfo().encode())
+        for entry in pkg.files:
+            add(entry, dirent=entry.endswith('/'))
+
+
+def make_packages(count, seed=0):
+    rng = random.Random(seed)
+    names = make_names(rng, count)
+    return [Package(rng, i, names) for i in range(count)]
+
+
+def generate_pool(pool, count, seed=0):
+    os.makedirs(pool, exist_ok=True)
+    packages = make_packages(count, seed)
+    for pkg in packages:
+        write_package(pool, pkg)
+    return packages
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument('pool', help='directory to write packages into')
+    parser.add_argument('-n', '--count', type=int, default=1000,
+                        help='number of packages to generate')
+    parser.add_argument('--seed', type=int, default=0,
+                        help='random seed, for reproducible pools')
+    args = parser.parse_args()
+
+    start = time.perf_counter()
+    packages = generate_pool(args.pool, args.count, args.seed)
+    elapsed = time.perf_counter() - start
+
+    nfiles = sum(len(pkg.files) for pkg in packages)
+    print('generated {} packages ({} files) in {:.1f}s'.format(len(packages), nfiles, elapsed))
+
+
+if __name__ == '__main__':
+    main()
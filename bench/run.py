@@ -0,0 +1,268 @@
+#!/usr/bin/env python
+"""Benchmark repose.
+
+Runs microbenchmarks of the parsers and the package cache through the
+same cffi bindings the tests use, then times the repose binary against
+synthetic pools of increasing size. Every result reports throughput
+and peak RSS. Pools are generated once and kept in the work directory.
+"""
+
+import argparse
+import json
+import os
+import resource
+import shutil
+import subprocess
+import sys
+import time
+
+import genpool
+
+BENCH_DIR = os.path.dirname(os.path.abspath(__file__))
+TOP_DIR = os.path.dirname(BENCH_DIR)
+SRC_DIR = os.path.join(TOP_DIR, 'src')
+TESTS_DIR = os.path.join(TOP_DIR, 'tests')
+
+SOURCES = ['desc.c', 'pkginfo.c', 'package.c', 'pkgcache.c', 'util.c',
+           'base64.c', 'arena.c', 'filelist.c', 'stats.c', 'ioctx.c', 'buffer.c']
+
+EXTRA_CDEF = '''
+void *calloc(size_t nmemb, size_t size);
+void package_free(struct pkg *pkg);
+'''
+
+
+def build_bindings(workdir):
+    import cffi
+
+    ffi = cffi.FFI()
+    with open(os.path.join(TESTS_DIR, '_repose.h')) as header:
+        ffi.set_source('repose_bench',
+                       '#include <stdlib.h>\n' + header.read(),
+                       include_dirs=[SRC_DIR],
+                       libraries=['archive', 'alpm', 'crypto'],
+                       sources=[os.path.join(SRC_DIR, src) for src in SOURCES],
+                       extra_compile_args=['-std=c11', '-O2', '-D_GNU_SOURCE'])
+
+    with open(os.path.join(TESTS_DIR, '_repose.c')) as cdef:
+        ffi.cdef(cdef.read() + EXTRA_CDEF)
+
+    ffi.compile(tmpdir=workdir)
+    sys.path.insert(0, workdir)
+
+    from repose_bench import ffi, lib
+    return ffi, lib
+
+
+def peak_rss_self():
+    return resource.getrusage(resource.RUSAGE_SELF).ru_maxrss * 1024
+
+
+class Results(object):
+    def __init__(self):
+        self.rows = []
+
+    def add(self, group, name, seconds, units, unit, rss):
+        row = {
+            'group': group,
+            'name': name,
+            'seconds': seconds,
+            'throughput': units / seconds if seconds else float('inf'),
+            'unit': unit,
+            'peak_rss': rss,
+        }
+        self.rows.append(row)
+        print('{:<10} {:<28} {:>9.3f}s {:>14.1f} {:<8} {:>8.1f} MiB'.format(
+            group, name, seconds, row['throughput'], unit + '/s', rss / 2 ** 20))
+        sys.stdout.flush()
+
+
+def best_of(repeat, fn):
+    best = None
+    for _ in range(repeat):
+        start = time.perf_counter()
+        fn()
+        elapsed = time.perf_counter() - start
+        best = elapsed if best is None else min(best, elapsed)
+    return best
+
+
+def bench_parser(ffi, lib, results, repeat, kind, blobs):
+    if kind == 'desc':
+        parser_type, init, feed = 'struct desc_parser *', lib.desc_parser_init, lib.desc_parser_feed
+    else:
+        parser_type, init, feed = 'struct pkginfo_parser *', lib.pkginfo_parser_init, lib.pkginfo_parser_feed
+
+    buffers = [ffi.new('char[]', blob) for blob in blobs]
+    lengths = [len(blob) for blob in blobs]
+    total = sum(lengths)
+
+    def run():
+        for buf, length in zip(buffers, lengths):
+            parser = ffi.new(parser_type)
+            pkg = ffi.cast('struct pkg *', lib.calloc(1, ffi.sizeof('struct pkg')))
+            init(parser)
+            if feed(parser, pkg, buf, length) < 0:
+                raise RuntimeError('{} parser failed'.format(kind))
+            lib.package_free(pkg)
+        lib.arena_release()
+
+    seconds = best_of(repeat, run)
+    results.add('micro', '{} parse'.format(kind), seconds, total / 2 ** 20, 'MiB', peak_rss_self())
+    results.add('micro', '{} parse'.format(kind), seconds, len(blobs), 'pkgs', peak_rss_self())
+
+
+def bench_pkgcache(ffi, lib, results, repeat, count):
+    names = [ffi.new('char[]', 'package-{}'.format(i).encode()) for i in range(count)]
+    pkgs = ffi.new('struct pkg[]', count)
+    for pkg, name in zip(pkgs, names):
+        pkg.name = name
+        pkg.hash = lib.pkgname_hash(name)
+
+    state = {}
+
+    def add():
+        cache = lib.pkgcache_create(0)
+        for i in range(count):
+            cache = lib.pkgcache_add(cache, ffi.addressof(pkgs, i))
+        if 'cache' in state:
+            lib.pkgcache_free(state['cache'])
+        state['cache'] = cache
+
+    def find():
+        cache = state['cache']
+        for name in names:
+            if lib.pkgcache_find(cache, name) == ffi.NULL:
+                raise RuntimeError('pkgcache lost an entry')
+
+    def sort():
+        lib.pkgcache_sort(state['cache'])
+
+    def remove():
+        add()
+        cache = state['cache']
+        for i in range(count):
+            cache = lib.pkgcache_remove(cache, ffi.addressof(pkgs, i), ffi.NULL)
+        state['cache'] = cache
+
+    label = 'pkgcache {} ({})'
+    results.add('micro', label.format('add', count), best_of(repeat, add), count, 'ops', peak_rss_self())
+    results.add('micro', label.format('find', count), best_of(repeat, find), count, 'ops', peak_rss_self())
+    results.add('micro', label.format('sort', count), best_of(repeat, sort), count, 'pkgs', peak_rss_self())
+    results.add('micro', label.format('add+remove', count), best_of(repeat, remove), count, 'ops', peak_rss_self())
+
+    lib.pkgcache_free(state['cache'])
+
+
+def run_micro(args, results):
+    ffi, lib = build_bindings(os.path.join(args.workdir, 'cffi'))
+
+    packages = genpool.make_packages(args.micro_count, seed=1)
+    desc_blobs = [pkg.desc_entry().encode() for pkg in packages]
+    pkginfo_blobs = [pkg.pkginfo().encode() for pkg in packages]
+
+    bench_parser(ffi, lib, results, args.repeat, 'desc', desc_blobs)
+    bench_parser(ffi, lib, results, args.repeat, 'pkginfo', pkginfo_blobs)
+    bench_pkgcache(ffi, lib, results, args.repeat, args.micro_count * 10)
+
+
+def run_repose(args, *argv):
+    """Run repose once, returning wall time and the child's peak RSS"""
+    cmd = [args.repose] + list(argv)
+    start = time.perf_counter()
+    proc = subprocess.Popen(cmd, stdout=subprocess.DEVNULL)
+    _, status, rusage = os.wait4(proc.pid, 0)
+    elapsed = time.perf_counter() - start
+
+    if os.WIFSIGNALED(status) or os.WEXITSTATUS(status) != 0:
+        raise RuntimeError('{} failed with status {}'.format(' '.join(cmd), status))
+    return elapsed, rusage.ru_maxrss * 1024
+
+
+def prepare_pool(args, count):
+    pool = os.path.join(args.workdir, 'pool-{}'.format(count))
+    stamp = pool + '.complete'
+    if not os.path.exists(stamp):
+        shutil.rmtree(pool, ignore_errors=True)
+        print('generating {} packages into {}...'.format(count, pool))
+        sys.stdout.flush()
+        genpool.generate_pool(pool, count, seed=args.seed)
+        open(stamp, 'w').close()
+    return pool
+
+
+def run_e2e(args, results, count):
+    pool = prepare_pool(args, count)
+    root = os.path.join(args.workdir, 'root-{}'.format(count))
+
+    common = ['-r', root, '-p', pool, '-m', 'x86_64', '--jobs={}'.format(args.jobs)]
+    if not args.no_files:
+        common.append('--files')
+
+    def timed(name, *argv, fresh=False):
+        best, rss = None, 0
+        for _ in range(args.repeat):
+            if fresh:
+                shutil.rmtree(root, ignore_errors=True)
+                os.makedirs(root)
+            elapsed, peak = run_repose(args, *argv)
+            best = elapsed if best is None else min(best, elapsed)
+            rss = max(rss, peak)
+        results.add(str(count), name, best, count, 'pkgs', rss)
+
+    # A cold build: get_filecache over the whole pool, then compile_database
+    timed('build', *common, 'bench', fresh=True)
+    # Everything up to date: load_database plus the filecache prefilter
+    timed('update (no changes)', *common, 'bench')
+    # Everything rescanned, but the previous database is still there
+    timed('rebuild', *common, '--rebuild', 'bench')
+    if not args.no_files:
+        # The same, with file lists read as the files database is written
+        timed('rebuild (stream)', *common, '--rebuild', '--stream', 'bench')
+    # Just load_database
+    timed('list', '-r', root, '-l', 'bench')
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument('--repose', default=os.path.join(TOP_DIR, 'repose'),
+                        help='repose binary to benchmark')
+    parser.add_argument('--workdir', default=os.path.join(BENCH_DIR, '_work'),
+                        help='where to keep generated pools and builds')
+    parser.add_argument('--sizes', default='1000,10000,50000',
+                        help='comma separated pool sizes')
+    parser.add_argument('--repeat', type=int, default=3,
+                        help='report the best of this many runs')
+    parser.add_argument('--jobs', type=int, default=os.cpu_count() or 1,
+                        help='value passed to repose --jobs')
+    parser.add_argument('--seed', type=int, default=0,
+                        help='seed for the generated pools')
+    parser.add_argument('--micro-count', type=int, default=2000,
+                        help='packages fed to the parser microbenchmarks')
+    parser.add_argument('--no-files', action='store_true',
+                        help="don't build the .files database")
+    parser.add_argument('--skip-micro', action='store_true',
+                        help="don't run the microbenchmarks")
+    parser.add_argument('--skip-e2e', action='store_true',
+                        help="don't run repose itself")
+    parser.add_argument('--json', metavar='FILE',
+                        help='also write the results to FILE as json')
+    args = parser.parse_args()
+
+    os.makedirs(args.workdir, exist_ok=True)
+    results = Results()
+
+    if not args.skip_micro:
+        run_micro(args, results)
+
+    if not args.skip_e2e:
+        for count in (int(size) for size in args.sizes.split(',')):
+            run_e2e(args, results, count)
+
+    if args.json:
+        with open(args.json, 'w') as out:
+            json.dump(results.rows, out, indent=2)
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,285 @@
+#include "arena.h"
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdalign.h>
+#include <stdatomic.h>
+#include <err.h>
+#include <pthread.h>
+
+/* Most allocations are short strings and list nodes. Anything bigger
+ * than a quarter block gets a block of its own so we don't waste the
+ * remainder of the current one. */
+static const size_t block_size = 0x10000;
+
+/* Longer strings are rarely repeated: don't bother interning them */
+static const size_t max_intern_len = 64;
+
+struct arena_block {
+    struct arena_block *next;
+    alignas(max_align_t) char data[];
+};
+
+struct intern_slot {
+    char *str;
+    uint32_t len;
+    uint32_t hash;
+};
+
+struct arena {
+    struct arena *next;
+    struct arena *spare;
+    unsigned generation;
+    struct arena_block *blocks;
+    char *cur;
+    size_t left;
+    size_t footprint;
+
+    struct intern_slot *table;
+    size_t buckets;
+    size_t entries;
+};
+
+static pthread_mutex_t arenas_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct arena *arenas;
+static struct arena *spares;
+static _Thread_local struct arena *thread_arena;
+static _Thread_local unsigned thread_generation;
+static _Atomic unsigned generation;
+
+static pthread_once_t arena_once = PTHREAD_ONCE_INIT;
+static pthread_key_t arena_key;
+
+/* A worker's arena outlives the worker: whatever it allocated is
+ * still in use. Park it for the next thread to carry on with, so a
+ * run of short-lived worker pools doesn't start a new arena each. */
+static void park_arena(void *data)
+{
+    struct arena *arena = data;
+
+    pthread_mutex_lock(&arenas_lock);
+    if (arena->generation == generation) {
+        arena->spare = spares;
+        spares = arena;
+    }
+    pthread_mutex_unlock(&arenas_lock);
+}
+
+static void setup_arenas(void)
+{
+    if (pthread_key_create(&arena_key, park_arena) != 0)
+        errx(EXIT_FAILURE, "failed to set up arenas");
+}
+
+struct arena *arena_get(void)
+{
+    if (thread_arena && thread_generation == generation)
+        return thread_arena;
+
+    pthread_once(&arena_once, setup_arenas);
+
+    pthread_mutex_lock(&arenas_lock);
+    struct arena *arena = spares;
+    if (arena) {
+        spares = arena->spare;
+    } else {
+        arena = calloc(1, sizeof(struct arena));
+        if (!arena)
+            err(EXIT_FAILURE, "failed to allocate arena");
+        arena->generation = generation;
+        arena->next = arenas;
+        arenas = arena;
+    }
+    pthread_mutex_unlock(&arenas_lock);
+
+    pthread_setspecific(arena_key, arena);
+    thread_generation = arena->generation;
+    return thread_arena = arena;
+}
+
+static struct arena_block *new_block(size_t size)
+{
+    struct arena_block *block = malloc(sizeof(struct arena_block) + size);
+    if (!block)
+        err(EXIT_FAILURE, "failed to allocate arena block");
+    return block;
+}
+
+static void *arena_bump(struct arena *arena, size_t size, size_t align)
+{
+    size_t pad = -(uintptr_t)arena->cur & (align - 1);
+
+    if (arena->cur && pad + size <= arena->left) {
+        void *ptr = arena->cur + pad;
+        arena->cur += pad + size;
+        arena->left -= pad + size;
+        return ptr;
+    }
+
+    if (size > block_size / 4) {
+        /* Chain oversized blocks in behind the current one */
+        struct arena_block *block = new_block(size);
+        arena->footprint += size;
+        if (arena->blocks) {
+            block->next = arena->blocks->next;
+            arena->blocks->next = block;
+        } else {
+            block->next = NULL;
+            arena->blocks = block;
+        }
+        return block->data;
+    }
+
+    struct arena_block *block = new_block(block_size);
+    arena->footprint += block_size;
+    block->next = arena->blocks;
+    arena->blocks = block;
+    arena->cur = block->data + size;
+    arena->left = block_size - size;
+    return block->data;
+}
+
+void *arena_alloc(struct arena *arena, size_t size)
+{
+    return arena_bump(arena, size, alignof(max_align_t));
+}
+
+char *arena_strndup(struct arena *arena, const char *str, size_t len)
+{
+    char *copy = arena_bump(arena, len + 1, 1);
+    memcpy(copy, str, len);
+    copy[len] = 0;
+    return copy;
+}
+
+static uint32_t intern_hash(const char *str, size_t len)
+{
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < len; ++i) {
+        hash ^= (unsigned char)str[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+static void intern_grow(struct arena *arena)
+{
+    size_t buckets = arena->buckets ? arena->buckets * 2 : 256;
+    struct intern_slot *table = calloc(buckets, sizeof(*table));
+    if (!table)
+        err(EXIT_FAILURE, "failed to allocate intern table");
+
+    for (size_t i = 0; i < arena->buckets; ++i) {
+        const struct intern_slot *slot = &arena->table[i];
+        if (!slot->str)
+            continue;
+
+        size_t pos = slot->hash & (buckets - 1);
+        while (table[pos].str)
+            pos = (pos + 1) & (buckets - 1);
+        table[pos] = *slot;
+    }
+
+    free(arena->table);
+    arena->table = table;
+    arena->buckets = buckets;
+}
+
+/* Return a shared copy of a short string. Interned strings end up
+ * shared between packages, so they must never be written to. */
+char *arena_intern(struct arena *arena, const char *str, size_t len)
+{
+    if (len > max_intern_len)
+        return arena_strndup(arena, str, len);
+
+    if ((arena->entries + 1) * 4 > arena->buckets * 3)
+        intern_grow(arena);
+
+    const uint32_t hash = intern_hash(str, len);
+    size_t pos = hash & (arena->buckets - 1);
+
+    for (struct intern_slot *slot; (slot = &arena->table[pos])->str;
+         pos = (pos + 1) & (arena->buckets - 1)) {
+        if (slot->hash == hash && slot->len == len && memcmp(slot->str, str, len) == 0)
+            return slot->str;
+    }
+
+    char *copy = arena_strndup(arena, str, len);
+    arena->table[pos] = (struct intern_slot){
+        .str = copy,
+        .len = len,
+        .hash = hash
+    };
+    arena->entries += 1;
+    return copy;
+}
+
+static void free_arena(struct arena *arena)
+{
+    while (arena->blocks) {
+        struct arena_block *block = arena->blocks;
+        arena->blocks = block->next;
+        free(block);
+    }
+
+    free(arena->table);
+    free(arena);
+}
+
+/* Arenas handed out from here on start empty. The ones before stay
+ * valid, so whatever is still needed can be copied out of them, until
+ * arena_release_retired. */
+void arena_retire(void)
+{
+    pthread_mutex_lock(&arenas_lock);
+    generation += 1;
+    spares = NULL;
+    pthread_mutex_unlock(&arenas_lock);
+}
+
+void arena_release_retired(void)
+{
+    pthread_mutex_lock(&arenas_lock);
+    for (struct arena **link = &arenas; *link;) {
+        struct arena *arena = *link;
+
+        if (arena->generation != generation) {
+            *link = arena->next;
+            free_arena(arena);
+        } else {
+            link = &arena->next;
+        }
+    }
+    pthread_mutex_unlock(&arenas_lock);
+}
+
+/* Bytes held in blocks, across every thread's arena */
+size_t arena_footprint(void)
+{
+    size_t footprint = 0;
+
+    pthread_mutex_lock(&arenas_lock);
+    for (const struct arena *arena = arenas; arena; arena = arena->next)
+        footprint += arena->footprint;
+    pthread_mutex_unlock(&arenas_lock);
+
+    return footprint;
+}
+
+void arena_release(void)
+{
+    pthread_mutex_lock(&arenas_lock);
+    while (arenas) {
+        struct arena *arena = arenas;
+        arenas = arena->next;
+        free_arena(arena);
+    }
+    spares = NULL;
+    pthread_mutex_unlock(&arenas_lock);
+
+    if (thread_arena) {
+        pthread_setspecific(arena_key, NULL);
+        thread_arena = NULL;
+    }
+}
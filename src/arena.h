@@ -0,0 +1,28 @@
+#pragma once
+
+#include <stddef.h>
+
+struct arena;
+
+/* Package metadata lives for as long as the process does, so it's
+ * bump allocated out of large blocks instead of malloc'd string by
+ * string. Each thread gets its own arena; nothing here locks but
+ * handing one out. An exiting thread's arena goes to the next thread
+ * that needs one. */
+struct arena *arena_get(void);
+
+void *arena_alloc(struct arena *arena, size_t size);
+char *arena_strndup(struct arena *arena, const char *str, size_t len);
+char *arena_intern(struct arena *arena, const char *str, size_t len);
+
+/* For long-running processes: retire the arenas in use, copy what's
+ * still live into fresh ones, then free the retired arenas. Only safe
+ * while no other thread is allocating, and once nothing points into
+ * the retired arenas anymore. */
+void arena_retire(void);
+void arena_release_retired(void);
+size_t arena_footprint(void);
+
+/* Free every thread's arena in one go. Only safe once nothing points
+ * into them anymore and no other thread is allocating. */
+void arena_release(void);
@@ -13,7 +13,7 @@
 #include <err.h>
 #include <time.h>
 #include <sys/stat.h>
-#include <openssl/sha.h>
+#include <pthread.h>
 
 #include "repose.h"
 #include "package.h"
@@ -21,68 +21,86 @@
 #include "util.h"
 #include "desc.h"
 #include "buffer.h"
+#include "filelist.h"
 #include "signing.h"
+#include "stats.h"
+#include "dbindex.h"
+#include "ioctx.h"
 
 struct database_reader {
     struct archive *archive;
     struct pkg *likely_pkg;
+    struct pkgcache *shared;
     time_t mtime;
 };
 
+/* The name, version and type fields all share the same memory */
+struct entry_info {
+    char *name;
+    const char *type;
+    const char *version;
+};
+
+/* The database we're replacing, read alongside the new one so entries
+ * of packages that didn't change can be carried over as-is */
+struct database_previous {
+    struct archive *archive;
+    struct archive_entry *entry;
+    struct entry_info info;
+};
+
 struct database_writer {
     struct archive *archive;
     struct archive_entry *entry;
     struct buffer buf;
     enum contents contents;
+    int rootfd;
     int poolfd;
-};
+    int fd;
+    int prevfd;
+    char *tmpname;
+    struct database_previous prev;
 
-/* The name, version and type fields all share the same memory */
-struct entry_info {
-    char *name;
-    const char *type;
-    const char *version;
+    /* Only takes the packages that changed since the last write */
+    bool delta;
 };
 
-static char *sha256_fd(int fd)
+static inline char *tmpname_for(const char *repo_name)
 {
-    SHA256_CTX ctx;
-    unsigned char output[32];
-
-    SHA256_Init(&ctx);
-    for (;;) {
-        char buf[BUFSIZ];
-        ssize_t nbytes_r = read(fd, buf, sizeof(buf));
-        check_posix(nbytes_r, "failed to read file");
-        if (nbytes_r == 0)
-            break;
-        SHA256_Update(&ctx, buf, nbytes_r);
-    }
-    SHA256_Final(output, &ctx);
+    return joinstring(repo_name, ".tmp", NULL);
+}
 
-    return hex_representation(output, sizeof(output));
+static void add_decompressed(struct archive *archive)
+{
+    const la_int64_t bytes = archive_filter_bytes(archive, 0);
+    if (bytes > 0)
+        stats_add(STAT_BYTES_DECOMPRESSED, bytes);
 }
 
-static char *sha256_file(int dirfd, const char *filename)
+static void sha256_file(struct pkg *pkg, int dirfd)
 {
-    _cleanup_close_ int fd = openat(dirfd, filename, O_RDONLY);
-    check_posix(fd, "failed to open %s for sha256 checksum", filename);
-    return sha256_fd(fd);
+    _cleanup_close_ int fd = openat(dirfd, pkg->filename, O_RDONLY);
+    check_posix(fd, "failed to open %s for sha256 checksum", pkg->filename);
+
+    _cleanup_free_ char *sha256sum = sha256_fd(fd);
+    check_null(sha256sum, "failed to checksum %s", pkg->filename);
+    package_set(pkg, PKG_SHA256SUM, sha256sum, strlen(sha256sum));
 }
 
 static int parse_database_pathname(const char *entryname, struct entry_info *entry)
 {
     entry->name = strdup(entryname);
-    const char *slash = strchrnul(entry->name, '/'), *dash = slash;
+    const char *slash = strchrnul(entry->name, '/'), *dash;
 
-    dash = memrchr(entry->name, '-', dash - entry->name);
-    dash = memrchr(entry->name, '-', dash - entry->name);
+    dash = memrchr(entry->name, '-', slash - entry->name);
+    if (dash)
+        dash = memrchr(entry->name, '-', dash - entry->name);
 
-    if (*dash != '-')
+    if (!dash)
         return -EINVAL;
 
+    entry->type = *slash ? slash + 1 : NULL;
     entry->name[dash - entry->name] = entry->name[slash - entry->name] = '\0';
-    entry->type = slash ? slash + 1 : NULL;
     entry->version = &entry->name[dash - entry->name + 1];
 
     return 0;
@@ -98,26 +116,28 @@ static struct pkg *get_package(struct database_reader *db, struct entry_info *en
 {
     struct pkg *pkg;
 
-    if (db->likely_pkg) {
-        hash_t pkgname_hash = sdbm(entry_info->name);
-        if (pkgname_hash == db->likely_pkg->hash && streq(db->likely_pkg->name, entry_info->name))
-            return db->likely_pkg;
-    }
+    /* Entries for the same package come one after the other: a plain
+     * compare is cheaper than hashing the name again */
+    if (db->likely_pkg && streq(db->likely_pkg->name, entry_info->name))
+        return db->likely_pkg;
 
-    pkg = pkgcache_find(*pkgcache, entry_info->name);
+    const hash_t hash = pkgname_hash(entry_info->name);
+    pkg = pkgcache_find_hashed(*pkgcache, entry_info->name, hash);
+    if (!pkg && db->shared)
+        pkg = pkgcache_find_hashed(db->shared, entry_info->name, hash);
     if (allocate && !pkg) {
         pkg = malloc(sizeof(struct pkg));
         if (!pkg)
             return NULL;
 
         *pkg = (struct pkg){
-            .hash = sdbm(entry_info->name),
-            .name = strdup(entry_info->name),
-            .version = strdup(entry_info->version),
+            .hash = hash,
             .mtime = db->mtime
         };
+        package_set(pkg, PKG_PKGNAME, entry_info->name, strlen(entry_info->name));
+        package_set(pkg, PKG_VERSION, entry_info->version, strlen(entry_info->version));
 
-        *pkgcache = pkgcache_add_sorted(*pkgcache, pkg);
+        *pkgcache = pkgcache_add(*pkgcache, pkg, NULL);
     }
 
     if (pkg)
@@ -167,6 +187,8 @@ static int parse_database_entry(struct database_reader *db, struct archive_entry
         if (pkg && read_desc(db->archive, pkg) < 0) {
             errx(EXIT_FAILURE, "failed to parse %s for %s", entry_info.type, pathname);
         }
+        if (pkg)
+            filelist_finish(pkg->files);
     }
 
 cleanup:
@@ -174,6 +196,219 @@ cleanup:
     return ret;
 }
 
+/* A database member read off the archive, waiting to be parsed */
+struct load_chunk {
+    struct load_chunk *next;
+    struct entry_info info;
+    char *data;
+    size_t len;
+};
+
+/* Each worker only ever sees the packages whose names hash to it, so
+ * a package's desc, depends and files members are always parsed in
+ * order, by the same thread, into a cache only that thread touches. */
+struct load_worker {
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    struct load_chunk *head, *tail;
+    size_t queued;
+    bool done;
+
+    struct database_reader db;
+    struct pkgcache *cache;
+};
+
+/* How many members the reader may get ahead of each worker */
+static const size_t max_queued = 64;
+
+static struct load_chunk *read_chunk(struct archive *archive, struct archive_entry *entry,
+                                     struct entry_info *info)
+{
+    struct load_chunk *chunk = malloc(sizeof(struct load_chunk));
+    check_null(chunk, "failed to allocate database chunk");
+    *chunk = (struct load_chunk){ .info = *info };
+
+    size_t size = archive_entry_size(entry) > 0 ? archive_entry_size(entry) : 0x1000;
+    chunk->data = malloc(size);
+    check_null(chunk->data, "failed to allocate database chunk");
+
+    for (;;) {
+        char *buf;
+        size_t buf_len;
+        int status = archive_read(archive, &buf, &buf_len);
+        if (status == ARCHIVE_EOF)
+            break;
+        if (status < ARCHIVE_WARN)
+            errx(EXIT_FAILURE, "failed to read %s for %s", info->type, info->name);
+
+        if (chunk->len + buf_len > size) {
+            while (chunk->len + buf_len > size)
+                size *= 2;
+            chunk->data = realloc(chunk->data, size);
+            check_null(chunk->data, "failed to allocate database chunk");
+        }
+
+        memcpy(chunk->data + chunk->len, buf, buf_len);
+        chunk->len += buf_len;
+    }
+
+    return chunk;
+}
+
+static void load_chunk_free(struct load_chunk *chunk)
+{
+    entry_info_free(&chunk->info);
+    free(chunk->data);
+    free(chunk);
+}
+
+static void worker_push(struct load_worker *worker, struct load_chunk *chunk)
+{
+    pthread_mutex_lock(&worker->lock);
+    while (worker->queued >= max_queued)
+        pthread_cond_wait(&worker->cond, &worker->lock);
+
+    if (worker->tail)
+        worker->tail->next = chunk;
+    else
+        worker->head = chunk;
+    worker->tail = chunk;
+    worker->queued += 1;
+
+    pthread_cond_signal(&worker->cond);
+    pthread_mutex_unlock(&worker->lock);
+}
+
+static struct load_chunk *worker_pop(struct load_worker *worker)
+{
+    pthread_mutex_lock(&worker->lock);
+    while (!worker->head && !worker->done)
+        pthread_cond_wait(&worker->cond, &worker->lock);
+
+    struct load_chunk *chunk = worker->head;
+    if (chunk) {
+        worker->head = chunk->next;
+        if (!worker->head)
+            worker->tail = NULL;
+        worker->queued -= 1;
+    }
+
+    pthread_cond_signal(&worker->cond);
+    pthread_mutex_unlock(&worker->lock);
+    return chunk;
+}
+
+static void worker_finish(struct load_worker *worker)
+{
+    pthread_mutex_lock(&worker->lock);
+    worker->done = true;
+    pthread_cond_signal(&worker->cond);
+    pthread_mutex_unlock(&worker->lock);
+}
+
+static void *load_worker(void *arg)
+{
+    struct load_worker *worker = arg;
+    struct load_chunk *chunk;
+
+    while ((chunk = worker_pop(worker))) {
+        struct entry_info *info = &chunk->info;
+        bool allocate = !streq(info->type, "files");
+
+        struct pkg *pkg = get_package(&worker->db, info, &worker->cache, allocate);
+        if (allocate && !pkg)
+            err(EXIT_FAILURE, "failed to allocate package %s", info->name);
+
+        if (pkg) {
+            struct desc_parser parser;
+            desc_parser_init(&parser);
+
+            if (desc_parser_feed(&parser, pkg, chunk->data, chunk->len) < 0)
+                errx(EXIT_FAILURE, "failed to parse %s for %s", info->type, info->name);
+            filelist_finish(pkg->files);
+        }
+
+        load_chunk_free(chunk);
+    }
+
+    return NULL;
+}
+
+/* Decompress on this thread while the workers parse. New packages are
+ * merged into the cache once everything has been read. */
+static int load_database_parallel(struct database_reader *db, struct pkgcache **pkgcache,
+                                  size_t nworkers)
+{
+    struct load_worker *workers = calloc(nworkers, sizeof(struct load_worker));
+    check_null(workers, "failed to allocate database workers");
+    int ret = 0;
+
+    for (size_t i = 0; i < nworkers; ++i) {
+        struct load_worker *worker = &workers[i];
+
+        pthread_mutex_init(&worker->lock, NULL);
+        pthread_cond_init(&worker->cond, NULL);
+        worker->db = (struct database_reader){
+            .shared = *pkgcache,
+            .mtime = db->mtime
+        };
+        worker->cache = pkgcache_create(100);
+        check_null(worker->cache, "failed to allocate package cache");
+
+        int rc = pthread_create(&worker->thread, NULL, load_worker, worker);
+        if (rc != 0)
+            errx(EXIT_FAILURE, "failed to start worker thread: %s", strerror(rc));
+    }
+
+    struct archive_entry *entry;
+    while (archive_read_next_header(db->archive, &entry) == ARCHIVE_OK) {
+        if (!S_ISREG(archive_entry_mode(entry)))
+            continue;
+
+        struct entry_info info;
+        if (parse_database_pathname(archive_entry_pathname(entry), &info) < 0) {
+            entry_info_free(&info);
+            ret = -1;
+            break;
+        }
+
+        if (!info.type || !is_database_metadata(info.type)) {
+            entry_info_free(&info);
+            continue;
+        }
+
+        struct load_chunk *chunk = read_chunk(db->archive, entry, &info);
+        worker_push(&workers[pkgname_hash(info.name) % nworkers], chunk);
+    }
+
+    for (size_t i = 0; i < nworkers; ++i)
+        worker_finish(&workers[i]);
+
+    for (size_t i = 0; i < nworkers; ++i) {
+        struct load_worker *worker = &workers[i];
+
+        pthread_join(worker->thread, NULL);
+        pthread_mutex_destroy(&worker->lock);
+        pthread_cond_destroy(&worker->cond);
+
+        /* Only a corrupt database lists a package twice */
+        for (size_t j = 0; j < worker->cache->entries; ++j) {
+            struct pkg *old;
+            *pkgcache = pkgcache_add(*pkgcache, worker->cache->pkgs[j], &old);
+            if (old) {
+                warnx("database lists %s twice, keeping %s", old->name,
+                      worker->cache->pkgs[j]->version);
+                package_free(old);
+            }
+        }
+        pkgcache_free(worker->cache);
+    }
+
+    free(workers);
+    return ret;
+}
+
 int load_database(int fd, struct pkgcache **pkgcache)
 {
     int ret = 0;
@@ -190,11 +425,17 @@ int load_database(int fd, struct pkgcache **pkgcache)
     archive_read_support_filter_all(db.archive);
     archive_read_support_format_all(db.archive);
 
-    if (archive_read_open_fd(db.archive, fd, 8192) != ARCHIVE_OK) {
+    if (ioctx_open_archive(db.archive, fd) < 0) {
         ret = -1;
         goto cleanup;
     }
 
+    /* One thread decompresses, the rest parse */
+    if (config.jobs > 1) {
+        ret = load_database_parallel(&db, pkgcache, config.jobs - 1);
+        goto cleanup;
+    }
+
     while (archive_read_next_header(db.archive, &entry) == ARCHIVE_OK) {
         const mode_t mode = archive_entry_mode(entry);
 
@@ -205,6 +446,7 @@ int load_database(int fd, struct pkgcache **pkgcache)
     }
 
 cleanup:
+    add_decompressed(db.archive);
     archive_read_close(db.archive);
     archive_read_free(db.archive);
     return ret;
@@ -241,41 +483,6 @@ static void commit_entry(struct database_writer *db, const char *name,
     buffer_clear(&db->buf);
 }
 
-static void write_list(struct buffer *buf, const char *header, const alpm_list_t *lst)
-{
-    if (lst == NULL)
-        return;
-
-    buffer_printf(buf, "%%%s%%\n", header);
-    for (; lst; lst = lst->next)
-        buffer_printf(buf, "%s\n", (const char *)lst->data);
-    buffer_putc(buf, '\n');
-}
-
-static void write_string(struct buffer *buf, const char *header, const char *str)
-{
-    if (str == NULL)
-        return;
-
-    buffer_printf(buf, "%%%s%%\n%s\n\n", header, str);
-}
-
-static void write_size(struct buffer *buf, const char *header, size_t val)
-{
-    buffer_printf(buf, "%%%s%%\n%zd\n\n", header, val);
-}
-
-static void write_time(struct buffer *buf, const char *header, time_t val)
-{
-    buffer_printf(buf, "%%%s%%\n%ld\n\n", header, val);
-}
-
-#define write_entry(buf, header, val) _Generic((val), \
-    alpm_list_t *: write_list, \
-    char *: write_string, \
-    size_t: write_size, \
-    time_t: write_time)(buf, header, val)
-
 static void compile_desc_entry(struct database_writer *db, struct pkg *pkg)
 {
     write_entry(&db->buf, "FILENAME",  pkg->filename);
@@ -291,7 +498,7 @@ static void compile_desc_entry(struct database_writer *db, struct pkg *pkg)
         write_entry(&db->buf, "PGPSIG", pkg->base64sig);
     } else {
         if (!pkg->sha256sum)
-            pkg->sha256sum = sha256_file(db->poolfd, pkg->filename);
+            sha256_file(pkg, db->poolfd);
         write_entry(&db->buf, "SHA256SUM", pkg->sha256sum);
     }
 
@@ -313,20 +520,111 @@ static void compile_depends_entry(struct database_writer *db, struct pkg *pkg)
     write_entry(&db->buf, "CHECKDEPENDS", pkg->checkdepends);
 }
 
-static void compile_files_entry(struct database_writer *db, struct pkg *pkg)
+/* The package has to be read afresh, and if it can't be the write
+ * fails: an empty or partial %FILES% would look just like a real one */
+static int compile_files_entry(struct database_writer *db, struct pkg *pkg)
 {
     if (!pkg->files) {
         _cleanup_close_ int pkgfd = openat(db->poolfd, pkg->filename, O_RDONLY);
-        if (pkgfd < 0 && errno != ENOENT)
-            err(EXIT_FAILURE, "failed to open %s", pkg->filename);
+        if (pkgfd < 0) {
+            warn("failed to open %s", pkg->filename);
+            return -1;
+        }
 
-        load_package_files(pkg, pkgfd);
+        if (load_package_files(pkg, pkgfd) < 0) {
+            warnx("failed to read the file list of %s", pkg->filename);
+            return -1;
+        }
     }
 
     write_entry(&db->buf, "FILES", pkg->files);
+    return 0;
+}
+
+static void previous_next(struct database_previous *prev)
+{
+    entry_info_free(&prev->info);
+    prev->info = (struct entry_info){0};
+
+    while (archive_read_next_header(prev->archive, &prev->entry) == ARCHIVE_OK) {
+        if (parse_database_pathname(archive_entry_pathname(prev->entry), &prev->info) == 0)
+            return;
+        entry_info_free(&prev->info);
+        prev->info = (struct entry_info){0};
+    }
+
+    prev->entry = NULL;
 }
 
-static void compile_database_entry(struct database_writer *db, struct pkg *pkg)
+static void previous_open(struct database_previous *prev, int fd)
+{
+    prev->archive = archive_read_new();
+    archive_read_support_filter_all(prev->archive);
+    archive_read_support_format_all(prev->archive);
+
+    if (ioctx_open_archive(prev->archive, fd) < 0) {
+        prev->entry = NULL;
+        return;
+    }
+
+    previous_next(prev);
+}
+
+static void previous_close(struct database_previous *prev)
+{
+    if (!prev->archive)
+        return;
+
+    entry_info_free(&prev->info);
+    add_decompressed(prev->archive);
+    archive_read_close(prev->archive);
+    archive_read_free(prev->archive);
+}
+
+static bool previous_matches(const struct database_previous *prev, const struct pkg *pkg)
+{
+    return prev->entry && streq(prev->info.name, pkg->name) &&
+        streq(prev->info.version, pkg->version);
+}
+
+/* Copy every entry the previous database had for this package straight
+ * into the new one. Both databases are written in name order, so
+ * anything sorting before the package belongs to a package that has
+ * since been dropped and is skipped over. */
+static bool copy_previous_entry(struct database_writer *db, const struct pkg *pkg)
+{
+    struct database_previous *prev = &db->prev;
+
+    while (prev->entry && strcmp(prev->info.name, pkg->name) < 0)
+        previous_next(prev);
+
+    if (!previous_matches(prev, pkg))
+        return false;
+
+    do {
+        archive_write_header(db->archive, prev->entry);
+
+        for (;;) {
+            const void *buf;
+            size_t size;
+            int64_t offset;
+
+            int status = archive_read_data_block(prev->archive, &buf, &size, &offset);
+            if (status == ARCHIVE_EOF)
+                break;
+            if (status < ARCHIVE_WARN)
+                errx(EXIT_FAILURE, "failed to copy entry for %s: %s", pkg->name,
+                     archive_error_string(prev->archive));
+            archive_write_data(db->archive, buf, size);
+        }
+
+        previous_next(prev);
+    } while (previous_matches(prev, pkg));
+
+    return true;
+}
+
+static int compile_database_entry(struct database_writer *db, struct pkg *pkg)
 {
     _cleanup_free_ char *folder = joinstring(pkg->name, "-", pkg->version, NULL);
 
@@ -343,71 +641,441 @@ static void compile_database_entry(struct database_writer *db, struct pkg *pkg)
         commit_entry(db, "depends", folder);
     }
     if (db->contents & DB_FILES) {
-        compile_files_entry(db, pkg);
+        if (compile_files_entry(db, pkg) < 0)
+            return -1;
         commit_entry(db, "files", folder);
     }
     if (db->contents & DB_DELTAS) {
         write_entry(&db->buf, "DELTAS", pkg->deltas);
         commit_entry(db, "deltas", folder);
     }
+    return 0;
 }
 
-static int compile_database(struct repo *repo, const char *repo_name,
-                            enum contents what)
+static void set_filter_option(struct archive *archive, const char *option, int value)
 {
-    int ret = 0;
-    _cleanup_close_ int dbfd = openat(repo->rootfd, repo_name,
-                                      O_CREAT | O_WRONLY | O_TRUNC, 0644);
-    if (dbfd < 0)
-        return -1;
+    char buf[16];
+    snprintf(buf, sizeof(buf), "%d", value);
+
+    if (archive_write_set_filter_option(archive, NULL, option, buf) != ARCHIVE_OK)
+        warnx("compression doesn't support %s=%s: %s", option, buf,
+              archive_error_string(archive));
+}
+
+static void setup_compression(struct archive *archive)
+{
+    archive_write_add_filter(archive, config.compression);
+
+    if (config.compression_level >= 0)
+        set_filter_option(archive, "compression-level", config.compression_level);
+
+    /* Only the xz and zstd filters can spread compression over threads */
+    if (config.compression_threads > 1) {
+        if (config.compression == ARCHIVE_FILTER_XZ || config.compression == ARCHIVE_FILTER_ZSTD)
+            set_filter_option(archive, "threads", config.compression_threads);
+        else
+            warnx("threaded compression needs xz or zstd, ignoring");
+    }
+}
 
-    struct database_writer db = {
-        .archive = archive_write_new(),
-        .entry = archive_entry_new(),
-        .buf = {0},
+static int database_open(struct database_writer *db, struct repo *repo,
+                         const char *repo_name, enum contents what, bool delta)
+{
+    *db = (struct database_writer){
         .contents = what,
+        .rootfd = repo->rootfd,
         .poolfd = repo->poolfd,
+        .fd = -1,
+        .prevfd = -1,
+        .delta = delta
     };
 
-    archive_write_add_filter(db.archive, config.compression);
-    archive_write_set_format_pax_restricted(db.archive);
-
-    if (archive_write_open_fd(db.archive, dbfd) < 0) {
-        ret = -1;
-        goto cleanup;
+    /* The old database stays live, and is read from, while its
+     * replacement is written next to it. A delta has nothing to carry
+     * over. */
+    if (!delta) {
+        db->prevfd = openat(repo->rootfd, repo_name, O_RDONLY);
+        if (db->prevfd < 0 && errno != ENOENT)
+            return -1;
     }
 
-    archive_entry_populate(db.entry, AE_IFDIR, "", 0755);
-    archive_write_header(db.archive, db.entry);
-    archive_entry_clear(db.entry);
+    db->tmpname = tmpname_for(repo_name);
+    db->fd = openat(repo->rootfd, db->tmpname, O_CREAT | O_WRONLY | O_TRUNC, 0644);
+    if (db->fd < 0)
+        return -1;
+
+    db->archive = archive_write_new();
+    db->entry = archive_entry_new();
+
+    setup_compression(db->archive);
+    archive_write_set_format_pax_restricted(db->archive);
+
+    if (archive_write_open_fd(db->archive, db->fd) < 0)
+        return -1;
+
+    archive_entry_populate(db->entry, AE_IFDIR, "", 0755);
+    archive_write_header(db->archive, db->entry);
+    archive_entry_clear(db->entry);
 
     /* The files database can get very, very large. Lets allocate a
-     * 2MiB buffer so we have plenty of room and avoid reallocation. */
-    buffer_reserve(&db.buf, 0x200000);
+     * 2MiB buffer so we have plenty of room and avoid reallocation,
+     * reusing one from an earlier write if there is one. */
+    ioctx_take_buffer(&db->buf, 0x200000);
+
+    if (db->prevfd >= 0)
+        previous_open(&db->prev, db->prevfd);
+
+    return 0;
+}
+
+static int database_add(struct database_writer *db, struct pkg *pkg)
+{
+    if (db->delta)
+        return pkg->dirty ? compile_database_entry(db, pkg) : 0;
+
+    if (!pkg->dirty && copy_previous_entry(db, pkg))
+        return 0;
+    return compile_database_entry(db, pkg);
+}
+
+/* A delta opens with what a client needs to apply it: the generation
+ * it brings the database up to, and the name-version of every entry to
+ * remove before the entries that follow are added. */
+static void database_add_delta_header(struct database_writer *db, struct repo *repo,
+                                      size_t generation)
+{
+    write_entry(&db->buf, "GENERATION", generation);
+    write_entry(&db->buf, "REMOVED", repo->removed);
 
-    const alpm_list_t *node;
-    for (node = repo->cache->list; node; node = node->next) {
-        struct pkg *pkg = node->data;
-        compile_database_entry(&db, pkg);
+    archive_entry_populate(db->entry, AE_IFREG, ".DELTA", 0644);
+    archive_entry_set_size(db->entry, db->buf.len);
+    archive_write_header(db->archive, db->entry);
+    archive_write_data(db->archive, db->buf.data, db->buf.len);
+    archive_entry_clear(db->entry);
+    buffer_clear(&db->buf);
+}
+
+static int database_close(struct database_writer *db)
+{
+    int ret = 0;
+
+    if (db->archive && archive_write_close(db->archive) < 0)
+        ret = -1;
+    if (db->archive && archive_filter_bytes(db->archive, -1) > 0)
+        stats_add(STAT_BYTES_WRITTEN, archive_filter_bytes(db->archive, -1));
+    if (ret == 0 && db->fd >= 0 && fsync(db->fd) < 0)
+        ret = -1;
+
+    ioctx_give_buffer(&db->buf);
+    previous_close(&db->prev);
+
+    if (db->entry)
+        archive_entry_free(db->entry);
+    if (db->archive)
+        archive_write_free(db->archive);
+
+    closep(&db->fd);
+    closep(&db->prevfd);
+
+    /* Only a complete database may ever be published */
+    if (ret < 0 && db->tmpname)
+        unlinkat(db->rootfd, db->tmpname, 0);
+    free(db->tmpname);
+    return ret;
+}
+
+/* Write every database, and the deltas against the last generation if
+ * there are any to write, in a single walk over the cache with all the
+ * archives open at once. */
+static int compile_databases(struct repo *repo, const char *dbdelta,
+                             const char *filesdelta, size_t generation)
+{
+    const struct {
+        const char *name;
+        enum contents what;
+        bool delta;
+    } outputs[] = {
+        { repo->dbname,    DB_DESC | DB_DEPENDS, false },
+        { repo->filesname, DB_FILES,             false },
+        { dbdelta,         DB_DESC | DB_DEPENDS, true },
+        { filesdelta,      DB_FILES,             true }
+    };
+
+    struct database_writer writers[sizeof(outputs) / sizeof(*outputs)];
+    size_t count = 0;
+    int ret = 0;
+
+    for (size_t i = 0; i < sizeof(outputs) / sizeof(*outputs); ++i) {
+        if (!outputs[i].name)
+            continue;
+
+        struct database_writer *db = &writers[count++];
+        if (database_open(db, repo, outputs[i].name, outputs[i].what, outputs[i].delta) < 0) {
+            ret = -1;
+            break;
+        }
+        if (outputs[i].delta)
+            database_add_delta_header(db, repo, generation);
     }
 
-    archive_write_close(db.archive);
-    buffer_release(&db.buf);
+    if (ret == 0) {
+        pkgcache_sort(repo->cache);
+
+        for (size_t i = 0; i < repo->cache->entries && ret == 0; ++i) {
+            struct pkg *pkg = repo->cache->pkgs[i];
+            for (size_t w = 0; w < count && ret == 0; ++w) {
+                if (database_add(&writers[w], pkg) < 0)
+                    ret = -1;
+            }
+
+            /* Once written, a file list is only needed again if the
+             * package changes, and then it's read afresh. Letting go of
+             * it here keeps at most one list resident, however big the
+             * repo. */
+            filelist_free(pkg->files);
+            pkg->files = NULL;
+        }
+    }
 
-cleanup:
-    archive_entry_free(db.entry);
-    archive_write_free(db.archive);
+    for (size_t w = 0; w < count; ++w) {
+        if (database_close(&writers[w]) < 0)
+            ret = -1;
+    }
     return ret;
 }
 
-int write_database(struct repo *repo, const char *repo_name, enum contents what)
+static int sign_database(struct repo *repo, const char *repo_name)
 {
-    trace("writing %s...\n", repo_name);
-    check_posix(compile_database(repo, repo_name, what),
-                "failed to write %s database", repo_name);
+    _cleanup_free_ char *tmpname = tmpname_for(repo_name);
+    return gpgme_sign(repo->rootfd, tmpname, NULL);
+}
 
-    if (config.sign)
-        gpgme_sign(repo->rootfd, repo_name, NULL);
+/* Whatever was staged for publishing, and its signature */
+static void discard_databases(struct repo *repo, const char *const *names, size_t count)
+{
+    const int saved_errno = errno;
 
+    for (size_t i = 0; i < count; ++i) {
+        if (!names[i])
+            continue;
+
+        _cleanup_free_ char *tmpname = tmpname_for(names[i]);
+        _cleanup_free_ char *tmpsig = joinstring(tmpname, ".sig", NULL);
+        unlinkat(repo->rootfd, tmpsig, 0);
+        unlinkat(repo->rootfd, tmpname, 0);
+    }
+
+    errno = saved_errno;
+}
+
+/* Everything that's about to go live has to be there: once the first
+ * rename has happened, it's too late to back out */
+static bool databases_staged(struct repo *repo, const char *const *names, size_t count)
+{
+    for (size_t i = 0; i < count; ++i) {
+        if (!names[i])
+            continue;
+
+        _cleanup_free_ char *tmpname = tmpname_for(names[i]);
+        _cleanup_free_ char *tmpsig = joinstring(tmpname, ".sig", NULL);
+
+        if (faccessat(repo->rootfd, tmpname, F_OK, 0) < 0) {
+            warn("%s is missing", tmpname);
+            return false;
+        }
+        if (repo->sign && faccessat(repo->rootfd, tmpsig, F_OK, 0) < 0) {
+            warn("%s is missing", tmpsig);
+            return false;
+        }
+    }
+    return true;
+}
+
+/* Move a finished database over the live one, then its signature. The
+ * two can't be swapped in as one, but each rename is atomic: readers
+ * see either the old file or the new one, never a partial write. */
+static void publish_database(struct repo *repo, const char *repo_name)
+{
+    _cleanup_free_ char *tmpname = tmpname_for(repo_name);
+    check_posix(renameat(repo->rootfd, tmpname, repo->rootfd, repo_name),
+                "failed to replace %s", repo_name);
+
+    if (repo->sign) {
+        _cleanup_free_ char *tmpsig = joinstring(tmpname, ".sig", NULL);
+        _cleanup_free_ char *sig = joinstring(repo_name, ".sig", NULL);
+        check_posix(renameat(repo->rootfd, tmpsig, repo->rootfd, sig),
+                    "failed to replace %s", sig);
+    }
+}
+
+static inline char *delta_name(const char *repo_name, size_t generation)
+{
+    char suffix[32];
+    snprintf(suffix, sizeof(suffix), ".delta.%zu", generation);
+    return joinstring(repo_name, suffix, NULL);
+}
+
+/* The generation file records the database it was written alongside
+ * the way the index does: a generation only describes the live
+ * database while its size, modification time and inode still match */
+static bool same_database(const struct stat *st, intmax_t size, intmax_t sec,
+                          long nsec, uintmax_t ino)
+{
+    return st->st_size == size && st->st_mtim.tv_sec == sec &&
+        st->st_mtim.tv_nsec == nsec && st->st_ino == ino;
+}
+
+/* The generation last recorded, counting up by one every write, or -1
+ * if none was ever recorded. *current says whether the live database
+ * is still the one that generation was recorded for. */
+static int read_generation(struct repo *repo, const char *genname,
+                           size_t *generation, bool *current)
+{
+    *generation = 0;
+    *current = false;
+
+    _cleanup_fclose_ FILE *fp = fopenat(repo->rootfd, genname, "r");
+    if (!fp) {
+        if (errno != ENOENT)
+            warn("failed to open %s", genname);
+        return -1;
+    }
+
+    intmax_t size, sec;
+    long nsec;
+    uintmax_t ino;
+    struct stat st;
+
+    int fields = fscanf(fp, "%zu %jd %jd %ld %ju", generation, &size, &sec, &nsec, &ino);
+    if (fields < 1) {
+        warnx("%s is corrupt, starting over", genname);
+        return 0;
+    }
+
+    *current = fields == 5 && fstatat(repo->rootfd, repo->dbname, &st, 0) == 0 &&
+        same_database(&st, size, sec, nsec, ino);
+    return 0;
+}
+
+static void write_generation(struct repo *repo, const char *genname, size_t generation)
+{
+    struct stat st;
+    check_posix(fstatat(repo->rootfd, repo->dbname, &st, 0),
+                "failed to stat %s", repo->dbname);
+
+    _cleanup_free_ char *tmpname = tmpname_for(genname);
+    _cleanup_fclose_ FILE *fp = fopenat(repo->rootfd, tmpname, "w");
+    check_null(fp, "failed to open %s", tmpname);
+
+    fprintf(fp, "%zu %jd %jd %ld %ju\n", generation, (intmax_t)st.st_size,
+            (intmax_t)st.st_mtim.tv_sec, (long)st.st_mtim.tv_nsec, (uintmax_t)st.st_ino);
+    if (fflush(fp) != 0 || fsync(fileno(fp)) < 0)
+        err(EXIT_FAILURE, "failed to write %s", tmpname);
+
+    check_posix(renameat(repo->rootfd, tmpname, repo->rootfd, genname),
+                "failed to replace %s", genname);
+}
+
+/* Remove the deltas that have fallen out of the window we keep */
+static void prune_deltas(struct repo *repo, const char *repo_name, size_t generation)
+{
+    if (generation <= (size_t)config.deltas)
+        return;
+
+    for (size_t gen = generation - (size_t)config.deltas; gen > 0; --gen) {
+        _cleanup_free_ char *name = delta_name(repo_name, gen);
+        _cleanup_free_ char *sig = joinstring(name, ".sig", NULL);
+
+        unlinkat(repo->rootfd, sig, 0);
+        if (unlinkat(repo->rootfd, name, 0) < 0)
+            break;
+    }
+}
+
+int write_databases(struct repo *repo)
+{
+    if (repo->filesname)
+        trace("writing %s and %s...\n", repo->dbname, repo->filesname);
+    else
+        trace("writing %s...\n", repo->dbname);
+
+    /* A delta can only be written against a generation clients might
+     * have, and only when every change since then is accounted for.
+     * Once there is a generation, every write bumps it, with or without
+     * --delta, so clients never take a changed database for the one
+     * they have. */
+    _cleanup_free_ char *genname = joinstring(repo->dbname, ".gen", NULL);
+    _cleanup_free_ char *dbdelta = NULL, *filesdelta = NULL;
+    size_t previous, generation = 0;
+    bool current;
+
+    if (read_generation(repo, genname, &previous, &current) == 0 || config.deltas) {
+        generation = previous + 1;
+
+        if (config.deltas && previous && current && repo->tracked) {
+            dbdelta = delta_name(repo->dbname, generation);
+            if (repo->filesname)
+                filesdelta = delta_name(repo->filesname, generation);
+        }
+    }
+
+    /* Deltas go up first and the generation last: a client that sees
+     * the new generation is sure to find everything it needs */
+    const char *const outputs[] = { dbdelta, filesdelta, repo->dbname, repo->filesname };
+    const size_t count = sizeof(outputs) / sizeof(*outputs);
+
+    stats_begin(PHASE_WRITE);
+    if (compile_databases(repo, dbdelta, filesdelta, generation) < 0) {
+        discard_databases(repo, outputs, count);
+        err(EXIT_FAILURE, "failed to write %s database", repo->dbname);
+    }
+    stats_end(PHASE_WRITE);
+
+    /* Do all the slow work before touching anything live, so the only
+     * window clients can see is a handful of renames */
+    if (repo->sign) {
+        stats_begin(PHASE_SIGN);
+        for (size_t i = 0; i < count; ++i) {
+            if (outputs[i] && sign_database(repo, outputs[i]) < 0) {
+                discard_databases(repo, outputs, count);
+                errx(EXIT_FAILURE, "failed to sign %s", outputs[i]);
+            }
+        }
+        stats_end(PHASE_SIGN);
+    }
+
+    if (!databases_staged(repo, outputs, count)) {
+        discard_databases(repo, outputs, count);
+        errx(EXIT_FAILURE, "not publishing %s", repo->dbname);
+    }
+
+    stats_begin(PHASE_PUBLISH);
+    for (size_t i = 0; i < count; ++i) {
+        if (outputs[i])
+            publish_database(repo, outputs[i]);
+    }
+
+    check_posix(fsync(repo->rootfd), "failed to sync %s", repo->root);
+
+    if (generation) {
+        write_generation(repo, genname, generation);
+        check_posix(fsync(repo->rootfd), "failed to sync %s", repo->root);
+
+        if (config.deltas) {
+            prune_deltas(repo, repo->dbname, generation);
+            if (repo->filesname)
+                prune_deltas(repo, repo->filesname, generation);
+        }
+    }
+
+    stats_end(PHASE_PUBLISH);
+
+    /* The cache is still sorted from compile_databases */
+    if (config.index) {
+        stats_begin(PHASE_INDEX);
+        if (dbindex_write(repo->rootfd, repo->dbname, repo->cache) < 0)
+            warn("failed to write index for %s", repo->dbname);
+        stats_end(PHASE_INDEX);
+    }
     return 0;
 }
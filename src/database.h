@@ -12,4 +12,4 @@ enum contents {
 };
 
 int load_database(int fd, struct pkgcache **pkgcache);
-int write_database(struct repo *repo, const char *repo_name, enum contents what);
+int write_databases(struct repo *repo);
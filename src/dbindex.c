@@ -0,0 +1,545 @@
+#include "dbindex.h"
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <err.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "package.h"
+#include "buffer.h"
+#include "util.h"
+
+#define DBINDEX_MAGIC   "REPOSEIX"
+#define DBINDEX_VERSION 2
+#define DBINDEX_NONE    UINT32_MAX
+
+/* Give up on the perfect hash, and on writing an index, rather than
+ * search forever for a seed on some pathological set of names */
+static const uint32_t max_seed = 1u << 16;
+
+enum index_string {
+    STR_FILENAME,
+    STR_NAME,
+    STR_BASE,
+    STR_VERSION,
+    STR_DESC,
+    STR_URL,
+    STR_PACKAGER,
+    STR_SHA256SUM,
+    STR_BASE64SIG,
+    STR_ARCH,
+    STR_MAX
+};
+
+enum index_list {
+    LIST_GROUPS,
+    LIST_LICENSES,
+    LIST_REPLACES,
+    LIST_DEPENDS,
+    LIST_CONFLICTS,
+    LIST_PROVIDES,
+    LIST_OPTDEPENDS,
+    LIST_MAKEDEPENDS,
+    LIST_CHECKDEPENDS,
+    LIST_MAX
+};
+
+/* All offsets are from the start of the file, except string offsets,
+ * which are into the string table. Lists are runs of consecutive
+ * strings. The byte order is the host's: the index is a cache, not a
+ * format to ship around. */
+struct dbindex_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t count;
+    uint32_t buckets;
+    uint32_t slots;
+
+    uint64_t db_size;
+    int64_t db_mtime;
+    int64_t db_mtime_nsec;
+    uint64_t db_ino;
+
+    uint64_t records;
+    uint64_t seeds;
+    uint64_t table;
+    uint64_t strings;
+    uint64_t strings_len;
+};
+
+struct index_record {
+    uint64_t hash;
+    uint64_t size;
+    uint64_t isize;
+    int64_t builddate;
+    uint32_t str[STR_MAX];
+    struct {
+        uint32_t offset;
+        uint32_t count;
+    } list[LIST_MAX];
+};
+
+static inline char *index_name_for(const char *dbname)
+{
+    return joinstring(dbname, ".idx", NULL);
+}
+
+static inline uint64_t align8(uint64_t offset)
+{
+    return (offset + 7) & ~(uint64_t)7;
+}
+
+static uint64_t index_hash(const char *name, uint64_t seed)
+{
+    uint64_t hash = 14695981039346656037u ^ (seed * 0x9e3779b97f4a7c15u);
+    for (; *name; ++name) {
+        hash ^= (unsigned char)*name;
+        hash *= 1099511628211u;
+    }
+
+    hash ^= hash >> 32;
+    hash *= 0xd6e8feb86659fd93u;
+    hash ^= hash >> 32;
+    return hash;
+}
+
+static uint32_t put_string(struct buffer *strings, const char *str)
+{
+    if (!str)
+        return DBINDEX_NONE;
+
+    const size_t len = strlen(str);
+    const size_t offset = strings->len;
+    if (offset + len + 1 >= DBINDEX_NONE)
+        errx(EXIT_FAILURE, "database index string table overflow");
+
+    if (buffer_reserve(strings, len + 1) < 0)
+        err(EXIT_FAILURE, "failed to allocate database index");
+    memcpy(strings->data + offset, str, len + 1);
+    strings->len += len + 1;
+    return (uint32_t)offset;
+}
+
+static void put_list(struct buffer *strings, const alpm_list_t *list,
+                     uint32_t *offset, uint32_t *count)
+{
+    *offset = DBINDEX_NONE;
+    *count = 0;
+
+    for (; list; list = list->next) {
+        uint32_t str = put_string(strings, list->data);
+        if (*count == 0)
+            *offset = str;
+        *count += 1;
+    }
+}
+
+static void fill_record(struct index_record *record, struct buffer *strings,
+                        const struct pkg *pkg)
+{
+    *record = (struct index_record){
+        .hash = pkg->hash,
+        .size = pkg->size,
+        .isize = pkg->isize,
+        .builddate = pkg->builddate
+    };
+
+    record->str[STR_FILENAME]  = put_string(strings, pkg->filename);
+    record->str[STR_NAME]      = put_string(strings, pkg->name);
+    record->str[STR_BASE]      = put_string(strings, pkg->base);
+    record->str[STR_VERSION]   = put_string(strings, pkg->version);
+    record->str[STR_DESC]      = put_string(strings, pkg->desc);
+    record->str[STR_URL]       = put_string(strings, pkg->url);
+    record->str[STR_PACKAGER]  = put_string(strings, pkg->packager);
+    record->str[STR_SHA256SUM] = put_string(strings, pkg->sha256sum);
+    record->str[STR_BASE64SIG] = put_string(strings, pkg->base64sig);
+    record->str[STR_ARCH]      = put_string(strings, pkg->arch);
+
+    const alpm_list_t *lists[LIST_MAX] = {
+        [LIST_GROUPS]       = pkg->groups,
+        [LIST_LICENSES]     = pkg->licenses,
+        [LIST_REPLACES]     = pkg->replaces,
+        [LIST_DEPENDS]      = pkg->depends,
+        [LIST_CONFLICTS]    = pkg->conflicts,
+        [LIST_PROVIDES]     = pkg->provides,
+        [LIST_OPTDEPENDS]   = pkg->optdepends,
+        [LIST_MAKEDEPENDS]  = pkg->makedepends,
+        [LIST_CHECKDEPENDS] = pkg->checkdepends
+    };
+
+    for (int i = 0; i < LIST_MAX; ++i)
+        put_list(strings, lists[i], &record->list[i].offset, &record->list[i].count);
+}
+
+struct hash_bucket {
+    uint32_t id;
+    uint32_t count;
+    uint32_t *keys;
+};
+
+static int bucket_cmp(const void *p1, const void *p2)
+{
+    const struct hash_bucket *b1 = p1;
+    const struct hash_bucket *b2 = p2;
+    return (b1->count < b2->count) - (b1->count > b2->count);
+}
+
+/* Hash and displace: names are split into small buckets, and each
+ * bucket, biggest first, gets the first seed that lands all of its
+ * names in free slots. A lookup is then two hashes and one compare. */
+static int build_perfect_hash(const struct pkgcache *cache, uint32_t buckets,
+                              uint32_t slots, uint32_t *seeds, uint32_t *table)
+{
+    struct hash_bucket *bucket = calloc(buckets, sizeof(*bucket));
+    uint32_t *keys = calloc(cache->entries + 1, sizeof(uint32_t));
+    uint32_t *attempt = calloc(cache->entries + 1, sizeof(uint32_t));
+    check_null(bucket, "failed to allocate database index");
+    check_null(keys, "failed to allocate database index");
+    check_null(attempt, "failed to allocate database index");
+    int ret = 0;
+
+    for (size_t i = 0; i < cache->entries; ++i)
+        bucket[index_hash(cache->pkgs[i]->name, 0) % buckets].count++;
+
+    uint32_t *next = keys;
+    for (uint32_t b = 0; b < buckets; ++b) {
+        bucket[b].id = b;
+        bucket[b].keys = next;
+        next += bucket[b].count;
+        bucket[b].count = 0;
+    }
+
+    for (size_t i = 0; i < cache->entries; ++i) {
+        struct hash_bucket *b = &bucket[index_hash(cache->pkgs[i]->name, 0) % buckets];
+        b->keys[b->count++] = (uint32_t)i;
+    }
+
+    qsort(bucket, buckets, sizeof(*bucket), bucket_cmp);
+
+    for (uint32_t b = 0; b < buckets && bucket[b].count; ++b) {
+        const struct hash_bucket *cur = &bucket[b];
+        uint32_t seed;
+
+        for (seed = 1; seed < max_seed; ++seed) {
+            uint32_t placed = 0;
+
+            for (; placed < cur->count; ++placed) {
+                const char *name = cache->pkgs[cur->keys[placed]]->name;
+                uint32_t slot = index_hash(name, seed) % slots;
+
+                if (table[slot])
+                    break;
+                table[slot] = cur->keys[placed] + 1;
+                attempt[placed] = slot;
+            }
+
+            if (placed == cur->count)
+                break;
+
+            /* Collided: take back what this seed placed */
+            while (placed-- > 0)
+                table[attempt[placed]] = 0;
+        }
+
+        if (seed == max_seed) {
+            ret = -1;
+            break;
+        }
+        seeds[cur->id] = seed;
+    }
+
+    free(attempt);
+    free(keys);
+    free(bucket);
+    return ret;
+}
+
+static int write_all(int fd, const void *data, size_t len)
+{
+    const char *ptr = data;
+    while (len) {
+        ssize_t nbytes_w = write(fd, ptr, len);
+        if (nbytes_w < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        ptr += nbytes_w;
+        len -= nbytes_w;
+    }
+    return 0;
+}
+
+static int write_padded(int fd, const void *data, size_t len, uint64_t *offset)
+{
+    static const char zeros[8] = {0};
+    const uint64_t padding = align8(*offset) - *offset;
+
+    if (write_all(fd, zeros, padding) < 0 || write_all(fd, data, len) < 0)
+        return -1;
+
+    *offset += padding + len;
+    return 0;
+}
+
+/* Write the index for the cache as it was just written to dbname. The
+ * cache must already be sorted: records follow the database order. */
+int dbindex_write(int rootfd, const char *dbname, struct pkgcache *cache)
+{
+    struct stat st;
+    if (fstatat(rootfd, dbname, &st, 0) < 0)
+        return -1;
+
+    if (cache->entries >= DBINDEX_NONE) {
+        errno = EOVERFLOW;
+        return -1;
+    }
+
+    const uint32_t count = (uint32_t)cache->entries;
+    const uint32_t buckets = count / 4 + 1;
+    const uint32_t slots = count + count / 4 + 1;
+
+    struct index_record *records = calloc(count + 1, sizeof(*records));
+    uint32_t *seeds = calloc(buckets, sizeof(uint32_t));
+    uint32_t *table = calloc(slots, sizeof(uint32_t));
+    check_null(records, "failed to allocate database index");
+    check_null(seeds, "failed to allocate database index");
+    check_null(table, "failed to allocate database index");
+
+    struct buffer strings = {0};
+    int ret = -1;
+
+    for (uint32_t i = 0; i < count; ++i)
+        fill_record(&records[i], &strings, cache->pkgs[i]);
+    if (buffer_putc(&strings, 0) < 0)
+        err(EXIT_FAILURE, "failed to allocate database index");
+
+    if (build_perfect_hash(cache, buckets, slots, seeds, table) < 0) {
+        errno = EAGAIN;
+        goto cleanup;
+    }
+
+    struct dbindex_header header = {
+        .magic = DBINDEX_MAGIC,
+        .version = DBINDEX_VERSION,
+        .count = count,
+        .buckets = buckets,
+        .slots = slots,
+        .db_size = st.st_size,
+        .db_mtime = st.st_mtim.tv_sec,
+        .db_mtime_nsec = st.st_mtim.tv_nsec,
+        .db_ino = st.st_ino
+    };
+
+    header.records = align8(sizeof(header));
+    header.seeds = align8(header.records + (uint64_t)count * sizeof(*records));
+    header.table = align8(header.seeds + (uint64_t)buckets * sizeof(uint32_t));
+    header.strings = align8(header.table + (uint64_t)slots * sizeof(uint32_t));
+    header.strings_len = strings.len;
+
+    _cleanup_free_ char *idxname = index_name_for(dbname);
+    _cleanup_free_ char *tmpname = joinstring(idxname, ".tmp", NULL);
+    _cleanup_close_ int fd = openat(rootfd, tmpname, O_CREAT | O_WRONLY | O_TRUNC, 0644);
+    if (fd < 0)
+        goto cleanup;
+
+    uint64_t offset = 0;
+    if (write_padded(fd, &header, sizeof(header), &offset) < 0 ||
+        write_padded(fd, records, count * sizeof(*records), &offset) < 0 ||
+        write_padded(fd, seeds, buckets * sizeof(uint32_t), &offset) < 0 ||
+        write_padded(fd, table, slots * sizeof(uint32_t), &offset) < 0 ||
+        write_padded(fd, strings.data, strings.len, &offset) < 0 ||
+        fsync(fd) < 0 ||
+        renameat(rootfd, tmpname, rootfd, idxname) < 0) {
+        unlinkat(rootfd, tmpname, 0);
+        goto cleanup;
+    }
+
+    ret = 0;
+
+cleanup:
+    buffer_release(&strings);
+    free(table);
+    free(seeds);
+    free(records);
+    return ret;
+}
+
+static bool section_fits(const struct dbindex *index, uint64_t offset, uint64_t count, size_t size)
+{
+    return offset <= index->len && count <= (index->len - offset) / size;
+}
+
+/* Map the index for dbname, but only if it belongs to the database as
+ * it is on disk right now */
+int dbindex_open(struct dbindex *index, int rootfd, const char *dbname)
+{
+    *index = (struct dbindex){0};
+
+    struct stat dbst, st;
+    if (fstatat(rootfd, dbname, &dbst, 0) < 0)
+        return -1;
+
+    _cleanup_free_ char *idxname = index_name_for(dbname);
+    _cleanup_close_ int fd = openat(rootfd, idxname, O_RDONLY);
+    if (fd < 0 || fstat(fd, &st) < 0)
+        return -1;
+
+    if ((size_t)st.st_size < sizeof(struct dbindex_header)) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (map == MAP_FAILED)
+        return -1;
+
+    index->map = map;
+    index->len = st.st_size;
+    index->header = map;
+
+    const struct dbindex_header *header = index->header;
+    const bool valid = memcmp(header->magic, DBINDEX_MAGIC, sizeof(header->magic)) == 0 &&
+        header->version == DBINDEX_VERSION &&
+        header->buckets && header->slots &&
+        section_fits(index, header->records, header->count, sizeof(struct index_record)) &&
+        section_fits(index, header->seeds, header->buckets, sizeof(uint32_t)) &&
+        section_fits(index, header->table, header->slots, sizeof(uint32_t)) &&
+        section_fits(index, header->strings, header->strings_len, 1) &&
+        header->strings_len && index->map[header->strings + header->strings_len - 1] == 0;
+
+    const bool fresh = header->db_size == (uint64_t)dbst.st_size &&
+        header->db_mtime == dbst.st_mtim.tv_sec &&
+        header->db_mtime_nsec == dbst.st_mtim.tv_nsec &&
+        header->db_ino == (uint64_t)dbst.st_ino;
+
+    if (!valid || !fresh) {
+        munmap(map, index->len);
+        *index = (struct dbindex){0};
+        errno = valid ? ESTALE : EINVAL;
+        return -1;
+    }
+
+    return 0;
+}
+
+static inline const struct index_record *index_records(const struct dbindex *index)
+{
+    return (const struct index_record *)(index->map + index->header->records);
+}
+
+static char *index_string(const struct dbindex *index, uint32_t offset)
+{
+    if (offset == DBINDEX_NONE || offset >= index->header->strings_len)
+        return NULL;
+    return index->map + index->header->strings + offset;
+}
+
+static alpm_list_t *index_list(const struct dbindex *index, uint32_t offset, uint32_t count)
+{
+    const char *end = index->map + index->header->strings + index->header->strings_len;
+    alpm_list_t *list = NULL;
+
+    char *str = index_string(index, offset);
+    for (uint32_t i = 0; str && i < count; ++i) {
+        list = package_list_append(list, str);
+        str += strlen(str) + 1;
+        if (str >= end)
+            break;
+    }
+
+    return list;
+}
+
+/* Packages point straight into the mapping for their strings, so it
+ * has to stay mapped for as long as any of them are around. */
+int dbindex_load(const struct dbindex *index, struct pkgcache **cache, time_t mtime)
+{
+    const struct index_record *records = index_records(index);
+
+    /* Check everything up front so a bad index never leaves the cache
+     * half loaded */
+    for (uint32_t i = 0; i < index->header->count; ++i) {
+        const struct index_record *record = &records[i];
+        if (!index_string(index, record->str[STR_FILENAME]) ||
+            !index_string(index, record->str[STR_NAME]) ||
+            !index_string(index, record->str[STR_VERSION])) {
+            errno = EINVAL;
+            return -1;
+        }
+    }
+
+    for (uint32_t i = 0; i < index->header->count; ++i) {
+        const struct index_record *record = &records[i];
+
+        struct pkg *pkg = malloc(sizeof(pkg_t));
+        check_null(pkg, "failed to allocate package");
+        *pkg = (struct pkg){
+            .hash = record->hash,
+            .filename = index_string(index, record->str[STR_FILENAME]),
+            .name = index_string(index, record->str[STR_NAME]),
+            .base = index_string(index, record->str[STR_BASE]),
+            .version = index_string(index, record->str[STR_VERSION]),
+            .desc = index_string(index, record->str[STR_DESC]),
+            .url = index_string(index, record->str[STR_URL]),
+            .packager = index_string(index, record->str[STR_PACKAGER]),
+            .sha256sum = index_string(index, record->str[STR_SHA256SUM]),
+            .base64sig = index_string(index, record->str[STR_BASE64SIG]),
+            .arch = index_string(index, record->str[STR_ARCH]),
+            .size = record->size,
+            .isize = record->isize,
+            .builddate = record->builddate,
+            .mtime = mtime
+        };
+
+        alpm_list_t **lists[LIST_MAX] = {
+            [LIST_GROUPS]       = &pkg->groups,
+            [LIST_LICENSES]     = &pkg->licenses,
+            [LIST_REPLACES]     = &pkg->replaces,
+            [LIST_DEPENDS]      = &pkg->depends,
+            [LIST_CONFLICTS]    = &pkg->conflicts,
+            [LIST_PROVIDES]     = &pkg->provides,
+            [LIST_OPTDEPENDS]   = &pkg->optdepends,
+            [LIST_MAKEDEPENDS]  = &pkg->makedepends,
+            [LIST_CHECKDEPENDS] = &pkg->checkdepends
+        };
+
+        for (int l = 0; l < LIST_MAX; ++l)
+            *lists[l] = index_list(index, record->list[l].offset, record->list[l].count);
+
+        struct pkg *old;
+        *cache = pkgcache_add(*cache, pkg, &old);
+        if (old) {
+            warnx("index lists %s twice, keeping %s", old->name, pkg->version);
+            package_free(old);
+        }
+    }
+
+    return 0;
+}
+
+/* Look a package up by name without loading anything: returns its
+ * version, or NULL if the index doesn't have it */
+const char *dbindex_lookup(const struct dbindex *index, const char *name)
+{
+    const struct dbindex_header *header = index->header;
+    const uint32_t *seeds = (const uint32_t *)(index->map + header->seeds);
+    const uint32_t *table = (const uint32_t *)(index->map + header->table);
+
+    const uint32_t seed = seeds[index_hash(name, 0) % header->buckets];
+    const uint32_t idx = table[index_hash(name, seed) % header->slots];
+    if (!idx || idx > header->count)
+        return NULL;
+
+    const struct index_record *record = &index_records(index)[idx - 1];
+    const char *found = index_string(index, record->str[STR_NAME]);
+    if (!found || !streq(found, name))
+        return NULL;
+
+    return index_string(index, record->str[STR_VERSION]);
+}
@@ -0,0 +1,24 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <time.h>
+#include "pkgcache.h"
+
+struct dbindex_header;
+
+/* A sidecar to the database, <database>.idx, holding the same package
+ * metadata laid out to be mapped in and used directly: no
+ * decompression, no parsing. It records the size, mtime and inode of
+ * the database it was written alongside, and is ignored as soon as
+ * those no longer match. */
+struct dbindex {
+    char *map;
+    size_t len;
+    const struct dbindex_header *header;
+};
+
+int dbindex_write(int rootfd, const char *dbname, struct pkgcache *cache);
+int dbindex_open(struct dbindex *index, int rootfd, const char *dbname);
+int dbindex_load(const struct dbindex *index, struct pkgcache **cache, time_t mtime);
+const char *dbindex_lookup(const struct dbindex *index, const char *name);
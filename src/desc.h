@@ -6,10 +6,13 @@
 #include "package.h"
 
 struct archive;
+struct buffer;
+struct filelist;
 
 struct desc_parser {
     int cs;
     enum pkg_entry entry;
+    const char *mark;
     size_t pos;
     char store[LINE_MAX];
 };
@@ -18,3 +21,16 @@ void desc_parser_init(struct desc_parser *parser);
 ssize_t desc_parser_feed(struct desc_parser *parser, struct pkg *pkg,
                       char *buf, size_t buf_len);
 ssize_t read_desc(struct archive *archive, struct pkg *pkg);
+
+void write_list(struct buffer *buf, const char *header, const alpm_list_t *lst);
+void write_filelist(struct buffer *buf, const char *header, const struct filelist *files);
+void write_string(struct buffer *buf, const char *header, const char *str);
+void write_size(struct buffer *buf, const char *header, size_t val);
+void write_time(struct buffer *buf, const char *header, time_t val);
+
+#define write_entry(buf, header, val) _Generic((val), \
+    alpm_list_t *: write_list, \
+    struct filelist *: write_filelist, \
+    char *: write_string, \
+    size_t: write_size, \
+    time_t: write_time)(buf, header, val)
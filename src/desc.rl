@@ -1,24 +1,44 @@
 #include "desc.h"
 
+#include <string.h>
 #include <err.h>
+#include <archive.h>
 #include "package.h"
 #include "util.h"
 
 %%{
     machine desc;
 
-    action store {
-        parser->store[parser->pos++] = fc;
-        if (parser->pos == LINE_MAX) {
-            errx(1, "desc line too long");
-        }
+    action mark {
+        parser->mark = fpc;
+    }
+
+    action scan {
+        /* Most of a database is plain value lines, file lists
+           especially. Rather than walk them a byte at a time, find
+           the end of the line with memchr and skip straight to it. A
+           stray '%' is left for the machine to reject. */
+        char *end = memchr(fpc, '\n', pe - fpc);
+        if (!end)
+            end = pe;
+
+        char *percent = memchr(fpc, '%', end - fpc);
+        fexec percent ? percent : end;
     }
 
     action emit {
-        const char *entry = parser->store;
-        const size_t entry_len = parser->pos;
-        parser->store[parser->pos] = 0;
-        parser->pos = 0;
+        const char *entry = parser->mark;
+        size_t entry_len = fpc - parser->mark;
+        parser->mark = NULL;
+
+        if (parser->pos) {
+            /* The value started in an earlier block and was saved off
+               to the store. Finish it off there. */
+            desc_store(parser, entry, entry_len);
+            entry = parser->store;
+            entry_len = parser->pos;
+            parser->pos = 0;
+        }
 
         package_set(pkg, parser->entry, entry, entry_len);
     }
@@ -49,13 +69,24 @@
            | '%DELTAS%'       %{ parser->entry = PKG_FILES; };
 
       section = header '\n';
-      contents = [^%\n]+ @store %emit '\n';
+      contents = [^%\n]+ >mark $scan %emit '\n';
 
       main := ( section contents* '\n' | '\n' )*;
 }%%
 
 %%write data nofinal;
 
+static void desc_store(struct desc_parser *parser, const char *data, size_t len)
+{
+    if (parser->pos + len >= LINE_MAX) {
+        errx(1, "desc line too long");
+    }
+
+    memcpy(&parser->store[parser->pos], data, len);
+    parser->pos += len;
+    parser->store[parser->pos] = 0;
+}
+
 void desc_parser_init(struct desc_parser *parser)
 {
     *parser = (struct desc_parser){0};
@@ -69,6 +100,12 @@ ssize_t desc_parser_feed(struct desc_parser *parser, struct pkg *pkg,
     char *p = buf;
     char *pe = p + buf_len;
 
+    /* Values are handed to package_set straight out of the buffer. If
+       one was cut short by the end of the last block its start is in
+       the store, and the rest of it starts right here. */
+    if (parser->pos)
+        parser->mark = buf;
+
     %%access parser->;
     %%write exec;
 
@@ -76,6 +113,11 @@ ssize_t desc_parser_feed(struct desc_parser *parser, struct pkg *pkg,
     if (parser->cs == desc_error)
         return -1;
 
+    if (parser->mark) {
+        desc_store(parser, parser->mark, pe - parser->mark);
+        parser->mark = NULL;
+    }
+
     return buf_len;
 }
 
@@ -88,7 +130,11 @@ ssize_t read_desc(struct archive *archive, struct pkg *pkg)
 
     for (;;) {
         size_t bufsize;
-        archive_read(archive, &buf, &bufsize);
+        int status = archive_read(archive, &buf, &bufsize);
+        if (status == ARCHIVE_EOF)
+            break;
+        if (status < ARCHIVE_WARN)
+            return -1;
 
         ssize_t result = desc_parser_feed(&parser, pkg, buf, bufsize);
         if (result < 0) {
@@ -96,8 +142,6 @@ ssize_t read_desc(struct archive *archive, struct pkg *pkg)
         } else {
             nbytes_r += result;
         }
-
-        break;
     }
 
     return nbytes_r;
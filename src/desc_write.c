@@ -0,0 +1,49 @@
+#include "desc.h"
+
+#include "buffer.h"
+#include "filelist.h"
+
+void write_list(struct buffer *buf, const char *header, const alpm_list_t *lst)
+{
+    if (lst == NULL)
+        return;
+
+    buffer_printf(buf, "%%%s%%\n", header);
+    for (; lst; lst = lst->next)
+        buffer_printf(buf, "%s\n", (const char *)lst->data);
+    buffer_putc(buf, '\n');
+}
+
+void write_filelist(struct buffer *buf, const char *header, const struct filelist *files)
+{
+    if (files == NULL)
+        return;
+
+    struct filelist_iter iter;
+    filelist_iter_init(&iter, files);
+
+    buffer_printf(buf, "%%%s%%\n", header);
+    for (const char *path; (path = filelist_next(&iter));)
+        buffer_printf(buf, "%s\n", path);
+    buffer_putc(buf, '\n');
+
+    filelist_iter_free(&iter);
+}
+
+void write_string(struct buffer *buf, const char *header, const char *str)
+{
+    if (str == NULL)
+        return;
+
+    buffer_printf(buf, "%%%s%%\n%s\n\n", header, str);
+}
+
+void write_size(struct buffer *buf, const char *header, size_t val)
+{
+    buffer_printf(buf, "%%%s%%\n%zd\n\n", header, val);
+}
+
+void write_time(struct buffer *buf, const char *header, time_t val)
+{
+    buffer_printf(buf, "%%%s%%\n%ld\n\n", header, val);
+}
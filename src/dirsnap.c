@@ -0,0 +1,213 @@
+#include "dirsnap.h"
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <errno.h>
+#include <err.h>
+
+#include "jobs.h"
+#include "util.h"
+
+struct stat_job {
+    int dirfd;
+    struct dirsnap *snap;
+};
+
+static uint64_t name_hash(const char *name)
+{
+    uint64_t hash = 14695981039346656037u;
+    for (; *name; ++name) {
+        hash ^= (unsigned char)*name;
+        hash *= 1099511628211u;
+    }
+    return hash;
+}
+
+static void stat_entry(void *data, size_t idx)
+{
+    struct stat_job *job = data;
+    struct dirsnap_entry *entry = &job->snap->entries[idx];
+
+    entry->has_stat = fstatat(job->dirfd, entry->name, &entry->st, 0) == 0;
+}
+
+/* Index table into the entries array, offset by one so zero means an
+ * empty slot. Kept at most half full. */
+static void build_table(struct dirsnap *snap)
+{
+    free(snap->table);
+    snap->buckets = 16;
+    while (snap->buckets < snap->count * 2)
+        snap->buckets *= 2;
+
+    snap->table = calloc(snap->buckets, sizeof(size_t));
+    check_null(snap->table, "failed to allocate directory snapshot");
+
+    for (size_t i = 0; i < snap->count; ++i) {
+        size_t slot = name_hash(snap->entries[i].name) & (snap->buckets - 1);
+        while (snap->table[slot])
+            slot = (slot + 1) & (snap->buckets - 1);
+        snap->table[slot] = i + 1;
+    }
+}
+
+int dirsnap_load(struct dirsnap *snap, int dirfd, int jobs)
+{
+    *snap = (struct dirsnap){0};
+
+    int dupfd = dup(dirfd);
+    if (dupfd < 0)
+        return -1;
+
+    DIR *dirp = fdopendir(dupfd);
+    if (!dirp) {
+        close(dupfd);
+        return -1;
+    }
+    rewinddir(dirp);
+
+    size_t size = 0;
+    for (const struct dirent *dp = readdir(dirp); dp; dp = readdir(dirp)) {
+        if (dp->d_type != DT_REG && dp->d_type != DT_LNK && dp->d_type != DT_UNKNOWN)
+            continue;
+
+        if (snap->count == size) {
+            size = size ? size * 2 : 64;
+            snap->entries = realloc(snap->entries, size * sizeof(*snap->entries));
+            check_null(snap->entries, "failed to allocate directory snapshot");
+        }
+
+        snap->entries[snap->count++] = (struct dirsnap_entry){
+            .name = strdup(dp->d_name),
+            .symlink = dp->d_type == DT_LNK
+        };
+    }
+    closedir(dirp);
+
+    struct stat_job job = { .dirfd = dirfd, .snap = snap };
+    run_jobs(jobs, snap->count, stat_entry, &job);
+
+    /* Only keep what turned out to be, or point to, regular files */
+    size_t count = 0;
+    for (size_t i = 0; i < snap->count; ++i) {
+        struct dirsnap_entry *entry = &snap->entries[i];
+
+        if (entry->has_stat && S_ISREG(entry->st.st_mode))
+            snap->entries[count++] = *entry;
+        else
+            free(entry->name);
+    }
+    snap->count = count;
+
+    build_table(snap);
+    return 0;
+}
+
+void dirsnap_free(struct dirsnap *snap)
+{
+    for (size_t i = 0; i < snap->count; ++i)
+        free(snap->entries[i].name);
+    free(snap->entries);
+    free(snap->table);
+    *snap = (struct dirsnap){0};
+}
+
+static size_t find_index(const struct dirsnap *snap, const char *name)
+{
+    if (!snap->table)
+        return 0;
+
+    size_t slot = name_hash(name) & (snap->buckets - 1);
+    for (size_t idx; (idx = snap->table[slot]); slot = (slot + 1) & (snap->buckets - 1)) {
+        if (streq(snap->entries[idx - 1].name, name))
+            return idx;
+    }
+
+    return 0;
+}
+
+const struct dirsnap_entry *dirsnap_find(const struct dirsnap *snap, const char *name)
+{
+    size_t idx = find_index(snap, name);
+    return idx ? &snap->entries[idx - 1] : NULL;
+}
+
+static void append_entry(struct dirsnap *snap, const struct dirsnap_entry *entry)
+{
+    snap->entries = realloc(snap->entries, (snap->count + 1) * sizeof(*snap->entries));
+    check_null(snap->entries, "failed to allocate directory snapshot");
+
+    snap->entries[snap->count] = *entry;
+    snap->entries[snap->count].name = strdup(entry->name);
+    snap->count++;
+}
+
+/* Bring the named entries back in line with the directory: stat each
+ * one again, adding, updating or dropping it as needed. Names must be
+ * unique. */
+void dirsnap_refresh(struct dirsnap *snap, int dirfd, char *const *names, size_t count)
+{
+    bool removed = false;
+
+    for (size_t i = 0; i < count; ++i) {
+        struct dirsnap_entry fresh = { .name = names[i], .has_stat = true };
+        struct stat lst;
+
+        const bool present = fstatat(dirfd, fresh.name, &fresh.st, 0) == 0 &&
+            S_ISREG(fresh.st.st_mode);
+        fresh.symlink = present &&
+            fstatat(dirfd, fresh.name, &lst, AT_SYMLINK_NOFOLLOW) == 0 &&
+            S_ISLNK(lst.st_mode);
+
+        const size_t idx = find_index(snap, fresh.name);
+        if (idx && present) {
+            struct dirsnap_entry *entry = &snap->entries[idx - 1];
+            entry->symlink = fresh.symlink;
+            entry->st = fresh.st;
+        } else if (idx) {
+            struct dirsnap_entry *entry = &snap->entries[idx - 1];
+            free(entry->name);
+            entry->name = NULL;
+            removed = true;
+        } else if (present) {
+            append_entry(snap, &fresh);
+        }
+    }
+
+    if (removed) {
+        size_t kept = 0;
+        for (size_t i = 0; i < snap->count; ++i) {
+            if (snap->entries[i].name)
+                snap->entries[kept++] = snap->entries[i];
+        }
+        snap->count = kept;
+    }
+
+    build_table(snap);
+}
+
+/* A snapshot of just the named entries of another, for when only a few
+ * files are worth looking at. Names must be unique. */
+void dirsnap_subset(struct dirsnap *subset, const struct dirsnap *snap,
+                    char *const *names, size_t count)
+{
+    *subset = (struct dirsnap){0};
+
+    for (size_t i = 0; i < count; ++i) {
+        const struct dirsnap_entry *entry = dirsnap_find(snap, names[i]);
+        if (entry)
+            append_entry(subset, entry);
+    }
+
+    build_table(subset);
+}
+
+const struct stat *dirsnap_stat(const struct dirsnap *snap, const char *name)
+{
+    const struct dirsnap_entry *entry = dirsnap_find(snap, name);
+    return entry ? &entry->st : NULL;
+}
@@ -0,0 +1,31 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/stat.h>
+
+/* One readdir pass over a directory, with every regular file stat'ed
+ * up front, so the rest of a run can ask about files in it without
+ * going back to the filesystem. */
+struct dirsnap_entry {
+    char *name;
+    bool symlink;
+    bool has_stat;
+    struct stat st;
+};
+
+struct dirsnap {
+    struct dirsnap_entry *entries;
+    size_t count;
+    size_t *table;
+    size_t buckets;
+};
+
+int dirsnap_load(struct dirsnap *snap, int dirfd, int jobs);
+void dirsnap_free(struct dirsnap *snap);
+void dirsnap_refresh(struct dirsnap *snap, int dirfd, char *const *names, size_t count);
+void dirsnap_subset(struct dirsnap *subset, const struct dirsnap *snap,
+                    char *const *names, size_t count);
+
+const struct dirsnap_entry *dirsnap_find(const struct dirsnap *snap, const char *name);
+const struct stat *dirsnap_stat(const struct dirsnap *snap, const char *name);
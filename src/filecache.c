@@ -6,25 +6,27 @@
 #include <string.h>
 #include <fcntl.h>
 #include <unistd.h>
-#include <dirent.h>
 #include <errno.h>
+#include <err.h>
+#include <sys/stat.h>
 #include <alpm.h>
 
+#include "repose.h"
+#include "jobs.h"
 #include "package.h"
 #include "pkgcache.h"
 #include "filters.h"
+#include "statcache.h"
+#include "dirsnap.h"
+#include "filelist.h"
+#include "signing.h"
 #include "util.h"
 
-static inline bool is_file(int d_type)
-{
-    return d_type == DT_REG || d_type == DT_UNKNOWN;
-}
-
 static inline struct pkgcache *filecache_add(struct pkgcache *cache, struct pkg *pkg)
 {
     struct pkg *old = pkgcache_find(cache, pkg->name);
     if (!old) {
-        return pkgcache_add(cache, pkg);
+        return pkgcache_add(cache, pkg, NULL);
     }
 
     int vercmp = alpm_pkg_vercmp(pkg->version, old->version);
@@ -35,81 +37,481 @@ static inline struct pkgcache *filecache_add(struct pkgcache *cache, struct pkg
     return cache;
 }
 
-static size_t get_filecache_size(DIR *dirp)
+struct scan_result {
+    struct pkg *pkg;
+    struct statcache_entry *cached;
+    struct stat st;
+    char *record;
+    size_t record_len;
+    time_t sig_mtime;
+    bool files;
+    bool taken;
+};
+
+struct scan_job {
+    int dirfd;
+    struct pool_view *views;
+    size_t nviews;
+    struct statcache *statcache;
+
+    /* Whether any view, in which case which ones, is going to write a
+     * files database out of the scan */
+    bool files;
+    bool *view_files;
+
+    /* Candidate packages, each paired with its signature, if any */
+    const struct dirsnap_entry **entries;
+    const struct dirsnap_entry **sigs;
+    struct scan_result *results;
+    size_t count;
+
+    /* Which views want each result, nviews flags per candidate */
+    bool *wanted;
+};
+
+static void scan_job_free(struct scan_job *job)
+{
+    free(job->entries);
+    free(job->sigs);
+    free(job->results);
+    free(job->wanted);
+    free(job->view_files);
+}
+
+static bool is_signature(const char *filename)
+{
+    const char *ext = strrchr(filename, '.');
+    return ext && streq(ext, ".sig");
+}
+
+/* With the root doubling as the pool, a repo's databases, and the
+ * caches, generations, deltas and staged writes kept next to them, sit
+ * alongside the packages */
+static bool is_repo_file(const struct scan_job *job, const char *name)
 {
-    struct dirent *dp;
-    size_t size = 0;
+    for (size_t i = 0; i < job->nviews; ++i) {
+        const struct repo *repo = job->views[i].repo;
+        if (repo->pool || !repo->rootname)
+            continue;
 
-    for (dp = readdir(dirp); dp; dp = readdir(dirp)) {
-        if (is_file(dp->d_type))
-            ++size;
+        const size_t len = strlen(repo->rootname);
+        if (strncmp(name, repo->rootname, len) == 0 && name[len] == '.')
+            return true;
     }
+    return false;
+}
 
-    rewinddir(dirp);
-    return size;
+/* Sort the pool snapshot into packages and signatures up front, so the
+ * workers never have to go looking for a package's signature. */
+static void collect_entries(struct scan_job *job, const struct dirsnap *snap)
+{
+    const size_t size = snap->count ? snap->count : 1;
+    job->entries = calloc(size, sizeof(*job->entries));
+    job->sigs = calloc(size, sizeof(*job->sigs));
+    check_null(job->entries, "failed to allocate filecache entries");
+    check_null(job->sigs, "failed to allocate filecache entries");
+
+    for (size_t i = 0; i < snap->count; ++i) {
+        const struct dirsnap_entry *entry = &snap->entries[i];
+
+        /* Symlinks are what we put in the repo, not packages */
+        if (entry->symlink || is_signature(entry->name) || is_repo_file(job, entry->name))
+            continue;
+
+        _cleanup_free_ char *signame = joinstring(entry->name, ".sig", NULL);
+        job->entries[job->count] = entry;
+        job->sigs[job->count] = dirsnap_find(snap, signame);
+        job->count++;
+    }
+
+    job->results = calloc(job->count ? job->count : 1, sizeof(struct scan_result));
+    check_null(job->results, "failed to allocate filecache entries");
 }
 
-static struct pkg *load_from_file(int dirfd, const char *filename)
+/* The name, version and arch fields all share the same memory */
+struct filename_info {
+    char *name;
+    char *version;
+    char *arch;
+};
+
+/* Split a package filename of the form name-pkgver-pkgrel-arch.pkg.tar.*
+ * into its parts, without having to open the package itself. */
+static int parse_package_filename(const char *filename, struct filename_info *info)
 {
-    _cleanup_close_ int pkgfd = openat(dirfd, filename, O_RDONLY);
-    check_posix(pkgfd, "failed to open %s", filename);
+    info->name = strdup(filename);
 
-    struct pkg *pkg = malloc(sizeof(pkg_t));
-    *pkg = (struct pkg){ .filename = strdup(filename) };
+    char *ext = strstr(info->name, ".pkg.tar");
+    if (!ext)
+        return -EINVAL;
+    *ext = '\0';
 
-    if (load_package(pkg, pkgfd) < 0) {
-        package_free(pkg);
+    char *arch = strrchr(info->name, '-');
+    if (!arch)
+        return -EINVAL;
+    *arch = '\0';
+
+    char *dash = memrchr(info->name, '-', arch - info->name);
+    if (dash)
+        dash = memrchr(info->name, '-', dash - info->name);
+    if (!dash || dash == info->name)
+        return -EINVAL;
+    *dash = '\0';
+
+    info->version = dash + 1;
+    info->arch = arch + 1;
+    return 0;
+}
+
+static bool is_up_to_date(struct pkgcache *known, const struct dirsnap_entry *entry,
+                          const struct dirsnap_entry *sig, const struct filename_info *info)
+{
+    struct pkg *old = pkgcache_find(known, info->name);
+    if (!old || !streq(old->version, info->version) || !streq(old->filename, entry->name))
+        return false;
+
+    if (entry->st.st_mtime > old->mtime)
+        return false;
+
+    /* A new or updated signature still needs to be picked up */
+    if (sig)
+        return old->base64sig && sig->st.st_mtime <= old->mtime;
+    return true;
+}
+
+static bool view_wants_file(const struct pool_view *view, const struct dirsnap_entry *entry,
+                            const struct dirsnap_entry *sig, const struct filename_info *info)
+{
+    if (view->arch && !streq(info->arch, view->arch) && !streq(info->arch, "any"))
+        return false;
+
+    if (view->targets) {
+        struct pkg pkg = {
+            .filename = entry->name,
+            .name = info->name,
+            .version = info->version
+        };
+
+        if (!match_targets(&pkg, view->targets))
+            return false;
+    }
+
+    struct pkgcache *known = view->repo->cache;
+    return !known || !is_up_to_date(known, entry, sig, info);
+}
+
+/* Decide from the filename alone whether a file is worth opening: it
+ * is if any one view wants it, and its file list is only worth reading
+ * if one of those views writes a files database. Any file that doesn't
+ * follow the package naming scheme is still opened, so we don't miss
+ * oddly named packages. */
+static bool prefilter_file(struct scan_job *job, const struct dirsnap_entry *entry,
+                           const struct dirsnap_entry *sig, struct scan_result *result)
+{
+    struct filename_info info;
+    bool ret = true;
+
+    result->files = job->files;
+    if (parse_package_filename(entry->name, &info) < 0)
+        goto cleanup;
+
+    ret = false;
+    result->files = false;
+    for (size_t i = 0; i < job->nviews; ++i) {
+        if (view_wants_file(&job->views[i], entry, sig, &info)) {
+            ret = true;
+            result->files |= job->view_files[i];
+        }
+    }
+
+cleanup:
+    free(info.name);
+    return ret;
+}
+
+/* Check a package against its signature before anything is read out
+ * of it. A signature already verified against this exact file, going
+ * by the statcache, isn't checked again. */
+static int verify_package(const char *filename, int pkgfd, int sigfd,
+                          time_t sig_mtime, struct scan_result *result)
+{
+    if (sigfd < 0) {
+        warnx("%s is not signed, skipping", filename);
+        return -1;
+    }
+
+    if (!statcache_entry_verified(result->cached, &result->st, sig_mtime)) {
+        if (gpgme_verify_fd(pkgfd, sigfd, filename) < 0) {
+            warnx("%s has an invalid signature, skipping", filename);
+            return -1;
+        }
+    }
+
+    result->sig_mtime = sig_mtime;
+    return 0;
+}
+
+static int open_pool_file(int dirfd, const char *filename)
+{
+    int fd = openat(dirfd, filename, O_RDONLY);
+    if (fd < 0 && errno != ENOENT)
+        err(EXIT_FAILURE, "failed to open %s", filename);
+    return fd;
+}
+
+/* The package, and its signature, are opened once. Verifying, parsing
+ * and checksumming all go through those descriptors, and the statcache
+ * is keyed on what they fstat to rather than on the snapshot, so a file
+ * swapped in after the snapshot was taken is judged on its own. */
+static struct pkg *load_from_file(struct scan_job *job, const struct dirsnap_entry *entry,
+                                  const struct dirsnap_entry *sig, struct scan_result *result)
+{
+    struct statcache *statcache = job->statcache;
+    const char *filename = entry->name;
+    struct pkg *pkg = NULL;
+    bool fresh = false;
+
+    /* Gone since the snapshot was taken: there's nothing to add */
+    _cleanup_close_ int pkgfd = open_pool_file(job->dirfd, filename);
+    if (pkgfd < 0)
+        return NULL;
+
+    _cleanup_close_ int sigfd = sig ? open_pool_file(job->dirfd, sig->name) : -1;
+    time_t sig_mtime = 0;
+
+    check_posix(fstat(pkgfd, &result->st), "failed to stat %s", filename);
+    if (sigfd >= 0) {
+        struct stat st;
+        check_posix(fstat(sigfd, &st), "failed to stat %s", sig->name);
+        sig_mtime = st.st_mtime;
+    }
+
+    if (statcache)
+        result->cached = statcache_find(statcache, filename);
+
+    if (config.verify && verify_package(filename, pkgfd, sigfd, sig_mtime, result) < 0)
         return NULL;
+
+    if (result->cached) {
+        pkg = statcache_entry_load(result->cached, &result->st);
+
+        /* An entry recorded before we wanted file lists is no good,
+         * and one recorded with them has more than we're after */
+        if (pkg && result->files && !pkg->files) {
+            package_free(pkg);
+            pkg = NULL;
+        } else if (pkg && !result->files && pkg->files) {
+            filelist_free(pkg->files);
+            pkg->files = NULL;
+        }
+    }
+
+    if (!pkg) {
+        pkg = malloc(sizeof(pkg_t));
+        check_null(pkg, "failed to allocate package");
+        *pkg = (struct pkg){0};
+        package_set(pkg, PKG_FILENAME, filename, strlen(filename));
+
+        if (load_package(pkg, pkgfd, result->files) < 0) {
+            package_free(pkg);
+            return NULL;
+        }
+        fresh = true;
     }
 
-    if (load_package_signature(pkg, dirfd) < 0 && errno != ENOENT) {
+    if (sigfd >= 0 && load_package_signature(pkg, sigfd) < 0) {
         package_free(pkg);
         return NULL;
     }
 
+    /* Unsigned packages are identified by their checksum instead. Work
+     * it out here while the file is still hot in the page cache, rather
+     * than stalling the database writer on it later. */
+    if (!pkg->base64sig && !pkg->sha256sum) {
+        _cleanup_free_ char *sha256sum = sha256_fd(pkgfd);
+        check_null(sha256sum, "failed to checksum %s", filename);
+        package_set(pkg, PKG_SHA256SUM, sha256sum, strlen(sha256sum));
+        fresh = true;
+    }
+
+    /* Anything we had to read the file for is worth remembering */
+    if (statcache && fresh)
+        result->record = statcache_record(pkg, &result->record_len);
+
     return pkg;
 }
 
-static struct pkgcache *scan_for_targets(struct pkgcache *cache, int dirfd, DIR *dirp,
-                                        alpm_list_t *targets, const char *arch)
+/* Runs on the worker threads. Each job only ever touches its own slot,
+ * so no locking is needed until the results are merged. */
+static void scan_file(void *data, size_t idx)
 {
-    const struct dirent *dp;
+    struct scan_job *job = data;
+    struct scan_result *result = &job->results[idx];
 
-    for (dp = readdir(dirp); dp; dp = readdir(dirp)) {
-        if (!is_file(dp->d_type))
-            continue;
+    const struct dirsnap_entry *entry = job->entries[idx];
+    const struct dirsnap_entry *sig = job->sigs[idx];
 
-        struct pkg *pkg = load_from_file(dirfd, dp->d_name);
-        if (!pkg)
-            continue;
+    if (!prefilter_file(job, entry, sig, result)) {
+        /* The file is still around, so keep its cache entry alive */
+        struct statcache_entry *cached = statcache_find(job->statcache, entry->name);
+        if (cached)
+            cached->seen = true;
+        return;
+    }
 
-        if (targets && !match_targets(pkg, targets)) {
-            package_free(pkg);
-            continue;
-        }
+    struct pkg *pkg = load_from_file(job, entry, sig, result);
+    if (!pkg)
+        return;
 
-        if (arch && !match_arch(pkg, arch)) {
-            package_free(pkg);
+    bool *wanted = &job->wanted[idx * job->nviews];
+    bool any = false;
+
+    for (size_t i = 0; i < job->nviews; ++i) {
+        const struct pool_view *view = &job->views[i];
+
+        wanted[i] = (!view->targets || match_targets(pkg, view->targets)) &&
+            (!view->arch || match_arch(pkg, view->arch));
+        any |= wanted[i];
+    }
+
+    if (!any) {
+        package_free(pkg);
+        return;
+    }
+
+    result->pkg = pkg;
+}
+
+static void update_statcache(struct scan_job *job)
+{
+    /* Refresh stale entries in place first: appending new entries may
+     * move the array out from under the cached entry pointers. */
+    for (size_t i = 0; i < job->count; ++i) {
+        struct scan_result *result = &job->results[i];
+        struct statcache_entry *entry = result->cached;
+
+        if (!entry)
             continue;
+
+        if (result->record)
+            entry = statcache_put(job->statcache, entry, job->entries[i]->name,
+                                  &result->st, result->record, result->record_len);
+        if (result->sig_mtime)
+            statcache_set_verified(job->statcache, entry, result->sig_mtime);
+    }
+
+    for (size_t i = 0; i < job->count; ++i) {
+        struct scan_result *result = &job->results[i];
+
+        if (result->record && !result->cached) {
+            struct statcache_entry *entry =
+                statcache_put(job->statcache, NULL, job->entries[i]->name,
+                              &result->st, result->record, result->record_len);
+            if (result->sig_mtime)
+                statcache_set_verified(job->statcache, entry, result->sig_mtime);
         }
+    }
+
+    statcache_finish(job->statcache);
+}
+
+static void scan_for_targets(struct scan_job *job)
+{
+    run_jobs(config.jobs, job->count, scan_file, job);
 
-        cache = filecache_add(cache, pkg);
+    /* Merge in directory order, same as a serial scan would, so the
+     * newest-version dedupe picks the same package every time. Views
+     * writing a files database go first: a package that reaches any
+     * other view untaken isn't wanted with its file list anywhere. */
+    for (size_t pass = 0; pass < 2; ++pass) {
+        for (size_t v = 0; v < job->nviews; ++v) {
+            struct pool_view *view = &job->views[v];
+            const bool files = job->view_files[v];
+
+            if (files != (pass == 0))
+                continue;
+
+            for (size_t i = 0; i < job->count; ++i) {
+                struct scan_result *result = &job->results[i];
+                if (!result->pkg || !job->wanted[i * job->nviews + v])
+                    continue;
+
+                /* Every repo needs a package of its own to take
+                 * ownership of */
+                struct pkg *pkg = result->pkg;
+                if (result->taken) {
+                    pkg = package_copy(result->pkg, files);
+                } else if (!files && pkg->files) {
+                    filelist_free(pkg->files);
+                    pkg->files = NULL;
+                }
+
+                result->taken = true;
+                view->filecache = filecache_add(view->filecache, pkg);
+            }
+        }
     }
 
-    return cache;
+    if (job->statcache)
+        update_statcache(job);
 }
 
-struct pkgcache *get_filecache(int dirfd, alpm_list_t *targets, const char *arch)
+/* Scan the packages in snap once on behalf of several repos sharing the
+ * pool. Each package is only ever opened once, however many of the
+ * views end up wanting it. */
+void get_filecaches(struct pool_view *views, size_t count, int poolfd,
+                    const struct dirsnap *snap, struct statcache *statcache)
 {
-    int dupfd = dup(dirfd);
-    check_posix(dupfd, "failed to duplicate fd");
-    check_posix(lseek(dupfd, 0, SEEK_SET), "failed to lseek");
+    struct scan_job job = {
+        .dirfd = poolfd,
+        .views = views,
+        .nviews = count,
+        .statcache = statcache
+    };
+
+    /* Streaming leaves file lists to be read as the files database is
+     * written, rather than holding every one of them until then */
+    job.view_files = calloc(count ? count : 1, sizeof(bool));
+    check_null(job.view_files, "failed to allocate filecache entries");
+    for (size_t i = 0; i < count; ++i) {
+        job.view_files[i] = views[i].repo->filesname && !config.stream;
+        job.files |= job.view_files[i];
+    }
 
-    _cleanup_closedir_ DIR *dirp = fdopendir(dupfd);
-    check_null(dirp, "fdopendir failed");
+    collect_entries(&job, snap);
+    job.wanted = calloc(job.count ? job.count * count : 1, sizeof(bool));
+    check_null(job.wanted, "failed to allocate filecache entries");
+
+    for (size_t i = 0; i < count; ++i) {
+        views[i].filecache = pkgcache_create(job.count);
+        check_null(views[i].filecache, "failed to allocate filecache");
+    }
+
+    scan_for_targets(&job);
+    scan_job_free(&job);
+}
+
+/* Scan the packages in snap, or the whole pool if there's no snapshot
+ * to go by */
+struct pkgcache *get_filecache(struct repo *repo, const struct dirsnap *snap,
+                               alpm_list_t *targets, const char *arch)
+{
+    struct dirsnap local = {0};
+    if (!snap)
+        snap = repo->poolsnap;
+    if (!snap) {
+        check_posix(dirsnap_load(&local, repo->poolfd, config.jobs),
+                    "failed to read pool directory");
+        snap = &local;
+    }
 
-    size_t size = get_filecache_size(dirp);
-    struct pkgcache *cache = pkgcache_create(size);
+    struct pool_view view = {
+        .repo = repo,
+        .targets = targets,
+        .arch = arch
+    };
 
-    return scan_for_targets(cache, dirfd, dirp, targets, arch);
+    get_filecaches(&view, 1, repo->poolfd, snap, repo->statcache);
+    dirsnap_free(&local);
+    return view.filecache;
 }
@@ -1,6 +1,23 @@
 #pragma once
 
+#include <stddef.h>
 #include <alpm_list.h>
 #include "pkgcache.h"
 
-struct pkgcache *get_filecache(int dirfd, alpm_list_t *targets, const char *arch);
+struct repo;
+struct dirsnap;
+struct statcache;
+
+/* One repository's share of a pool scan: the packages in the pool it
+ * wants, going by its targets and architecture, end up in filecache. */
+struct pool_view {
+    struct repo *repo;
+    alpm_list_t *targets;
+    const char *arch;
+    struct pkgcache *filecache;
+};
+
+struct pkgcache *get_filecache(struct repo *repo, const struct dirsnap *snap,
+                               alpm_list_t *targets, const char *arch);
+void get_filecaches(struct pool_view *views, size_t count, int poolfd,
+                    const struct dirsnap *snap, struct statcache *statcache);
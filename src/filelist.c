@@ -0,0 +1,165 @@
+#include "filelist.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <err.h>
+
+static void *reserve(void *data, size_t *size, size_t need)
+{
+    if (need <= *size)
+        return data;
+
+    size_t new_size = *size ? *size * 2 : 64;
+    while (new_size < need)
+        new_size *= 2;
+
+    data = realloc(data, new_size);
+    if (!data)
+        err(EXIT_FAILURE, "failed to allocate file list");
+
+    *size = new_size;
+    return data;
+}
+
+static void put_varint(struct filelist *list, size_t val)
+{
+    do {
+        unsigned char byte = val & 0x7f;
+        val >>= 7;
+        list->data[list->len++] = byte | (val ? 0x80 : 0);
+    } while (val);
+}
+
+static size_t get_varint(const struct filelist *list, size_t *pos)
+{
+    size_t val = 0;
+    unsigned shift = 0;
+    unsigned char byte;
+
+    do {
+        byte = list->data[(*pos)++];
+        val |= (size_t)(byte & 0x7f) << shift;
+        shift += 7;
+    } while (byte & 0x80);
+
+    return val;
+}
+
+struct filelist *filelist_new(void)
+{
+    struct filelist *list = calloc(1, sizeof(struct filelist));
+    if (!list)
+        err(EXIT_FAILURE, "failed to allocate file list");
+    return list;
+}
+
+void filelist_free(struct filelist *list)
+{
+    if (!list)
+        return;
+
+    free(list->data);
+    free(list->last);
+    free(list);
+}
+
+/* A copy that can go on being appended to independently, sized to
+ * fit like a finished list */
+struct filelist *filelist_copy(const struct filelist *list)
+{
+    struct filelist *copy = filelist_new();
+
+    if (list->len) {
+        copy->data = malloc(list->len);
+        if (!copy->data)
+            err(EXIT_FAILURE, "failed to allocate file list");
+        memcpy(copy->data, list->data, list->len);
+        copy->size = list->len;
+    }
+    if (list->last) {
+        copy->last = reserve(NULL, &copy->last_size, list->last_len + 1);
+        memcpy(copy->last, list->last, list->last_len);
+    }
+
+    copy->len = list->len;
+    copy->count = list->count;
+    copy->last_len = list->last_len;
+    return copy;
+}
+
+void filelist_add(struct filelist *list, const char *path, size_t len)
+{
+    size_t prefix = 0;
+    size_t max_prefix = len < list->last_len ? len : list->last_len;
+    while (prefix < max_prefix && path[prefix] == list->last[prefix])
+        ++prefix;
+
+    /* Two varints take at most 2 * 10 bytes */
+    const size_t suffix = len - prefix;
+    list->data = reserve(list->data, &list->size, list->len + suffix + 20);
+    put_varint(list, prefix);
+    put_varint(list, suffix);
+    memcpy(list->data + list->len, path + prefix, suffix);
+    list->len += suffix;
+    list->count += 1;
+
+    list->last = reserve(list->last, &list->last_size, len + 1);
+    memcpy(list->last + prefix, path + prefix, suffix);
+    list->last_len = len;
+}
+
+/* Once every path is in, give back the slack from doubling the buffer
+ * and the copy of the last path. Adding to the list afterwards still
+ * works, the next path just isn't front coded. */
+void filelist_finish(struct filelist *list)
+{
+    if (!list)
+        return;
+
+    /* Failing to shrink only means keeping the slack */
+    if (!list->len) {
+        free(list->data);
+        list->data = NULL;
+        list->size = 0;
+    } else if (list->size > list->len) {
+        unsigned char *data = realloc(list->data, list->len);
+        if (data) {
+            list->data = data;
+            list->size = list->len;
+        }
+    }
+
+    free(list->last);
+    list->last = NULL;
+    list->last_len = list->last_size = 0;
+}
+
+void filelist_iter_init(struct filelist_iter *iter, const struct filelist *list)
+{
+    *iter = (struct filelist_iter){ .list = list };
+}
+
+/* Returns the next path, valid until the following call, or NULL once
+ * the list is exhausted. */
+const char *filelist_next(struct filelist_iter *iter)
+{
+    const struct filelist *list = iter->list;
+    if (!list || iter->pos >= list->len)
+        return NULL;
+
+    const size_t prefix = get_varint(list, &iter->pos);
+    const size_t suffix = get_varint(list, &iter->pos);
+
+    iter->path = reserve(iter->path, &iter->path_size, prefix + suffix + 1);
+    memcpy(iter->path + prefix, list->data + iter->pos, suffix);
+    iter->pos += suffix;
+    iter->path_len = prefix + suffix;
+    iter->path[iter->path_len] = 0;
+
+    return iter->path;
+}
+
+void filelist_iter_free(struct filelist_iter *iter)
+{
+    free(iter->path);
+}
@@ -0,0 +1,37 @@
+#pragma once
+
+#include <stddef.h>
+
+/* A package's file list, packed into one buffer. Paths arrive sorted
+ * and share long prefixes, so each one is front coded: the length it
+ * shares with the previous path, then the length and bytes of the
+ * rest. */
+struct filelist {
+    unsigned char *data;
+    size_t len;
+    size_t size;
+    size_t count;
+
+    /* The last path added, to diff the next one against */
+    char *last;
+    size_t last_len;
+    size_t last_size;
+};
+
+struct filelist_iter {
+    const struct filelist *list;
+    size_t pos;
+    char *path;
+    size_t path_len;
+    size_t path_size;
+};
+
+struct filelist *filelist_new(void);
+void filelist_free(struct filelist *list);
+struct filelist *filelist_copy(const struct filelist *list);
+void filelist_add(struct filelist *list, const char *path, size_t len);
+void filelist_finish(struct filelist *list);
+
+void filelist_iter_init(struct filelist_iter *iter, const struct filelist *list);
+const char *filelist_next(struct filelist_iter *iter);
+void filelist_iter_free(struct filelist_iter *iter);
@@ -0,0 +1,207 @@
+#include "ioctx.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <err.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <archive.h>
+
+#include "buffer.h"
+#include "util.h"
+
+#define SPARE_BUFFERS 4
+
+struct ioblock {
+    struct ioblock *next;
+    int fd;
+    off_t offset;
+    off_t file_size;
+    unsigned char *data;
+    size_t size;
+
+    /* Bytes ioblock_peek read ahead, handed out by the next read */
+    size_t primed;
+};
+
+struct ioctx {
+    struct ioblock *blocks;
+    struct buffer spare[SPARE_BUFFERS];
+    size_t nspare;
+};
+
+static pthread_once_t ioctx_once = PTHREAD_ONCE_INIT;
+static pthread_key_t ioctx_key;
+
+static void release_ioctx(void *data)
+{
+    struct ioctx *ctx = data;
+
+    while (ctx->blocks) {
+        struct ioblock *block = ctx->blocks;
+        ctx->blocks = block->next;
+        free(block->data);
+        free(block);
+    }
+
+    for (size_t i = 0; i < ctx->nspare; ++i)
+        buffer_release(&ctx->spare[i]);
+    free(ctx);
+}
+
+static void setup_ioctx(void)
+{
+    if (pthread_key_create(&ioctx_key, release_ioctx) != 0)
+        errx(EXIT_FAILURE, "failed to set up I/O context");
+}
+
+/* Created on first use, released when the thread exits */
+static struct ioctx *get_ioctx(void)
+{
+    pthread_once(&ioctx_once, setup_ioctx);
+
+    struct ioctx *ctx = pthread_getspecific(ioctx_key);
+    if (ctx)
+        return ctx;
+
+    ctx = calloc(1, sizeof(*ctx));
+    check_null(ctx, "failed to allocate I/O context");
+    pthread_setspecific(ioctx_key, ctx);
+    return ctx;
+}
+
+/* Reads go through pread from the start of the file, whatever the
+ * file offset happens to be */
+struct ioblock *ioblock_open(int fd)
+{
+    struct ioctx *ctx = get_ioctx();
+    struct ioblock *block = ctx->blocks;
+
+    if (block) {
+        ctx->blocks = block->next;
+    } else {
+        block = calloc(1, sizeof(*block));
+        check_null(block, "failed to allocate read block");
+
+        block->size = archive_block_size;
+        if (posix_memalign((void **)&block->data, 4096, block->size) != 0)
+            errx(EXIT_FAILURE, "failed to allocate read block");
+    }
+
+    struct stat st;
+    block->fd = fd;
+    block->offset = 0;
+    block->primed = 0;
+    block->file_size = fstat(fd, &st) == 0 ? st.st_size : -1;
+
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    return block;
+}
+
+void ioblock_close(struct ioblock *block)
+{
+    struct ioctx *ctx = get_ioctx();
+    block->next = ctx->blocks;
+    ctx->blocks = block;
+}
+
+/* The first block of the file, before anything else has been read from
+ * it. It isn't consumed: the next read returns it again. */
+const unsigned char *ioblock_peek(struct ioblock *block, size_t *len)
+{
+    if (!block->primed && block->offset == 0) {
+        ssize_t nbytes_r = pread(block->fd, block->data, block->size, 0);
+        if (nbytes_r > 0) {
+            block->primed = nbytes_r;
+            block->offset = nbytes_r;
+        }
+    }
+
+    *len = block->primed;
+    return block->data;
+}
+
+ssize_t ioblock_read(struct ioblock *block, const void **data)
+{
+    *data = block->data;
+
+    if (block->primed) {
+        const size_t len = block->primed;
+        block->primed = 0;
+        return len;
+    }
+
+    ssize_t nbytes_r = pread(block->fd, block->data, block->size, block->offset);
+    if (nbytes_r > 0)
+        block->offset += nbytes_r;
+    return nbytes_r;
+}
+
+static la_ssize_t read_callback(struct archive *archive, void *data, const void **buf)
+{
+    ssize_t nbytes_r = ioblock_read(data, buf);
+    if (nbytes_r < 0)
+        archive_set_error(archive, errno, "read failed: %s", strerror(errno));
+    return nbytes_r;
+}
+
+/* Only uncompressed archives ever skip, and then it's free */
+static la_int64_t skip_callback(struct archive *archive, void *data, la_int64_t request)
+{
+    struct ioblock *block = data;
+    (void)archive;
+
+    if (block->primed || block->file_size < 0)
+        return 0;
+
+    const off_t left = block->file_size - block->offset;
+    if (request > left)
+        request = left > 0 ? left : 0;
+
+    block->offset += request;
+    return request;
+}
+
+static int close_callback(struct archive *archive, void *data)
+{
+    (void)archive;
+    ioblock_close(data);
+    return ARCHIVE_OK;
+}
+
+/* The archive takes the block over and hands it back to the pool when
+ * it's closed, whether or not it opens */
+int ioblock_open_archive(struct ioblock *block, struct archive *archive)
+{
+    int ret = archive_read_open2(archive, block, NULL, read_callback,
+                                 skip_callback, close_callback);
+    return ret == ARCHIVE_OK ? 0 : -1;
+}
+
+int ioctx_open_archive(struct archive *archive, int fd)
+{
+    return ioblock_open_archive(ioblock_open(fd), archive);
+}
+
+void ioctx_take_buffer(struct buffer *buf, size_t reserve)
+{
+    struct ioctx *ctx = get_ioctx();
+
+    *buf = ctx->nspare ? ctx->spare[--ctx->nspare] : (struct buffer){0};
+    buffer_clear(buf);
+    buffer_reserve(buf, reserve);
+}
+
+void ioctx_give_buffer(struct buffer *buf)
+{
+    struct ioctx *ctx = get_ioctx();
+
+    if (buf->data && ctx->nspare < SPARE_BUFFERS)
+        ctx->spare[ctx->nspare++] = *buf;
+    else
+        buffer_release(buf);
+    *buf = (struct buffer){0};
+}
@@ -0,0 +1,23 @@
+#pragma once
+
+#include <stddef.h>
+#include <sys/types.h>
+
+struct archive;
+struct buffer;
+struct ioblock;
+
+/* Each thread keeps a small pool of aligned read blocks, and of the
+ * scratch buffers database writers use, so reading a package or writing
+ * a database doesn't start with a round of allocations. Blocks are
+ * sized by --block-size. */
+struct ioblock *ioblock_open(int fd);
+void ioblock_close(struct ioblock *block);
+
+const unsigned char *ioblock_peek(struct ioblock *block, size_t *len);
+ssize_t ioblock_read(struct ioblock *block, const void **data);
+int ioblock_open_archive(struct ioblock *block, struct archive *archive);
+
+int ioctx_open_archive(struct archive *archive, int fd);
+void ioctx_take_buffer(struct buffer *buf, size_t reserve);
+void ioctx_give_buffer(struct buffer *buf);
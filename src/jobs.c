@@ -0,0 +1,60 @@
+#include "jobs.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <err.h>
+#include <pthread.h>
+
+struct job_queue {
+    job_fn fn;
+    void *data;
+    size_t count;
+    size_t next;
+};
+
+static void *job_worker(void *arg)
+{
+    struct job_queue *queue = arg;
+
+    for (;;) {
+        size_t idx = __atomic_fetch_add(&queue->next, 1, __ATOMIC_RELAXED);
+        if (idx >= queue->count)
+            break;
+        queue->fn(queue->data, idx);
+    }
+
+    return NULL;
+}
+
+/* Call fn for every index in [0, count), spread over up to "jobs"
+ * threads. Work is handed out one index at a time so a few large
+ * packages don't starve the rest of the pool. */
+void run_jobs(int jobs, size_t count, job_fn fn, void *data)
+{
+    struct job_queue queue = {
+        .fn = fn,
+        .data = data,
+        .count = count
+    };
+
+    if (jobs <= 1 || count <= 1) {
+        job_worker(&queue);
+        return;
+    }
+
+    size_t nthreads = (size_t)jobs < count ? (size_t)jobs : count;
+    pthread_t *threads = calloc(nthreads, sizeof(pthread_t));
+    if (!threads)
+        err(EXIT_FAILURE, "failed to allocate worker threads");
+
+    for (size_t i = 0; i < nthreads; ++i) {
+        int rc = pthread_create(&threads[i], NULL, job_worker, &queue);
+        if (rc != 0)
+            errx(EXIT_FAILURE, "failed to start worker thread: %s", strerror(rc));
+    }
+
+    for (size_t i = 0; i < nthreads; ++i)
+        pthread_join(threads[i], NULL);
+
+    free(threads);
+}
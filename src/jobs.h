@@ -0,0 +1,7 @@
+#pragma once
+
+#include <stddef.h>
+
+typedef void (*job_fn)(void *data, size_t idx);
+
+void run_jobs(int jobs, size_t count, job_fn fn, void *data);
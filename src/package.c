@@ -4,6 +4,7 @@
 #include <stdbool.h>
 #include <string.h>
 #include <err.h>
+#include <errno.h>
 #include <archive.h>
 #include <archive_entry.h>
 #include <unistd.h>
@@ -14,42 +15,140 @@
 #include "pkginfo.h"
 #include "pkgcache.h"
 #include "base64.h"
+#include "arena.h"
+#include "filelist.h"
+#include "stats.h"
+#include "ioctx.h"
 
-int load_package(pkg_t *pkg, int fd)
-{
+struct package_reader {
     struct archive *archive;
+};
+
+/* Sniff the compression of a package from its leading bytes so only
+ * the one decompressor we need gets set up. */
+static int detect_filter(const unsigned char *data, size_t len)
+{
+    static const struct {
+        int filter;
+        size_t len;
+        const char *magic;
+    } magics[] = {
+        { ARCHIVE_FILTER_XZ,       6, "\xfd\x37\x7a\x58\x5a\x00" },
+        { ARCHIVE_FILTER_ZSTD,     4, "\x28\xb5\x2f\xfd" },
+        { ARCHIVE_FILTER_GZIP,     2, "\x1f\x8b" },
+        { ARCHIVE_FILTER_BZIP2,    3, "BZh" },
+        { ARCHIVE_FILTER_LZ4,      4, "\x04\x22\x4d\x18" },
+        { ARCHIVE_FILTER_COMPRESS, 2, "\x1f\x9d" },
+    };
+
+    for (size_t i = 0; i < sizeof(magics) / sizeof(*magics); ++i) {
+        if (len >= magics[i].len && memcmp(data, magics[i].magic, magics[i].len) == 0)
+            return magics[i].filter;
+    }
+
+    if (len >= 262 && memcmp(&data[257], "ustar", 5) == 0)
+        return ARCHIVE_FILTER_NONE;
+    return -1;
+}
+
+static void support_filter(struct archive *archive, int filter)
+{
+    switch (filter) {
+    case ARCHIVE_FILTER_XZ:
+        archive_read_support_filter_xz(archive);
+        break;
+    case ARCHIVE_FILTER_ZSTD:
+        archive_read_support_filter_zstd(archive);
+        break;
+    case ARCHIVE_FILTER_GZIP:
+        archive_read_support_filter_gzip(archive);
+        break;
+    case ARCHIVE_FILTER_BZIP2:
+        archive_read_support_filter_bzip2(archive);
+        break;
+    case ARCHIVE_FILTER_LZ4:
+        archive_read_support_filter_lz4(archive);
+        break;
+    case ARCHIVE_FILTER_COMPRESS:
+        archive_read_support_filter_compress(archive);
+        break;
+    case ARCHIVE_FILTER_NONE:
+        archive_read_support_filter_none(archive);
+        break;
+    default:
+        archive_read_support_filter_all(archive);
+        archive_read_support_format_all(archive);
+        return;
+    }
+
+    archive_read_support_format_tar(archive);
+}
+
+/* The first block read is sniffed for the compression and then handed
+ * to libarchive as is, so it's only ever read once */
+static int package_reader_open(struct package_reader *reader, int fd)
+{
+    *reader = (struct package_reader){ .archive = archive_read_new() };
+
+    struct ioblock *block = ioblock_open(fd);
+    size_t head_len;
+    const unsigned char *head = ioblock_peek(block, &head_len);
+
+    support_filter(reader->archive, detect_filter(head, head_len));
+    return ioblock_open_archive(block, reader->archive);
+}
+
+static void package_reader_close(struct package_reader *reader)
+{
+    const la_int64_t decompressed = archive_filter_bytes(reader->archive, 0);
+    stats_add(STAT_PKGS_OPENED, 1);
+    if (decompressed > 0)
+        stats_add(STAT_BYTES_DECOMPRESSED, decompressed);
+
+    archive_read_close(reader->archive);
+    archive_read_free(reader->archive);
+}
+
+int load_package(pkg_t *pkg, int fd, bool files)
+{
+    struct package_reader reader;
     struct stat st;
 
     check_posix(fstat(fd, &st), "failed to stat file");
 
-    archive = archive_read_new();
-    archive_read_support_filter_all(archive);
-    archive_read_support_format_all(archive);
-
-    if (archive_read_open_fd(archive, fd, 8192) != ARCHIVE_OK) {
-        archive_read_free(archive);
+    if (package_reader_open(&reader, fd) < 0) {
+        package_reader_close(&reader);
         return -1;
     }
 
+    /* .PKGINFO is the first entry in any package makepkg produces.
+     * Unless we're also after the file list, stop as soon as we have
+     * it: every further header we ask for means decompressing more of
+     * the payload. */
     bool found_pkginfo = false;
     struct archive_entry *entry;
-    while (archive_read_next_header(archive, &entry) == ARCHIVE_OK && !found_pkginfo) {
+    while (archive_read_next_header(reader.archive, &entry) == ARCHIVE_OK) {
         const char *entry_name = archive_entry_pathname(entry);
         const mode_t mode = archive_entry_mode(entry);
 
-        if (S_ISREG(mode) && streq(entry_name, ".PKGINFO")) {
-            if (read_pkginfo(archive, pkg) < 0) {
+        if (entry_name[0] != '.') {
+            if (files)
+                package_set(pkg, PKG_FILES, entry_name, strlen(entry_name));
+        } else if (S_ISREG(mode) && streq(entry_name, ".PKGINFO")) {
+            if (read_pkginfo(reader.archive, pkg) < 0) {
                 errx(EXIT_FAILURE, "failed to parse PKGINFO on %s", pkg->filename);
             }
             found_pkginfo = true;
+            if (!files)
+                break;
         }
     }
 
-    archive_read_close(archive);
-    archive_read_free(archive);
+    package_reader_close(&reader);
+    filelist_finish(pkg->files);
 
     if (found_pkginfo) {
-        pkg->hash = sdbm(pkg->name);
+        pkg->hash = pkgname_hash(pkg->name);
         pkg->size = st.st_size;
         pkg->mtime = st.st_mtime;
         return 0;
@@ -58,22 +157,23 @@ int load_package(pkg_t *pkg, int fd)
     return -1;
 }
 
-int load_package_signature(struct pkg *pkg, int dirfd)
+/* Read from the start whatever the offset: verifying the package may
+ * already have read through the signature */
+int load_package_signature(struct pkg *pkg, int fd)
 {
-    _cleanup_free_ char *signame = joinstring(pkg->filename, ".sig", NULL);
-    _cleanup_close_ int fd = openat(dirfd, signame, O_RDONLY);
-    if (fd < 0)
-        return -1;
-
     struct stat st;
-    check_posix(fstat(fd, &st), "failed to stat signature");
+    if (fstat(fd, &st) < 0)
+        return -1;
 
     _cleanup_free_ char *signature = malloc(st.st_size);
-    check_posix(read(fd, signature, st.st_size), "failed to read signature");
+    check_null(signature, "failed to allocate signature");
+    if (pread(fd, signature, st.st_size, 0) != st.st_size)
+        return -1;
 
-    pkg->base64sig = base64_encode((const unsigned char *)signature,
-                                   st.st_size, NULL);
-    check_null(pkg->base64sig, "failed to find base64 signature");
+    _cleanup_free_ char *base64sig = base64_encode((const unsigned char *)signature,
+                                                   st.st_size, NULL);
+    check_null(base64sig, "failed to find base64 signature");
+    package_set(pkg, PKG_PGPSIG, base64sig, strlen(base64sig));
 
     // If the signature's timestamp is new than the packages, update
     // it to the newer value.
@@ -85,92 +185,145 @@ int load_package_signature(struct pkg *pkg, int dirfd)
 
 int load_package_files(struct pkg *pkg, int fd)
 {
-    struct archive *archive;
-    struct stat st;
-
-    check_posix(fstat(fd, &st), "failed to stat file");
-
-    archive = archive_read_new();
-    archive_read_support_filter_all(archive);
-    archive_read_support_format_all(archive);
+    struct package_reader reader;
 
-    if (archive_read_open_fd(archive, fd, 8192) != ARCHIVE_OK) {
-        archive_read_free(archive);
+    if (package_reader_open(&reader, fd) < 0) {
+        package_reader_close(&reader);
         return -1;
     }
 
+    /* A list cut short by a truncated or corrupt archive is worse than
+     * none at all: it would be published as if it were complete */
     struct archive_entry *entry;
-    while (archive_read_next_header(archive, &entry) == ARCHIVE_OK) {
+    int status;
+    while ((status = archive_read_next_header(reader.archive, &entry)) == ARCHIVE_OK) {
         const char *entry_name = archive_entry_pathname(entry);
 
         if (entry_name[0] != '.')
-            pkg->files = alpm_list_add(pkg->files, strdup(entry_name));
+            package_set(pkg, PKG_FILES, entry_name, strlen(entry_name));
     }
 
-    archive_read_close(archive);
-    archive_read_free(archive);
+    if (status != ARCHIVE_EOF) {
+        const int error = archive_errno(reader.archive);
+        warnx("%s", archive_error_string(reader.archive));
+        package_reader_close(&reader);
+        errno = error > 0 ? error : EIO;
+        return -1;
+    }
+
+    package_reader_close(&reader);
+    filelist_finish(pkg->files);
     return 0;
 }
 
+/* Everything a package points to, short of its file list, lives in the
+ * arena and stays there until arena_release, so there's only the
+ * struct itself to give back. */
 void package_free(pkg_t *pkg)
 {
-    free(pkg->filename);
-    free(pkg->name);
-    free(pkg->version);
-    free(pkg->desc);
-    free(pkg->url);
-    free(pkg->packager);
-    free(pkg->sha256sum);
-    free(pkg->base64sig);
-    free(pkg->arch);
-
-    alpm_list_free_inner(pkg->groups, free);
-    alpm_list_free(pkg->groups);
-    alpm_list_free_inner(pkg->licenses, free);
-    alpm_list_free(pkg->licenses);
-    alpm_list_free_inner(pkg->depends, free);
-    alpm_list_free(pkg->depends);
-    alpm_list_free_inner(pkg->conflicts, free);
-    alpm_list_free(pkg->conflicts);
-    alpm_list_free_inner(pkg->provides, free);
-    alpm_list_free(pkg->provides);
-    alpm_list_free_inner(pkg->optdepends, free);
-    alpm_list_free(pkg->optdepends);
-    alpm_list_free_inner(pkg->makedepends, free);
-    alpm_list_free(pkg->makedepends);
-    alpm_list_free_inner(pkg->files, free);
-    alpm_list_free(pkg->files);
-
+    filelist_free(pkg->files);
     free(pkg);
 }
 
+/* The strings and lists are shared with the original; they stay put
+ * in the arena and nothing modifies them once a package is loaded. The
+ * file list is only copied when asked for. */
+struct pkg *package_copy(const struct pkg *pkg, bool files)
+{
+    struct pkg *copy = malloc(sizeof(pkg_t));
+    check_null(copy, "failed to allocate package");
+
+    *copy = *pkg;
+    copy->files = files && pkg->files ? filelist_copy(pkg->files) : NULL;
+    return copy;
+}
+
+static alpm_list_t *list_append(alpm_list_t *list, char *data)
+{
+    alpm_list_t *node = arena_alloc(arena_get(), sizeof(alpm_list_t));
+
+    *node = (alpm_list_t){ .data = data };
+    if (!list) {
+        node->prev = node;
+        return node;
+    }
+
+    /* The head's prev pointer always points at the tail */
+    node->prev = list->prev;
+    list->prev->next = node;
+    list->prev = node;
+    return list;
+}
+
+alpm_list_t *package_list_append(alpm_list_t *list, char *data)
+{
+    return list_append(list, data);
+}
+
 static void pkg_append_list(const char *entry, size_t len, alpm_list_t **list)
 {
-    *list = alpm_list_add(*list, strndup(entry, len));
+    *list = list_append(*list, arena_strndup(arena_get(), entry, len));
+}
+
+static void pkg_append_interned(const char *entry, size_t len, alpm_list_t **list)
+{
+    *list = list_append(*list, arena_intern(arena_get(), entry, len));
+}
+
+static void pkg_append_file(const char *entry, size_t len, struct filelist **files)
+{
+    if (!*files)
+        *files = filelist_new();
+    filelist_add(*files, entry, len);
 }
 
 static void pkg_set_string(const char *entry, size_t len, char **data)
 {
-    free(*data);
-    *data = strndup(entry, len);
+    *data = arena_strndup(arena_get(), entry, len);
+}
+
+static void pkg_set_interned(const char *entry, size_t len, char **data)
+{
+    *data = arena_intern(arena_get(), entry, len);
 }
 
-static void pkg_set_size(const char *entry, size_t _unused_ len, size_t *data)
+/* Entries aren't necessarily null terminated: the parsers hand over
+ * spans straight out of the archive's buffers. */
+static const char *terminate(const char *entry, size_t len, char *buf, size_t buf_len)
 {
-    parse_size(entry, data);
+    /* Nothing this long is a valid number; let parsing fail */
+    if (len >= buf_len)
+        len = 0;
+    memcpy(buf, entry, len);
+    buf[len] = 0;
+    return buf;
 }
 
-static void pkg_set_time(const char *entry, size_t _unused_ len, time_t *data)
+static void pkg_set_size(const char *entry, size_t len, size_t *data)
 {
-    parse_time(entry, data);
+    char buf[32];
+    parse_size(terminate(entry, len, buf, sizeof(buf)), data);
+}
+
+static void pkg_set_time(const char *entry, size_t len, time_t *data)
+{
+    char buf[32];
+    parse_time(terminate(entry, len, buf, sizeof(buf)), data);
 }
 
 #define pkg_set(entry, len, field) _Generic((field), \
     alpm_list_t **: pkg_append_list, \
+    struct filelist **: pkg_append_file, \
     char **: pkg_set_string, \
     size_t *: pkg_set_size, \
     time_t *: pkg_set_time)(entry, len, field)
 
+/* For values shared between lots of packages, like architectures,
+ * packagers, licenses and dependencies */
+#define pkg_intern(entry, len, field) _Generic((field), \
+    alpm_list_t **: pkg_append_interned, \
+    char **: pkg_set_interned)(entry, len, field)
+
 void package_set(pkg_t *pkg, enum pkg_entry type, const char *entry, size_t len)
 {
     switch (type) {
@@ -185,11 +338,11 @@ void package_set(pkg_t *pkg, enum pkg_entry type, const char *entry, size_t len)
         }
         break;
     case PKG_PKGBASE:
-        pkg_set(entry, len, &pkg->base);
+        pkg_intern(entry, len, &pkg->base);
         break;
     case PKG_VERSION:
         if (!pkg->version) {
-            pkg_set(entry, len, &pkg->version);
+            pkg_intern(entry, len, &pkg->version);
         } else if (!strneq(entry, pkg->version, len)) {
             errx(EXIT_FAILURE, "database entry %%VERSION%% and desc record are mismatched!");
         }
@@ -198,7 +351,7 @@ void package_set(pkg_t *pkg, enum pkg_entry type, const char *entry, size_t len)
         pkg_set(entry, len, &pkg->desc);
         break;
     case PKG_GROUPS:
-        pkg_set(entry, len, &pkg->groups);
+        pkg_intern(entry, len, &pkg->groups);
         break;
     case PKG_CSIZE:
         pkg_set(entry, len, &pkg->size);
@@ -213,40 +366,40 @@ void package_set(pkg_t *pkg, enum pkg_entry type, const char *entry, size_t len)
         pkg_set(entry, len, &pkg->base64sig);
         break;
     case PKG_URL:
-        pkg_set(entry, len, &pkg->url);
+        pkg_intern(entry, len, &pkg->url);
         break;
     case PKG_LICENSE:
-        pkg_set(entry, len, &pkg->licenses);
+        pkg_intern(entry, len, &pkg->licenses);
         break;
     case PKG_ARCH:
-        pkg_set(entry, len, &pkg->arch);
+        pkg_intern(entry, len, &pkg->arch);
         break;
     case PKG_BUILDDATE:
         pkg_set(entry, len, &pkg->builddate);
         break;
     case PKG_PACKAGER:
-        pkg_set(entry, len, &pkg->packager);
+        pkg_intern(entry, len, &pkg->packager);
         break;
     case PKG_REPLACES:
-        pkg_set(entry, len, &pkg->replaces);
+        pkg_intern(entry, len, &pkg->replaces);
         break;
     case PKG_DEPENDS:
-        pkg_set(entry, len, &pkg->depends);
+        pkg_intern(entry, len, &pkg->depends);
         break;
     case PKG_CONFLICTS:
-        pkg_set(entry, len, &pkg->conflicts);
+        pkg_intern(entry, len, &pkg->conflicts);
         break;
     case PKG_PROVIDES:
-        pkg_set(entry, len, &pkg->provides);
+        pkg_intern(entry, len, &pkg->provides);
         break;
     case PKG_OPTDEPENDS:
-        pkg_set(entry, len, &pkg->optdepends);
+        pkg_intern(entry, len, &pkg->optdepends);
         break;
     case PKG_MAKEDEPENDS:
-        pkg_set(entry, len, &pkg->makedepends);
+        pkg_intern(entry, len, &pkg->makedepends);
         break;
     case PKG_CHECKDEPENDS:
-        pkg_set(entry, len, &pkg->checkdepends);
+        pkg_intern(entry, len, &pkg->checkdepends);
         break;
     case PKG_FILES:
         pkg_set(entry, len, &pkg->files);
@@ -258,3 +411,46 @@ void package_set(pkg_t *pkg, enum pkg_entry type, const char *entry, size_t len)
         break;
     }
 }
+
+static void compact_string(char **data, void (*set)(const char *, size_t, char **))
+{
+    if (*data)
+        set(*data, strlen(*data), data);
+}
+
+static void compact_list(alpm_list_t **list, void (*append)(const char *, size_t, alpm_list_t **))
+{
+    const alpm_list_t *node = *list;
+
+    *list = NULL;
+    for (; node; node = node->next)
+        append(node->data, strlen(node->data), list);
+}
+
+/* Copy everything the package points into the calling thread's arena,
+ * interned the same way as when it was loaded, so the arenas it came
+ * from can be retired */
+void package_compact(pkg_t *pkg)
+{
+    compact_string(&pkg->filename, pkg_set_string);
+    compact_string(&pkg->name, pkg_set_string);
+    compact_string(&pkg->base, pkg_set_interned);
+    compact_string(&pkg->version, pkg_set_interned);
+    compact_string(&pkg->desc, pkg_set_string);
+    compact_string(&pkg->url, pkg_set_interned);
+    compact_string(&pkg->packager, pkg_set_interned);
+    compact_string(&pkg->sha256sum, pkg_set_string);
+    compact_string(&pkg->base64sig, pkg_set_string);
+    compact_string(&pkg->arch, pkg_set_interned);
+
+    compact_list(&pkg->groups, pkg_append_interned);
+    compact_list(&pkg->licenses, pkg_append_interned);
+    compact_list(&pkg->replaces, pkg_append_interned);
+    compact_list(&pkg->depends, pkg_append_interned);
+    compact_list(&pkg->conflicts, pkg_append_interned);
+    compact_list(&pkg->provides, pkg_append_interned);
+    compact_list(&pkg->optdepends, pkg_append_interned);
+    compact_list(&pkg->makedepends, pkg_append_interned);
+    compact_list(&pkg->checkdepends, pkg_append_interned);
+    compact_list(&pkg->deltas, pkg_append_list);
+}
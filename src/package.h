@@ -2,9 +2,12 @@
 
 #include <stddef.h>
 #include <stdint.h>
+#include <stdbool.h>
 #include <time.h>
 #include <alpm_list.h>
 
+struct filelist;
+
 typedef uint64_t hash_t;
 
 enum pkg_entry {
@@ -52,6 +55,7 @@ typedef struct pkg {
     size_t isize;
     time_t builddate;
     time_t mtime;
+    bool dirty;
 
     alpm_list_t *groups;
     alpm_list_t *licenses;
@@ -62,12 +66,15 @@ typedef struct pkg {
     alpm_list_t *optdepends;
     alpm_list_t *makedepends;
     alpm_list_t *checkdepends;
-    alpm_list_t *files;
+    struct filelist *files;
     alpm_list_t *deltas;
 } pkg_t;
 
-int load_package(pkg_t *pkg, int fd);
+int load_package(pkg_t *pkg, int fd, bool files);
 int load_package_signature(struct pkg *pkg, int fd);
 int load_package_files(pkg_t *pkg, int fd);
 void package_free(pkg_t *pkg);
+struct pkg *package_copy(const struct pkg *pkg, bool files);
+void package_compact(pkg_t *pkg);
 void package_set(pkg_t *pkg, enum pkg_entry type, const char *entry, size_t len);
+alpm_list_t *package_list_append(alpm_list_t *list, char *data);
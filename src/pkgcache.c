@@ -1,258 +1,329 @@
 #include "pkgcache.h"
 
+#include <stdint.h>
 #include <string.h>
 #include <errno.h>
+#include <endian.h>
 
-hash_t sdbm(const char *str)
+#include "util.h"
+
+static inline uint64_t mix(uint64_t a, uint64_t b)
 {
-    hash_t c;
-    hash_t hash = 0;
+    const __uint128_t r = (__uint128_t)a * b;
+    return (uint64_t)r ^ (uint64_t)(r >> 64);
+}
 
-    if (!str) {
-        return hash;
-    }
-    while ((c = *str++)) {
-        hash = c + hash * 65599;
-    }
+static inline uint64_t read_word(const unsigned char *p, size_t len)
+{
+    uint64_t word = 0;
+    memcpy(&word, p, len);
+    return le64toh(word);
+}
+
+/* In the style of wyhash: eat the name a word at a time, folding each
+ * one in with a 64x64->128 bit multiply. The length goes in too, so
+ * names that differ in length practically never share a hash. */
+hash_t pkgname_hash(const char *str)
+{
+    if (!str)
+        return 0;
 
-    return hash;
+    const unsigned char *p = (const unsigned char *)str;
+    const size_t len = strlen(str);
+    uint64_t seed = 0xa0761d6478bd642full ^ len;
+    size_t left = len;
+
+    for (; left > 8; p += 8, left -= 8)
+        seed = mix(read_word(p, 8) ^ 0xe7037ed1a0b428dbull, seed);
+
+    seed = mix(read_word(p, left) ^ 0x8ebc6af09c88c6e3ull, seed);
+    return mix(seed ^ 0x589965cc75374cc3ull, len ^ 0x1d8e4e27c47d124full);
 }
 
 static int pkg_cmp(const void *p1, const void *p2)
 {
-    const struct pkg *pkg1 = p1;
-    const struct pkg *pkg2 = p2;
+    const struct pkg *pkg1 = *(struct pkg *const *)p1;
+    const struct pkg *pkg2 = *(struct pkg *const *)p2;
     return strcmp(pkg1->name, pkg2->name);
 }
 
-/* List of primes for possible sizes of hash tables.
+/* Packages live in a contiguous array; the hash table only holds
+ * indexes into it, offset by one so zero can mark an empty slot. The
+ * table size is always a power of two and kept under 3/4 full.
  *
- * The maximum table size is the last prime under 1,000,000.  That is
- * more than an order of magnitude greater than the number of packages
- * in any Linux distribution, and well under UINT_MAX.
- */
-static const size_t prime_list[] =
+ * Alongside the table is a control byte per slot, SwissTable style:
+ * zero when the slot is empty, otherwise the high bit plus seven more
+ * bits of the hash. Probing reads eight of them at once and only
+ * follows a slot to its package when its control byte matches. The
+ * first group's worth is mirrored past the end so a group never has to
+ * wrap. */
+#define GROUP_WIDTH 8
+
+static const size_t min_buckets = 16;
+
+static const uint64_t lsbs = 0x0101010101010101ull;
+static const uint64_t msbs = 0x8080808080808080ull;
+
+static inline uint8_t ctrl_tag(hash_t hash)
 {
-    11u, 13u, 17u, 19u, 23u, 29u, 31u, 37u, 41u, 43u, 47u,
-    53u, 59u, 61u, 67u, 71u, 73u, 79u, 83u, 89u, 97u, 103u,
-    109u, 113u, 127u, 137u, 139u, 149u, 157u, 167u, 179u, 193u,
-    199u, 211u, 227u, 241u, 257u, 277u, 293u, 313u, 337u, 359u,
-    383u, 409u, 439u, 467u, 503u, 541u, 577u, 619u, 661u, 709u,
-    761u, 823u, 887u, 953u, 1031u, 1109u, 1193u, 1289u, 1381u,
-    1493u, 1613u, 1741u, 1879u, 2029u, 2179u, 2357u, 2549u,
-    2753u, 2971u, 3209u, 3469u, 3739u, 4027u, 4349u, 4703u,
-    5087u, 5503u, 5953u, 6427u, 6949u, 7517u, 8123u, 8783u,
-    9497u, 10273u, 11113u, 12011u, 12983u, 14033u, 15173u,
-    16411u, 17749u, 19183u, 20753u, 22447u, 24281u, 26267u,
-    28411u, 30727u, 33223u, 35933u, 38873u, 42043u, 45481u,
-    49201u, 53201u, 57557u, 62233u, 67307u, 72817u, 78779u,
-    85229u, 92203u, 99733u, 107897u, 116731u, 126271u, 136607u,
-    147793u, 159871u, 172933u, 187091u, 202409u, 218971u, 236897u,
-    256279u, 277261u, 299951u, 324503u, 351061u, 379787u, 410857u,
-    444487u, 480881u, 520241u, 562841u, 608903u, 658753u, 712697u,
-    771049u, 834181u, 902483u, 976369u
-};
-
-/* How far forward do we look when linear probing for a spot? */
-static const size_t stride = 1;
-/* What is the maximum load percentage of our hash table? */
-static const double max_hash_load = 0.68;
-/* Initial load percentage given a certain size */
-static const double initial_hash_load = 0.58;
-
-/* Allocate a hash table with space for at least "size" elements */
-struct pkgcache *pkgcache_create(size_t size)
+    return 0x80 | (hash >> 57);
+}
+
+static inline uint64_t load_group(const struct pkgcache *cache, size_t slot)
 {
-    struct pkgcache *cache = NULL;
-    size_t i, loopsize;
+    return read_word(&cache->ctrl[slot], GROUP_WIDTH);
+}
 
-    cache = calloc(1, sizeof(struct pkgcache));
-    if (!cache)
-        return NULL;
+/* A high bit in each byte of the group equal to tag. Can report a
+ * false match just above a real one; every match gets checked anyway. */
+static inline uint64_t match_tag(uint64_t group, uint8_t tag)
+{
+    const uint64_t x = group ^ (lsbs * tag);
+    return (x - lsbs) & ~x & msbs;
+}
 
-    size = size / initial_hash_load + 1;
+static inline uint64_t match_empty(uint64_t group)
+{
+    return ~group & msbs;
+}
 
-    loopsize = sizeof(prime_list) / sizeof(*prime_list);
-    for (i = 0; i < loopsize; i++) {
-        if (prime_list[i] > size) {
-            cache->buckets = prime_list[i];
-            cache->limit = cache->buckets * max_hash_load;
-            break;
-        }
-    }
+static inline size_t group_offset(uint64_t mask)
+{
+    return (size_t)__builtin_ctzll(mask) / 8;
+}
 
-    if (cache->buckets < size) {
-        errno = ERANGE;
-        free(cache);
-        return NULL;
+static inline void set_slot(struct pkgcache *cache, size_t slot, size_t idx, uint8_t ctrl)
+{
+    cache->table[slot] = idx;
+    cache->ctrl[slot] = ctrl;
+    if (slot < GROUP_WIDTH - 1)
+        cache->ctrl[cache->buckets + slot] = ctrl;
+}
+
+static inline size_t next_slot(const struct pkgcache *cache, size_t slot)
+{
+    return (slot + 1) & (cache->buckets - 1);
+}
+
+static inline size_t home_slot(const struct pkgcache *cache, hash_t hash)
+{
+    return hash & (cache->buckets - 1);
+}
+
+static inline bool needs_grow(const struct pkgcache *cache, size_t entries)
+{
+    return entries * 4 > cache->buckets * 3;
+}
+
+static void rebuild_table(struct pkgcache *cache)
+{
+    memset(cache->table, 0, cache->buckets * sizeof(*cache->table));
+    memset(cache->ctrl, 0, cache->buckets + GROUP_WIDTH - 1);
+
+    for (size_t i = 0; i < cache->entries; ++i) {
+        const hash_t hash = cache->pkgs[i]->hash;
+        size_t slot = home_slot(cache, hash);
+        while (cache->table[slot])
+            slot = next_slot(cache, slot);
+        set_slot(cache, slot, i + 1, ctrl_tag(hash));
     }
+}
 
-    cache->hash_table = calloc(cache->buckets, sizeof(alpm_list_t *));
-    if (!cache->hash_table) {
-        free(cache);
-        return NULL;
+static int resize_table(struct pkgcache *cache, size_t buckets)
+{
+    size_t *table = calloc(buckets, sizeof(*table));
+    uint8_t *ctrl = calloc(buckets + GROUP_WIDTH - 1, 1);
+    if (!table || !ctrl) {
+        free(table);
+        free(ctrl);
+        return -1;
     }
 
-    return cache;
+    free(cache->table);
+    free(cache->ctrl);
+    cache->table = table;
+    cache->ctrl = ctrl;
+    cache->buckets = buckets;
+    rebuild_table(cache);
+    return 0;
 }
 
-static size_t get_hash_position(hash_t hash, struct pkgcache *cache)
+static int reserve(struct pkgcache *cache, size_t entries)
 {
-    size_t position;
+    if (entries > cache->capacity) {
+        size_t capacity = cache->capacity ? cache->capacity * 2 : min_buckets;
+        while (capacity < entries)
+            capacity *= 2;
 
-    position = hash % cache->buckets;
+        struct pkg **pkgs = realloc(cache->pkgs, capacity * sizeof(*pkgs));
+        if (!pkgs)
+            return -1;
 
-    /* collision resolution using open addressing with linear probing */
-    while (cache->hash_table[position] != NULL) {
-        position += stride;
-        while (position >= cache->buckets) {
-            position -= cache->buckets;
-        }
+        cache->pkgs = pkgs;
+        cache->capacity = capacity;
     }
 
-    return position;
+    if (needs_grow(cache, entries)) {
+        size_t buckets = cache->buckets;
+        while (buckets * 3 < entries * 4)
+            buckets *= 2;
+
+        return resize_table(cache, buckets);
+    }
+
+    return 0;
 }
 
-/* Expand the hash table size to the next increment and rebin the entries */
-static struct pkgcache *rehash(struct pkgcache *oldcache)
+/* Allocate a cache with space for at least "size" packages */
+struct pkgcache *pkgcache_create(size_t size)
 {
-    struct pkgcache *newcache;
-    size_t newsize, i;
-
-    /* Hash tables will need resized in two cases:
-     *  - adding packages to the local database
-     *  - poor estimation of the number of packages in sync database
-     *
-     * For small hash tables sizes (<500) the increase in size is by a
-     * minimum of a factor of 2 for optimal rehash efficiency.  For
-     * larger database sizes, this increase is reduced to avoid excess
-     * memory allocation as both scenarios requiring a rehash should not
-     * require a table size increase that large. */
-    if (oldcache->buckets < 500) {
-        newsize = oldcache->buckets * 2;
-    } else if (oldcache->buckets < 2000) {
-        newsize = oldcache->buckets * 3 / 2;
-    } else if (oldcache->buckets < 5000) {
-        newsize = oldcache->buckets * 4 / 3;
-    } else {
-        newsize = oldcache->buckets + 1;
+    struct pkgcache *cache = calloc(1, sizeof(struct pkgcache));
+    if (!cache)
+        return NULL;
+
+    size_t buckets = min_buckets;
+    while (buckets * 3 < size * 4) {
+        if (buckets > SIZE_MAX / 2) {
+            errno = ERANGE;
+            free(cache);
+            return NULL;
+        }
+        buckets *= 2;
     }
 
-    newcache = pkgcache_create(newsize);
-    if (newcache == NULL) {
-        /* creation of newcache failed, stick with old one... */
-        return oldcache;
+    if (resize_table(cache, buckets) < 0 || reserve(cache, size) < 0) {
+        pkgcache_free(cache);
+        return NULL;
     }
 
-    newcache->list = oldcache->list;
-    oldcache->list = NULL;
+    return cache;
+}
+
+/* Find the table slot holding the package named "name", or the empty
+ * slot that ends its probe sequence. */
+static size_t find_slot(const struct pkgcache *cache, const char *name, hash_t hash)
+{
+    const uint8_t tag = ctrl_tag(hash);
+    size_t slot = home_slot(cache, hash);
+
+    for (;;) {
+        const uint64_t group = load_group(cache, slot);
+        const uint64_t empty = match_empty(group);
+        uint64_t match = match_tag(group, tag);
+
+        /* The probe sequence ends at the first empty slot */
+        if (empty)
+            match &= (empty & -empty) - 1;
 
-    for (i = 0; i < oldcache->buckets; i++) {
-        if (oldcache->hash_table[i] != NULL) {
-            struct pkg *package = oldcache->hash_table[i]->data;
-            size_t position = get_hash_position(package->hash, newcache);
+        for (; match; match &= match - 1) {
+            const size_t candidate = (slot + group_offset(match)) & (cache->buckets - 1);
+            const struct pkg *pkg = cache->pkgs[cache->table[candidate] - 1];
 
-            newcache->hash_table[position] = oldcache->hash_table[i];
-            oldcache->hash_table[i] = NULL;
+            if (pkg->hash == hash && streq(pkg->name, name))
+                return candidate;
         }
+
+        if (empty)
+            return (slot + group_offset(empty)) & (cache->buckets - 1);
+        slot = (slot + GROUP_WIDTH) & (cache->buckets - 1);
     }
+}
 
-    newcache->entries = oldcache->entries;
+/* Find the table slot pointing at array index "idx" */
+static size_t find_index(const struct pkgcache *cache, size_t idx)
+{
+    size_t slot = home_slot(cache, cache->pkgs[idx]->hash);
 
-    pkgcache_free(oldcache);
+    while (cache->table[slot] != idx + 1)
+        slot = next_slot(cache, slot);
 
-    return newcache;
+    return slot;
 }
 
-static struct pkgcache *pkgcache_add_pkg(struct pkgcache *cache, struct pkg *pkg,
-                                         int sorted)
+/* Backward shift deletion: pull later members of the probe sequence
+ * into the hole so lookups never stop early, no tombstones needed. */
+static void clear_slot(struct pkgcache *cache, size_t hole)
 {
-    alpm_list_t *ptr;
-    size_t position;
+    size_t slot = hole;
 
-    if (pkg == NULL || cache == NULL) {
-        return cache;
-    }
+    for (;;) {
+        slot = next_slot(cache, slot);
+
+        size_t idx = cache->table[slot];
+        if (!idx)
+            break;
 
-    if (cache->entries >= cache->limit) {
-        cache = rehash(cache);
+        size_t home = home_slot(cache, cache->pkgs[idx - 1]->hash);
+        size_t dist = (slot - home) & (cache->buckets - 1);
+        size_t hole_dist = (slot - hole) & (cache->buckets - 1);
+
+        if (dist >= hole_dist) {
+            set_slot(cache, hole, idx, cache->ctrl[slot]);
+            hole = slot;
+        }
     }
 
-    position = get_hash_position(pkg->hash, cache);
+    set_slot(cache, hole, 0, 0);
+}
+
+/* A package with the same name as one already in the cache takes its
+ * place, and the one it displaced is handed back through data for the
+ * caller to free. Only callers that have already made sure the name is
+ * new may pass NULL. */
+struct pkgcache *pkgcache_add(struct pkgcache *cache, struct pkg *pkg,
+                              struct pkg **data)
+{
+    if (data) {
+        *data = NULL;
+    }
 
-    ptr = malloc(sizeof(alpm_list_t));
-    if (ptr == NULL) {
+    if (pkg == NULL || cache == NULL) {
         return cache;
     }
 
-    ptr->data = pkg;
-    ptr->prev = ptr;
-    ptr->next = NULL;
+    if (reserve(cache, cache->entries + 1) < 0) {
+        return cache;
+    }
 
-    cache->hash_table[position] = ptr;
-    if (!sorted) {
-        cache->list = alpm_list_join(cache->list, ptr);
-    } else {
-        cache->list = alpm_list_mmerge(cache->list, ptr, pkg_cmp);
+    size_t slot = find_slot(cache, pkg->name, pkg->hash);
+    if (cache->table[slot]) {
+        struct pkg **entry = &cache->pkgs[cache->table[slot] - 1];
+        if (data) {
+            *data = *entry;
+        }
+        *entry = pkg;
+        return cache;
     }
 
-    cache->entries += 1;
+    cache->pkgs[cache->entries++] = pkg;
+    set_slot(cache, slot, cache->entries, ctrl_tag(pkg->hash));
     return cache;
 }
 
-
-struct pkgcache *pkgcache_add(struct pkgcache *cache, struct pkg *pkg)
-{
-    return pkgcache_add_pkg(cache, pkg, 0);
-}
-
 struct pkgcache *pkgcache_replace(struct pkgcache *cache, struct pkg *new, struct pkg *old)
 {
-    cache = pkgcache_remove(cache, old, NULL);
-    return pkgcache_add(cache, new);
-
-}
-
-struct pkgcache *pkgcache_add_sorted(struct pkgcache *cache, struct pkg *pkg)
-{
-    return pkgcache_add_pkg(cache, pkg, 1);
-}
+    if (cache == NULL || new == NULL || old == NULL) {
+        return cache;
+    }
 
-static size_t move_one_entry(struct pkgcache *cache,
-                             size_t start, size_t end)
-{
-    /* Iterate backwards from 'end' to 'start', seeing if any of the items
-     * would hash to 'start'. If we find one, we move it there and break.  If
-     * we get all the way back to position and find none that hash to it, we
-     * also end iteration. Iterating backwards helps prevent needless shuffles;
-     * we will never need to move more than one item per function call.  The
-     * return value is our current iteration location; if this is equal to
-     * 'start' we can stop this madness. */
-    while (end != start) {
-        alpm_list_t *i = cache->hash_table[end];
-        struct pkg *info = i->data;
-        size_t new_position = get_hash_position(info->hash, cache);
-
-        if (new_position == start) {
-            cache->hash_table[start] = i;
-            cache->hash_table[end] = NULL;
-            break;
+    /* Same name, same slot: just swap the package out in place */
+    if (new->hash == old->hash && streq(new->name, old->name)) {
+        size_t slot = find_slot(cache, old->name, old->hash);
+        if (cache->table[slot]) {
+            cache->pkgs[cache->table[slot] - 1] = new;
+            return cache;
         }
-
-        /* the odd math ensures we are always positive, e.g.
-         * e.g. (0 - 1) % 47      == -1
-         * e.g. (47 + 0 - 1) % 47 == 46 */
-        end = (cache->buckets + end - stride) % cache->buckets;
     }
-    return end;
+
+    cache = pkgcache_remove(cache, old, NULL);
+    return pkgcache_add(cache, new, NULL);
 }
 
+/* Removal moves the last package into the freed array slot. Callers
+ * removing while iterating should walk the array backwards. */
 struct pkgcache *pkgcache_remove(struct pkgcache *cache, struct pkg *pkg,
                                  struct pkg **data)
 {
-    alpm_list_t *i;
-    size_t position;
-
     if (data) {
         *data = NULL;
     }
@@ -261,94 +332,60 @@ struct pkgcache *pkgcache_remove(struct pkgcache *cache, struct pkg *pkg,
         return cache;
     }
 
-    position = pkg->hash % cache->buckets;
-    while ((i = cache->hash_table[position]) != NULL) {
-        struct pkg *info = i->data;
-
-        if (info->hash == pkg->hash &&
-           strcmp(info->name, pkg->name) == 0) {
-            size_t stop, prev;
-
-            /* remove from list and hash */
-            cache->list = alpm_list_remove_item(cache->list, i);
-            if (data) {
-                *data = info;
-            }
-            cache->hash_table[position] = NULL;
-            free(i);
-            cache->entries -= 1;
-
-            /* Potentially move entries following removed entry to keep open
-             * addressing collision resolution working. We start by finding the
-             * next null bucket to know how far we have to look. */
-            stop = position + stride;
-            while (stop >= cache->buckets) {
-                stop -= cache->buckets;
-            }
-            while (cache->hash_table[stop] != NULL && stop != position) {
-                stop += stride;
-                while (stop >= cache->buckets) {
-                    stop -= cache->buckets;
-                }
-            }
-            stop = (cache->buckets + stop - stride) % cache->buckets;
-
-            /* We now search backwards from stop to position. If we find an
-             * item that now hashes to position, we will move it, and then try
-             * to plug the new hole we just opened up, until we finally don't
-             * move anything. */
-            while ((prev = move_one_entry(cache, position, stop)) != position) {
-                position = prev;
-            }
+    size_t slot = find_slot(cache, pkg->name, pkg->hash);
+    size_t idx = cache->table[slot];
+    if (!idx) {
+        return cache;
+    }
 
-            return cache;
-        }
+    if (data) {
+        *data = cache->pkgs[idx - 1];
+    }
 
-        position += stride;
-        while (position >= cache->buckets) {
-            position -= cache->buckets;
-        }
+    clear_slot(cache, slot);
+
+    size_t last = --cache->entries;
+    if (idx - 1 != last) {
+        cache->table[find_index(cache, last)] = idx;
+        cache->pkgs[idx - 1] = cache->pkgs[last];
     }
 
     return cache;
 }
 
+/* Put the package array in name order, for writing out or listing */
+void pkgcache_sort(struct pkgcache *cache)
+{
+    qsort(cache->pkgs, cache->entries, sizeof(*cache->pkgs), pkg_cmp);
+    rebuild_table(cache);
+}
+
 void pkgcache_free(struct pkgcache *cache)
 {
     if (cache != NULL) {
-        size_t i;
-        for (i = 0; i < cache->buckets; i++) {
-            free(cache->hash_table[i]);
-        }
-        free(cache->hash_table);
+        free(cache->table);
+        free(cache->ctrl);
+        free(cache->pkgs);
     }
     free(cache);
 }
 
 struct pkg *pkgcache_find(struct pkgcache *cache, const char *name)
 {
-    alpm_list_t *lp;
-    size_t position;
-
-    if (name == NULL || cache == NULL) {
+    if (name == NULL) {
         return NULL;
     }
 
-    hash_t hash = sdbm(name);
-    position = hash % cache->buckets;
-
-    while ((lp = cache->hash_table[position]) != NULL) {
-        struct pkg *info = lp->data;
-
-        if (info->hash == hash && strcmp(info->name, name) == 0) {
-            return info;
-        }
+    return pkgcache_find_hashed(cache, name, pkgname_hash(name));
+}
 
-        position += stride;
-        while (position >= cache->buckets) {
-            position -= cache->buckets;
-		}
-	}
+/* For callers that already have the name's hash at hand */
+struct pkg *pkgcache_find_hashed(struct pkgcache *cache, const char *name, hash_t hash)
+{
+    if (name == NULL || cache == NULL) {
+        return NULL;
+    }
 
-	return NULL;
+    size_t idx = cache->table[find_slot(cache, name, hash)];
+    return idx ? cache->pkgs[idx - 1] : NULL;
 }
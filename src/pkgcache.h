@@ -7,21 +7,23 @@
 #include "package.h"
 
 struct pkgcache {
-    alpm_list_t **hash_table;
-    alpm_list_t *list;
-    size_t buckets;
+    struct pkg **pkgs;
     size_t entries;
-    size_t limit;
+    size_t capacity;
+    size_t *table;
+    uint8_t *ctrl;
+    size_t buckets;
 };
 
-hash_t sdbm(const char *str);
+hash_t pkgname_hash(const char *str);
 
 struct pkgcache *pkgcache_create(size_t size);
 void pkgcache_free(struct pkgcache *cache);
 
-struct pkgcache *pkgcache_add(struct pkgcache *cache, struct pkg *pkg);
+struct pkgcache *pkgcache_add(struct pkgcache *cache, struct pkg *pkg, struct pkg **data);
 struct pkgcache *pkgcache_replace(struct pkgcache *cache, struct pkg *new, struct pkg *old);
-struct pkgcache *pkgcache_add_sorted(struct pkgcache *cache, struct pkg *pkg);
 struct pkgcache *pkgcache_remove(struct pkgcache *cache, struct pkg *pkg, struct pkg **data);
+void pkgcache_sort(struct pkgcache *cache);
 
 struct pkg *pkgcache_find(struct pkgcache *cache, const char *name);
+struct pkg *pkgcache_find_hashed(struct pkgcache *cache, const char *name, hash_t hash);
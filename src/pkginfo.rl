@@ -1,28 +1,41 @@
 #include "pkginfo.h"
 
+#include <string.h>
 #include <err.h>
+#include <archive.h>
 #include "package.h"
 #include "util.h"
 
 %%{
     machine pkginfo;
 
-    action store {
-        parser->store[parser->pos++] = fc;
-        if (parser->pos == LINE_MAX) {
-            errx(1, "desc line too long");
-        }
+    action mark {
+        parser->mark = fpc;
+    }
+
+    action scan {
+        /* Skip straight to the end of the line, no need to walk the
+           value a byte at a time */
+        char *end = memchr(fpc, '\n', pe - fpc);
+        fexec end ? end : pe;
     }
 
     action emit {
+        const char *entry = parser->mark;
+        size_t entry_len = fpc - parser->mark;
+        parser->mark = NULL;
+
         if (parser->pos) {
-            const char *entry = parser->store;
-            const size_t entry_len = parser->pos;
-            parser->store[parser->pos] = 0;
+            /* The value started in an earlier block and was saved off
+               to the store. Finish it off there. */
+            pkginfo_store(parser, entry, entry_len);
+            entry = parser->store;
+            entry_len = parser->pos;
             parser->pos = 0;
+        }
 
+        if (entry_len)
             package_set(pkg, parser->entry, entry, entry_len);
-        }
     }
 
     header = 'pkgname'     %{ parser->entry = PKG_PKGNAME; }
@@ -46,7 +59,7 @@
            | 'backup'      %{ parser->entry = PKG_BACKUP; }
            | 'makepkgopt'  %{ parser->entry = PKG_MAKEPKGOPT; };
 
-    entry = header ' = ' [^\n]* @store %emit '\n';
+    entry = header ' = ' ( [^\n]* >mark $scan %emit ) '\n';
     comment = '#' [^\n]* '\n';
 
     main := ( entry | comment )*;
@@ -54,6 +67,17 @@
 
 %%write data nofinal;
 
+static void pkginfo_store(struct pkginfo_parser *parser, const char *data, size_t len)
+{
+    if (parser->pos + len >= LINE_MAX) {
+        errx(1, "pkginfo line too long");
+    }
+
+    memcpy(&parser->store[parser->pos], data, len);
+    parser->pos += len;
+    parser->store[parser->pos] = 0;
+}
+
 void pkginfo_parser_init(struct pkginfo_parser *parser)
 {
     *parser = (struct pkginfo_parser){0};
@@ -67,6 +91,12 @@ ssize_t pkginfo_parser_feed(struct pkginfo_parser *parser, struct pkg *pkg,
     char *p = buf;
     char *pe = p + buf_len;
 
+    /* Values are handed to package_set straight out of the buffer. If
+       one was cut short by the end of the last block its start is in
+       the store, and the rest of it starts right here. */
+    if (parser->pos)
+        parser->mark = buf;
+
     %%access parser->;
     %%write exec;
 
@@ -74,6 +104,11 @@ ssize_t pkginfo_parser_feed(struct pkginfo_parser *parser, struct pkg *pkg,
     if (parser->cs == pkginfo_error)
         return -1;
 
+    if (parser->mark) {
+        pkginfo_store(parser, parser->mark, pe - parser->mark);
+        parser->mark = NULL;
+    }
+
     return buf_len;
 }
 
@@ -86,7 +121,11 @@ ssize_t read_pkginfo(struct archive *archive, struct pkg *pkg)
 
     for (;;) {
         size_t bufsize;
-        archive_read(archive, &buf, &bufsize);
+        int status = archive_read(archive, &buf, &bufsize);
+        if (status == ARCHIVE_EOF)
+            break;
+        if (status < ARCHIVE_WARN)
+            return -1;
 
         ssize_t result = pkginfo_parser_feed(&parser, pkg, buf, bufsize);
         if (result < 0) {
@@ -94,8 +133,6 @@ ssize_t read_pkginfo(struct archive *archive, struct pkg *pkg)
         } else {
             nbytes_r += result;
         }
-
-        break;
     }
 
     return nbytes_r;
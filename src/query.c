@@ -0,0 +1,353 @@
+#include "query.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <alpm.h>
+
+#include "arena.h"
+#include "util.h"
+
+enum depmod {
+    DEP_ANY,
+    DEP_EQ,
+    DEP_GE,
+    DEP_LE,
+    DEP_GT,
+    DEP_LT
+};
+
+struct provision {
+    struct pkg *pkg;
+    const char *version;
+};
+
+struct query_name {
+    const char *name;
+    hash_t hash;
+    alpm_list_t *providers;
+    alpm_list_t *dependents;
+    alpm_list_t *replacers;
+};
+
+/* Everything up to the version constraint, or an optional dependency's
+ * description */
+static inline size_t name_length(const char *str)
+{
+    return strcspn(str, "<>=:");
+}
+
+static enum depmod parse_depmod(const char *str, const char **version)
+{
+    str += name_length(str);
+    *version = NULL;
+
+    switch (str[0]) {
+    case '=':
+        *version = str + 1;
+        return DEP_EQ;
+    case '>':
+        *version = str[1] == '=' ? str + 2 : str + 1;
+        return str[1] == '=' ? DEP_GE : DEP_GT;
+    case '<':
+        *version = str[1] == '=' ? str + 2 : str + 1;
+        return str[1] == '=' ? DEP_LE : DEP_LT;
+    default:
+        return DEP_ANY;
+    }
+}
+
+static bool satisfies(const struct provision *prov, const char *depend)
+{
+    const char *version;
+    const enum depmod mod = parse_depmod(depend, &version);
+
+    if (mod == DEP_ANY)
+        return true;
+    if (!prov->version)
+        return false;
+
+    const int cmp = alpm_pkg_vercmp(prov->version, version);
+    switch (mod) {
+    case DEP_EQ:
+        return cmp == 0;
+    case DEP_GE:
+        return cmp >= 0;
+    case DEP_LE:
+        return cmp <= 0;
+    case DEP_GT:
+        return cmp > 0;
+    case DEP_LT:
+        return cmp < 0;
+    default:
+        return true;
+    }
+}
+
+static struct query_name *probe(const struct query_index *index, const char *name, hash_t hash)
+{
+    const size_t mask = index->buckets - 1;
+
+    for (size_t i = hash & mask;; i = (i + 1) & mask) {
+        struct query_name *slot = &index->names[i];
+        if (!slot->name || (slot->hash == hash && streq(slot->name, name)))
+            return slot;
+    }
+}
+
+static void grow(struct query_index *index)
+{
+    struct query_index grown = {
+        .buckets = index->buckets ? index->buckets * 2 : 64,
+        .count = index->count
+    };
+
+    grown.names = calloc(grown.buckets, sizeof(*grown.names));
+    check_null(grown.names, "failed to allocate query index");
+
+    for (size_t i = 0; i < index->buckets; ++i) {
+        struct query_name *slot = &index->names[i];
+        if (slot->name)
+            *probe(&grown, slot->name, slot->hash) = *slot;
+    }
+
+    free(index->names);
+    *index = grown;
+}
+
+static struct query_name *intern_name(struct query_index *index, const char *str)
+{
+    const char *name = arena_intern(arena_get(), str, name_length(str));
+    const hash_t hash = pkgname_hash(name);
+
+    if ((index->count + 1) * 4 > index->buckets * 3)
+        grow(index);
+
+    struct query_name *slot = probe(index, name, hash);
+    if (!slot->name) {
+        slot->name = name;
+        slot->hash = hash;
+        ++index->count;
+    }
+    return slot;
+}
+
+static struct query_name *lookup(const struct query_index *index, const char *str)
+{
+    if (!index->buckets)
+        return NULL;
+
+    const size_t len = name_length(str);
+    _cleanup_free_ char *copy = NULL;
+    const char *name = str;
+
+    if (str[len]) {
+        copy = strndup(str, len);
+        check_null(copy, "failed to allocate memory");
+        name = copy;
+    }
+
+    struct query_name *slot = probe(index, name, pkgname_hash(name));
+    return slot->name ? slot : NULL;
+}
+
+static void add_provision(struct query_index *index, struct pkg *pkg,
+                          const char *str, const char *version)
+{
+    struct provision *prov = malloc(sizeof(*prov));
+    check_null(prov, "failed to allocate memory");
+    *prov = (struct provision){ .pkg = pkg, .version = version };
+
+    struct query_name *slot = intern_name(index, str);
+    slot->providers = alpm_list_add(slot->providers, prov);
+}
+
+static void add_dependent(struct query_index *index, struct pkg *pkg, const char *depend)
+{
+    struct query_dep *dep = malloc(sizeof(*dep));
+    check_null(dep, "failed to allocate memory");
+    *dep = (struct query_dep){ .pkg = pkg, .depend = depend };
+
+    struct query_name *slot = intern_name(index, depend);
+    slot->dependents = alpm_list_add(slot->dependents, dep);
+}
+
+void query_index_build(struct query_index *index, struct pkgcache *cache)
+{
+    *index = (struct query_index){0};
+
+    for (size_t i = 0; i < cache->entries; ++i) {
+        struct pkg *pkg = cache->pkgs[i];
+        const alpm_list_t *node;
+
+        add_provision(index, pkg, pkg->name, pkg->version);
+
+        for (node = pkg->provides; node; node = node->next) {
+            const char *version = strchr(node->data, '=');
+            add_provision(index, pkg, node->data, version ? version + 1 : NULL);
+        }
+
+        for (node = pkg->depends; node; node = node->next)
+            add_dependent(index, pkg, node->data);
+
+        for (node = pkg->replaces; node; node = node->next) {
+            struct query_name *slot = intern_name(index, node->data);
+            slot->replacers = alpm_list_add(slot->replacers, pkg);
+        }
+    }
+}
+
+void query_index_free(struct query_index *index)
+{
+    for (size_t i = 0; i < index->buckets; ++i) {
+        struct query_name *slot = &index->names[i];
+        if (!slot->name)
+            continue;
+
+        alpm_list_free_inner(slot->providers, free);
+        alpm_list_free(slot->providers);
+        alpm_list_free_inner(slot->dependents, free);
+        alpm_list_free(slot->dependents);
+        alpm_list_free(slot->replacers);
+    }
+
+    free(index->names);
+    *index = (struct query_index){0};
+}
+
+bool query_satisfied(const struct query_index *index, const char *depend,
+                     const alpm_list_t *without)
+{
+    struct query_name *entry = lookup(index, depend);
+    if (!entry)
+        return false;
+
+    for (const alpm_list_t *node = entry->providers; node; node = node->next) {
+        const struct provision *prov = node->data;
+
+        if (!alpm_list_find_ptr(without, prov->pkg) && satisfies(prov, depend))
+            return true;
+    }
+    return false;
+}
+
+/* Takes a dependency with a version constraint as readily as a bare
+ * name, and only returns the packages meeting it */
+alpm_list_t *query_providers(const struct query_index *index, const char *name)
+{
+    struct query_name *entry = lookup(index, name);
+    alpm_list_t *providers = NULL;
+
+    if (!entry)
+        return NULL;
+
+    for (const alpm_list_t *node = entry->providers; node; node = node->next) {
+        const struct provision *prov = node->data;
+
+        if (satisfies(prov, name) && !alpm_list_find_ptr(providers, prov->pkg))
+            providers = alpm_list_add(providers, prov->pkg);
+    }
+    return providers;
+}
+
+alpm_list_t *query_replacers(const struct query_index *index, const char *name)
+{
+    struct query_name *entry = lookup(index, name);
+    return entry ? alpm_list_copy(entry->replacers) : NULL;
+}
+
+static bool provided_by(struct query_name *entry, struct pkg *pkg,
+                        const char *depend)
+{
+    for (const alpm_list_t *node = entry->providers; node; node = node->next) {
+        const struct provision *prov = node->data;
+
+        if (prov->pkg == pkg && satisfies(prov, depend))
+            return true;
+    }
+    return false;
+}
+
+/* The dependencies pkg satisfies through one of its names. With a list
+ * of dropped packages, only those of the packages staying behind that
+ * nothing left would satisfy. */
+static alpm_list_t *collect_rdepends(alpm_list_t *list, const struct query_index *index,
+                                     struct query_name *entry, struct pkg *pkg,
+                                     const alpm_list_t *dropped)
+{
+    for (const alpm_list_t *node = entry->dependents; node; node = node->next) {
+        struct query_dep *dep = node->data;
+
+        if (dep->pkg == pkg || !provided_by(entry, pkg, dep->depend))
+            continue;
+        if (dropped && (alpm_list_find_ptr(dropped, dep->pkg) ||
+                        query_satisfied(index, dep->depend, dropped)))
+            continue;
+
+        list = alpm_list_add(list, dep);
+    }
+    return list;
+}
+
+/* A package listing the same name twice, say as its own name and as a
+ * provision, would otherwise have its dependents reported twice */
+static alpm_list_t *find_rdepends(alpm_list_t *list, const struct query_index *index,
+                                  struct pkg *pkg, const alpm_list_t *dropped)
+{
+    alpm_list_t *seen = NULL;
+    struct query_name *entry = lookup(index, pkg->name);
+
+    if (entry) {
+        list = collect_rdepends(list, index, entry, pkg, dropped);
+        seen = alpm_list_add(seen, entry);
+    }
+
+    for (const alpm_list_t *node = pkg->provides; node; node = node->next) {
+        entry = lookup(index, node->data);
+        if (!entry || alpm_list_find_ptr(seen, entry))
+            continue;
+
+        list = collect_rdepends(list, index, entry, pkg, dropped);
+        seen = alpm_list_add(seen, entry);
+    }
+
+    alpm_list_free(seen);
+    return list;
+}
+
+/* A list of struct query_dep */
+alpm_list_t *query_rdepends(const struct query_index *index, struct pkg *pkg)
+{
+    return find_rdepends(NULL, index, pkg, NULL);
+}
+
+/* A list of the dependency strings nothing in the index satisfies */
+alpm_list_t *query_unresolved(const struct query_index *index, struct pkg *pkg)
+{
+    alpm_list_t *unresolved = NULL;
+
+    for (const alpm_list_t *node = pkg->depends; node; node = node->next) {
+        if (!query_satisfied(index, node->data, NULL))
+            unresolved = alpm_list_add(unresolved, node->data);
+    }
+    return unresolved;
+}
+
+/* A list of struct query_dep: what dropping these packages would leave
+ * unsatisfied. Dependencies that already weren't satisfied, say by
+ * packages from another repository, aren't counted. */
+alpm_list_t *query_broken(const struct query_index *index, const alpm_list_t *dropped)
+{
+    alpm_list_t *broken = NULL;
+
+    for (const alpm_list_t *node = dropped; node; node = node->next) {
+        alpm_list_t *deps = find_rdepends(NULL, index, node->data, dropped);
+
+        /* Two dropped packages may both have satisfied the same one */
+        for (const alpm_list_t *dep = deps; dep; dep = dep->next) {
+            if (!alpm_list_find_ptr(broken, dep->data))
+                broken = alpm_list_add(broken, dep->data);
+        }
+        alpm_list_free(deps);
+    }
+    return broken;
+}
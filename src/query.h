@@ -0,0 +1,39 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <alpm_list.h>
+#include "pkgcache.h"
+
+struct query_name;
+
+/* A dependency, as written in depends, of the package declaring it */
+struct query_dep {
+    struct pkg *pkg;
+    const char *depend;
+};
+
+/* Every name packages provide, depend on or replace, built in one pass
+ * over the cache, so dependency questions about the whole repository
+ * are answered without going back to the database. Resolution follows
+ * pacman's: a package provides its own name at its own version, and an
+ * unversioned provision never satisfies a versioned dependency. */
+struct query_index {
+    struct query_name *names;
+    size_t count;
+    size_t buckets;
+};
+
+void query_index_build(struct query_index *index, struct pkgcache *cache);
+void query_index_free(struct query_index *index);
+
+bool query_satisfied(const struct query_index *index, const char *depend,
+                     const alpm_list_t *without);
+
+/* The lists hold pointers into the index and the cache: free them with
+ * alpm_list_free once done */
+alpm_list_t *query_providers(const struct query_index *index, const char *name);
+alpm_list_t *query_replacers(const struct query_index *index, const char *name);
+alpm_list_t *query_rdepends(const struct query_index *index, struct pkg *pkg);
+alpm_list_t *query_unresolved(const struct query_index *index, struct pkg *pkg);
+alpm_list_t *query_broken(const struct query_index *index, const alpm_list_t *dropped);
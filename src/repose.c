@@ -17,19 +17,27 @@
 #include <sys/utsname.h>
 #include <sys/stat.h>
 #include <sys/ioctl.h>
-#include <linux/btrfs.h>
+#include <linux/fs.h>
 #include <locale.h>
+#include <limits.h>
 
 #include "database.h"
 #include "filecache.h"
+#include "jobs.h"
 #include "package.h"
 #include "pkgcache.h"
 #include "filters.h"
 #include "signing.h"
+#include "statcache.h"
+#include "dirsnap.h"
+#include "stats.h"
+#include "watch.h"
+#include "query.h"
+#include "arena.h"
 #include "base64.h"
 #include "util.h"
 
-struct config config = {0};
+struct config config = { .compression_level = -1 };
 
 void trace(const char *fmt, ...)
 {
@@ -45,6 +53,7 @@ void trace(const char *fmt, ...)
 static _noreturn_ void usage(FILE *out)
 {
     fprintf(out, "usage: %s [options] <database> [pkgs|deltas ...]\n", program_invocation_short_name);
+    fprintf(out, "       %s [options] --batch=FILE\n", program_invocation_short_name);
     fputs("Options\n"
           " -h, --help            display this help and exit\n"
           " -V, --version         display version\n"
@@ -60,8 +69,30 @@ static _noreturn_ void usage(FILE *out)
           " -J, --xz              filter the archive through xz\n"
           " -z, --gzip            filter the archive through gzip\n"
           " -Z, --compress        filter the archive through compress\n"
+          "     --zstd            filter the archive through zstd\n"
+          "     --compression-level=LEVEL\n"
+          "                       set the compression level\n"
+          "     --compression-threads=N\n"
+          "                       compress with N threads (xz and zstd only)\n"
           "     --reflink         make repose make reflinks instead of symlinks\n"
-          "     --rebuild         force rebuild the repo\n", out);
+          "     --rebuild         force rebuild the repo\n"
+          "     --jobs=N          scan packages with N parallel jobs\n"
+          "     --cache           keep a cache of package metadata\n"
+          "     --block-size=SIZE read archives in blocks of SIZE bytes\n"
+          "     --verify-packages verify package signatures before adding them\n"
+          "     --stats[=json]    report time spent per phase and work done\n"
+          "     --watch[=DELAY]   keep running, updating the repo when the pool\n"
+          "                       changes, once it's been quiet for DELAY seconds\n"
+          "     --index           write and load an index for fast database loading\n"
+          "     --batch=FILE      update every database listed in FILE from one\n"
+          "                       scan of the pool\n"
+          "     --stream          read file lists while writing the files database\n"
+          "                       instead of keeping them in memory\n"
+          "     --delta[=COUNT]   also publish deltas against the previous\n"
+          "                       database, keeping the last COUNT\n"
+          "     --query=TYPE      answer a dependency query: rdepends, unresolved,\n"
+          "                       provides or replaces\n"
+          "     --force           drop packages even if others depend on them\n", out);
 
     exit(out == stderr ? EXIT_FAILURE : EXIT_SUCCESS);
 }
@@ -104,23 +135,30 @@ static _noreturn_ void elephant(void)
 static int clone_file(const struct repo *repo, const char *filename)
 {
     _cleanup_close_ int src = openat(repo->poolfd, filename, O_RDONLY);
+    stats_add(STAT_LINK_SYSCALLS, 1);
     if (src < 0)
 	return src;
 
     _cleanup_close_ int dest = openat(repo->rootfd, filename, O_WRONLY | O_TRUNC, 0664);
+    stats_add(STAT_LINK_SYSCALLS, 1);
     if (dest < 0 && errno == ENOENT) {
         dest = openat(repo->rootfd, filename, O_WRONLY | O_CREAT, 0664);
+        stats_add(STAT_LINK_SYSCALLS, 1);
     }
     if (dest < 0)
 	return dest;
 
-    return ioctl(dest, BTRFS_IOC_CLONE, src);
+    /* FICLONE is the generic spelling of BTRFS_IOC_CLONE, so this
+     * works on btrfs, XFS, bcachefs and anything else with reflinks */
+    stats_add(STAT_LINK_SYSCALLS, 1);
+    return ioctl(dest, FICLONE, src);
 }
 
 static int symlink_file(const struct repo *repo, const char *path1, const char *path2)
 {
     _cleanup_free_ char* canonical_path1 = canonicalize_file_name(path1);
     int ret = symlinkat(canonical_path1, repo->rootfd, path2);
+    stats_add(STAT_LINK_SYSCALLS, 1);
     if (ret < 0 && errno == EEXIST)
         return 0;
     return ret;
@@ -129,10 +167,13 @@ static int symlink_file(const struct repo *repo, const char *path1, const char *
 static inline int unlink_file(const struct repo *repo, const char *filename)
 {
     struct stat st;
+    stats_add(STAT_LINK_SYSCALLS, 1);
     if (fstatat(repo->rootfd, filename, &st, AT_SYMLINK_NOFOLLOW) < 0)
         return errno != ENOENT ? -1 : 0;
-    if (S_ISLNK(st.st_mode))
+    if (S_ISLNK(st.st_mode)) {
+        stats_add(STAT_LINK_SYSCALLS, 1);
         return unlinkat(repo->rootfd, filename, 0);
+    }
     return 0;
 }
 
@@ -145,13 +186,28 @@ static int clone_pkg(const struct repo *repo, const struct pkg *pkg)
     return clone_file(repo, pkg->filename);
 }
 
+/* Answer from the pool snapshot when there is one; every check that
+ * doesn't hit the filesystem is a round trip saved on network mounts */
+static bool pool_contains(const struct repo *repo, const char *filename)
+{
+    if (repo->poolsnap)
+        return dirsnap_find(repo->poolsnap, filename) != NULL;
+
+    if (faccessat(repo->poolfd, filename, F_OK, 0) < 0) {
+        if (errno != ENOENT)
+            err(EXIT_FAILURE, "couldn't access package %s", filename);
+        return false;
+    }
+    return true;
+}
+
 static int symlink_pkg(const struct repo *repo, const struct pkg *pkg)
 {
     _cleanup_free_ char *link = joinstring(repo->pool, "/", pkg->filename, NULL);
-    _cleanup_free_ char *siglink = joinstring(link, ".sig", NULL);
+    _cleanup_free_ char *signame = joinstring(pkg->filename, ".sig", NULL);
 
-    if (access(siglink, F_OK) != -1) {
-	_cleanup_free_ char *signame = joinstring(pkg->filename, ".sig", NULL);
+    if (pool_contains(repo, signame)) {
+	_cleanup_free_ char *siglink = joinstring(link, ".sig", NULL);
 	if (symlink_file(repo, siglink, signame) < 0 && errno != EEXIST)
 	    err(1, "failed to symlink signature %s", signame);
     }
@@ -159,8 +215,25 @@ static int symlink_pkg(const struct repo *repo, const struct pkg *pkg)
     return symlink_file(repo, link, pkg->filename);
 }
 
+/* Packages that didn't change since the last run were linked back then.
+ * Only check that the link is still there instead of redoing it. */
+static bool is_linked(const struct repo *repo, const struct pkg *pkg)
+{
+    struct stat st;
+    stats_add(STAT_LINK_SYSCALLS, 1);
+    if (fstatat(repo->rootfd, pkg->filename, &st, AT_SYMLINK_NOFOLLOW) < 0)
+        return false;
+
+    if (config.reflink)
+        return S_ISREG(st.st_mode) && (size_t)st.st_size == pkg->size;
+    return S_ISLNK(st.st_mode);
+}
+
 static inline void link_pkg(const struct repo *repo, const struct pkg *pkg)
 {
+    if (!pkg->dirty && is_linked(repo, pkg))
+        return;
+
     if (config.reflink) {
         check_posix(clone_pkg(repo, pkg),
                     "failed to make reflink for %s", pkg->filename);
@@ -180,14 +253,66 @@ static inline int unlink_pkg(const struct repo *repo, const struct pkg *pkg)
     return unlink_file(repo, signame);
 }
 
+static void link_one(void *data, size_t idx)
+{
+    const struct repo *repo = data;
+    link_pkg(repo, repo->cache->pkgs[idx]);
+}
+
 static void link_db(struct repo *repo)
 {
     if (!repo->pool)
         return;
 
-    alpm_list_t *node;
-    for (node = repo->cache->list; node; node = node->next)
-        link_pkg(repo, node->data);
+    /* Each link is a handful of independent syscalls; spread them over
+     * the worker pool rather than issuing them one by one */
+    stats_begin(PHASE_LINK);
+    run_jobs(config.jobs, repo->cache->entries, link_one, repo);
+    stats_end(PHASE_LINK);
+}
+
+/* Remember what a delta will need to tell clients to remove */
+static void record_removal(struct repo *repo, const struct pkg *pkg)
+{
+    if (config.deltas)
+        repo->removed = alpm_list_add(repo->removed, joinstring(pkg->name, "-", pkg->version, NULL));
+}
+
+/* Refuse to leave packages behind with dependencies that only the
+ * packages being dropped satisfied */
+static void check_drop(struct repo *repo, alpm_list_t *targets)
+{
+    alpm_list_t *dropped = NULL;
+
+    if (!targets || !repo->cache)
+        return;
+
+    for (size_t i = 0; i < repo->cache->entries; ++i) {
+        struct pkg *pkg = repo->cache->pkgs[i];
+
+        if (match_targets(pkg, targets))
+            dropped = alpm_list_add(dropped, pkg);
+    }
+
+    if (!dropped)
+        return;
+
+    struct query_index index;
+    query_index_build(&index, repo->cache);
+
+    alpm_list_t *broken = query_broken(&index, dropped);
+    for (const alpm_list_t *node = broken; node; node = node->next) {
+        const struct query_dep *dep = node->data;
+        warnx("%s depends on %s", dep->pkg->name, dep->depend);
+    }
+
+    const bool refuse = broken != NULL;
+    alpm_list_free(broken);
+    alpm_list_free(dropped);
+    query_index_free(&index);
+
+    if (refuse)
+        errx(EXIT_FAILURE, "refusing to drop packages still depended on, use --force to drop them anyway");
 }
 
 static void drop_from_repo(struct repo *repo, alpm_list_t *targets)
@@ -195,13 +320,14 @@ static void drop_from_repo(struct repo *repo, alpm_list_t *targets)
     if (!targets || !repo->cache)
         return;
 
-    alpm_list_t *node;
-    for (node = repo->cache->list; node; node = node->next) {
-        struct pkg *pkg = node->data;
+    /* Walk backwards: removal fills the hole from the end */
+    for (size_t i = repo->cache->entries; i-- > 0;) {
+        struct pkg *pkg = repo->cache->pkgs[i];
 
         if (match_targets(pkg, targets)) {
             trace("dropping %s\n", pkg->name);
 
+            record_removal(repo, pkg);
             repo->cache = pkgcache_remove(repo->cache, pkg, NULL);
             unlink_pkg(repo, pkg);
             package_free(pkg);
@@ -210,30 +336,17 @@ static void drop_from_repo(struct repo *repo, alpm_list_t *targets)
     }
 }
 
-static void list_repo(struct repo *repo)
-{
-    alpm_list_t *node;
-    for (node = repo->cache->list; node; node = node->next) {
-        struct pkg *pkg = node->data;
-
-        printf("%s %s\n", pkg->name, pkg->version);
-    }
-}
-
 static void reduce_repo(struct repo *repo)
 {
     if (!repo->cache)
         return;
 
-    alpm_list_t *node;
-    for (node = repo->cache->list; node; node = node->next) {
-        struct pkg *pkg = node->data;
-
-        if (faccessat(repo->poolfd, pkg->filename, F_OK, 0) < 0) {
-            if (errno != ENOENT)
-                err(EXIT_FAILURE, "couldn't access package %s", pkg->filename);
+    for (size_t i = repo->cache->entries; i-- > 0;) {
+        struct pkg *pkg = repo->cache->pkgs[i];
 
+        if (!pool_contains(repo, pkg->filename)) {
             trace("dropping %s\n", pkg->name);
+            record_removal(repo, pkg);
             repo->cache = pkgcache_remove(repo->cache, pkg, NULL);
             unlink_pkg(repo, pkg);
             package_free(pkg);
@@ -247,15 +360,15 @@ static void update_repo(struct repo *repo, struct pkgcache *src)
     if (!repo->cache)
         repo->cache = pkgcache_create(src->entries);
 
-    alpm_list_t *node;
-    for (node = src->list; node; node = node->next) {
-        struct pkg *pkg = node->data;
+    for (size_t i = 0; i < src->entries; ++i) {
+        struct pkg *pkg = src->pkgs[i];
         struct pkg *old = pkgcache_find(repo->cache, pkg->name);
 
         if (!old) {
             /* The package isn't already in the database. Just add it */
             trace("adding %s %s\n", pkg->name, pkg->version);
-            repo->cache = pkgcache_add(repo->cache, pkg);
+            pkg->dirty = true;
+            repo->cache = pkgcache_add(repo->cache, pkg, NULL);
             repo->dirty = true;
             continue;
         }
@@ -284,6 +397,8 @@ static void update_repo(struct repo *repo, struct pkgcache *src)
             continue;
         }
 
+        pkg->dirty = true;
+        record_removal(repo, old);
         repo->cache = pkgcache_replace(repo->cache, pkg, old);
         unlink_pkg(repo, pkg);
         package_free(old);
@@ -309,6 +424,14 @@ static int load_db(struct repo *repo, const char *filename)
         return -1;
     }
 
+    /* A fresh index has everything the database does, ready to use */
+    struct stat st;
+    if (repo->index.map && fstat(dbfd, &st) == 0 &&
+        dbindex_load(&repo->index, &repo->cache, st.st_mtime) == 0) {
+        trace("loaded %s from its index\n", filename);
+        return 0;
+    }
+
     if (load_database(dbfd, &repo->cache) < 0) {
         warn("failed to open %s database", filename);
         return -1;
@@ -317,6 +440,139 @@ static int load_db(struct repo *repo, const char *filename)
     return 0;
 }
 
+static int target_cmp(const void *p1, const void *p2)
+{
+    return strcmp(p1, p2);
+}
+
+/* Exact names can be answered straight from the index, without
+ * loading the database at all. They're listed in name order and only
+ * once each, just as they would be off the database. */
+static bool list_from_index(struct repo *repo, alpm_list_t *targets)
+{
+    if (!repo->index.map || !targets)
+        return false;
+
+    for (alpm_list_t *node = targets; node; node = node->next) {
+        const char *version = dbindex_lookup(&repo->index, node->data);
+        if (!version)
+            return false;
+    }
+
+    alpm_list_t *sorted = alpm_list_msort(alpm_list_copy(targets),
+                                          alpm_list_count(targets), target_cmp);
+    const char *last = NULL;
+
+    for (alpm_list_t *node = sorted; node; node = node->next) {
+        const char *name = node->data;
+        if (last && streq(last, name))
+            continue;
+
+        printf("%s %s\n", name, dbindex_lookup(&repo->index, name));
+        last = name;
+    }
+
+    alpm_list_free(sorted);
+    return true;
+}
+
+static void list_repo(struct repo *repo, alpm_list_t *targets)
+{
+    if (list_from_index(repo, targets))
+        return;
+
+    repo->cache = pkgcache_create(100);
+    if (load_db(repo, repo->dbname) < 0)
+        errx(EXIT_FAILURE, "failed to open database %s", repo->dbname);
+
+    pkgcache_sort(repo->cache);
+
+    for (size_t i = 0; i < repo->cache->entries; ++i) {
+        struct pkg *pkg = repo->cache->pkgs[i];
+
+        if (!targets || match_targets(pkg, targets))
+            printf("%s %s\n", pkg->name, pkg->version);
+    }
+}
+
+enum query_type {
+    QUERY_NONE,
+    QUERY_RDEPENDS,
+    QUERY_UNRESOLVED,
+    QUERY_PROVIDES,
+    QUERY_REPLACES
+};
+
+static enum query_type parse_query(const char *str)
+{
+    if (streq(str, "rdepends"))
+        return QUERY_RDEPENDS;
+    if (streq(str, "unresolved"))
+        return QUERY_UNRESOLVED;
+    if (streq(str, "provides"))
+        return QUERY_PROVIDES;
+    if (streq(str, "replaces"))
+        return QUERY_REPLACES;
+    errx(EXIT_FAILURE, "invalid query: %s", str);
+}
+
+static void print_packages(alpm_list_t *pkgs)
+{
+    for (const alpm_list_t *node = pkgs; node; node = node->next) {
+        const struct pkg *pkg = node->data;
+        printf("%s %s\n", pkg->name, pkg->version);
+    }
+    alpm_list_free(pkgs);
+}
+
+/* Answered from one index built over the loaded cache. rdepends and
+ * unresolved take packages as targets, provides and replaces names. */
+static void query_repo(struct repo *repo, enum query_type type, alpm_list_t *targets)
+{
+    struct query_index index;
+
+    pkgcache_sort(repo->cache);
+    query_index_build(&index, repo->cache);
+
+    switch (type) {
+    case QUERY_RDEPENDS:
+    case QUERY_UNRESOLVED:
+        for (size_t i = 0; i < repo->cache->entries; ++i) {
+            struct pkg *pkg = repo->cache->pkgs[i];
+            alpm_list_t *list, *node;
+
+            if (targets && !match_targets(pkg, targets))
+                continue;
+
+            if (type == QUERY_RDEPENDS) {
+                list = query_rdepends(&index, pkg);
+                for (node = list; node; node = node->next) {
+                    const struct query_dep *dep = node->data;
+                    printf("%s %s\n", dep->pkg->name, dep->depend);
+                }
+            } else {
+                list = query_unresolved(&index, pkg);
+                for (node = list; node; node = node->next)
+                    printf("%s %s\n", pkg->name, (char *)node->data);
+            }
+            alpm_list_free(list);
+        }
+        break;
+    case QUERY_PROVIDES:
+        for (const alpm_list_t *node = targets; node; node = node->next)
+            print_packages(query_providers(&index, node->data));
+        break;
+    case QUERY_REPLACES:
+        for (const alpm_list_t *node = targets; node; node = node->next)
+            print_packages(query_replacers(&index, node->data));
+        break;
+    default:
+        break;
+    }
+
+    query_index_free(&index);
+}
+
 static void check_signature(struct repo *repo, const char *name)
 {
     _cleanup_free_ char *sig = joinstring(name, ".sig", NULL);
@@ -326,7 +582,7 @@ static void check_signature(struct repo *repo, const char *name)
             errx(EXIT_FAILURE, "repo signature is invalid or corrupt!");
         } else {
             trace("found a valid signature, will resign...\n");
-            config.sign = true;
+            repo->sign = true;
         }
     } else if (errno != ENOENT) {
         err(EXIT_FAILURE, "countn't access %s", name);
@@ -346,6 +602,7 @@ static int init_repo(struct repo *repo, const char *reponame, bool files,
         repo->poolfd = repo->rootfd;
     }
 
+    repo->rootname = reponame;
     repo->dbname = joinstring(reponame, ".db", NULL);
     repo->filesname = joinstring(reponame, ".files", NULL);
 
@@ -358,12 +615,18 @@ static int init_repo(struct repo *repo, const char *reponame, bool files,
         }
     }
 
-    if (config.sign) {
+    repo->sign = config.sign;
+    if (repo->sign) {
         check_signature(repo, repo->dbname);
         if (repo->filesname)
             check_signature(repo, repo->filesname);
     }
 
+    /* Only used when asked for, like writing it. Stays mapped for good:
+     * packages loaded from it point into it */
+    if (config.index)
+        dbindex_open(&repo->index, repo->rootfd, repo->dbname);
+
     if (load_cache) {
         repo->cache = pkgcache_create(100);
 
@@ -373,14 +636,183 @@ static int init_repo(struct repo *repo, const char *reponame, bool files,
             repo->dirty = true;
             return -1;
         }
+        repo->tracked = true;
 
-        if (repo->filesname)
-            return load_db(repo, repo->filesname);
+        /* Don't parse the files database. Unchanged packages have
+           their entries copied over from it raw when it's rewritten,
+           and changed ones get their file lists from the package. */
+        if (repo->filesname && faccessat(repo->rootfd, repo->filesname, F_OK, 0) < 0) {
+            if (errno != ENOENT)
+                err(EXIT_FAILURE, "failed to access database %s", repo->filesname);
+            repo->dirty = true;
+            return -1;
+        }
     }
 
     return 0;
 }
 
+static void publish_repo(struct repo *repo)
+{
+    if (!repo->dirty) {
+        trace("repo does not need updating\n");
+        return;
+    }
+
+    write_databases(repo);
+    link_db(repo);
+
+    /* What was just written is the baseline for the next update */
+    for (size_t i = 0; i < repo->cache->entries; ++i)
+        repo->cache->pkgs[i]->dirty = false;
+    repo->dirty = false;
+
+    alpm_list_free_inner(repo->removed, free);
+    alpm_list_free(repo->removed);
+    repo->removed = NULL;
+    repo->tracked = true;
+}
+
+/* Packages update_repo didn't take are still ours to free */
+static void release_filecache(struct repo *repo, struct pkgcache *filecache)
+{
+    for (size_t i = 0; i < filecache->entries; ++i) {
+        struct pkg *pkg = filecache->pkgs[i];
+        if (pkgcache_find(repo->cache, pkg->name) != pkg)
+            package_free(pkg);
+    }
+    pkgcache_free(filecache);
+}
+
+/* Our own databases, and uploads still in flight under a hidden
+ * temporary name, aren't worth waking up for */
+static bool is_ignored(const char *name, const char *rootname)
+{
+    const size_t len = strlen(rootname);
+    return name[0] == '.' || (strncmp(name, rootname, len) == 0 && name[len] == '.');
+}
+
+static int name_cmp(const void *p1, const void *p2)
+{
+    return strcmp(*(char *const *)p1, *(char *const *)p2);
+}
+
+/* A change to either a package or its signature means looking at both */
+static size_t collect_changes(const struct watch *watch, const char *rootname, char ***out)
+{
+    char **names = calloc(watch->count * 2 + 1, sizeof(char *));
+    check_null(names, "failed to allocate watch events");
+    size_t count = 0;
+
+    for (size_t i = 0; i < watch->count; ++i) {
+        const char *name = watch->names[i];
+        if (is_ignored(name, rootname))
+            continue;
+
+        const char *ext = strrchr(name, '.');
+        names[count++] = strdup(name);
+        if (ext && streq(ext, ".sig"))
+            names[count++] = strndup(name, ext - name);
+        else
+            names[count++] = joinstring(name, ".sig", NULL);
+    }
+
+    qsort(names, count, sizeof(char *), name_cmp);
+
+    size_t unique = 0;
+    for (size_t i = 0; i < count; ++i) {
+        if (unique && streq(names[unique - 1], names[i]))
+            free(names[i]);
+        else
+            names[unique++] = names[i];
+    }
+
+    *out = names;
+    return unique;
+}
+
+/* Replaced and dropped packages leave their metadata behind in the
+ * arenas. Once the arenas have grown to twice what they held after the
+ * last compaction, copy the packages still in the repo into fresh
+ * arenas and free the old ones, so memory tracks the repo's size
+ * rather than how long we've been running. */
+static void compact_repo(struct repo *repo, size_t *baseline)
+{
+    if (arena_footprint() <= *baseline * 2)
+        return;
+
+    trace("compacting package metadata\n");
+    arena_retire();
+    for (size_t i = 0; i < repo->cache->entries; ++i)
+        package_compact(repo->cache->pkgs[i]);
+    arena_release_retired();
+
+    *baseline = arena_footprint();
+}
+
+/* Keep the database and pool snapshot resident and only look at the
+ * files that changed. A burst of uploads settles into a single write. */
+static _noreturn_ void watch_repo(struct repo *repo, alpm_list_t *targets,
+                                  const char *rootname, int delay_ms,
+                                  enum stats_format stats)
+{
+    const char *path = repo->pool ? repo->pool : repo->root;
+    struct watch watch;
+    check_posix(watch_init(&watch, path), "failed to watch %s", path);
+    size_t baseline = arena_footprint();
+
+    for (;;) {
+        trace("watching %s for changes...\n", path);
+        check_posix(watch_wait(&watch, delay_ms), "failed to watch %s", path);
+        stats_reset();
+
+        struct dirsnap changed = {0};
+        const struct dirsnap *scan = &changed;
+        char **names = NULL;
+        size_t count = 0;
+
+        stats_begin(PHASE_FILECACHE);
+        if (watch.overflow) {
+            /* Events were dropped, so nothing short of a full rescan
+             * can be trusted */
+            trace("lost track of changes, rescanning %s\n", path);
+            dirsnap_free(repo->poolsnap);
+            check_posix(dirsnap_load(repo->poolsnap, repo->poolfd, config.jobs),
+                        "failed to read pool directory");
+            scan = repo->poolsnap;
+        } else {
+            count = collect_changes(&watch, rootname, &names);
+            dirsnap_refresh(repo->poolsnap, repo->poolfd, names, count);
+            dirsnap_subset(&changed, repo->poolsnap, names, count);
+        }
+        watch_reset(&watch);
+
+        /* Incremental scans only see part of the pool, which would make
+         * the statcache evict everything else: leave it out */
+        struct pkgcache *filecache = get_filecache(repo, scan, targets, config.arch);
+        check_null(filecache, "failed to get filecache");
+        stats_end(PHASE_FILECACHE);
+
+        stats_begin(PHASE_REDUCE);
+        reduce_repo(repo);
+        stats_end(PHASE_REDUCE);
+
+        stats_begin(PHASE_UPDATE);
+        update_repo(repo, filecache);
+        stats_end(PHASE_UPDATE);
+
+        publish_repo(repo);
+        release_filecache(repo, filecache);
+        compact_repo(repo, &baseline);
+        stats_report(stderr, stats);
+
+        for (size_t i = 0; i < count; ++i)
+            free(names[i]);
+        free(names);
+        dirsnap_free(&changed);
+    }
+}
+
 static alpm_list_t *load_manifest(struct repo *repo, const char *reponame)
 {
     _cleanup_free_ char *manifest = joinstring(reponame, ".manifest", NULL);
@@ -414,10 +846,198 @@ static char *get_rootname(char *name)
     return name;
 }
 
+static int parse_jobs(const char *arg)
+{
+    size_t jobs;
+    if (parse_size(arg, &jobs) < 0 || jobs == 0 || jobs > INT_MAX)
+        errx(EXIT_FAILURE, "invalid number of jobs: %s", arg);
+    return (int)jobs;
+}
+
+static int parse_deltas(const char *arg)
+{
+    size_t deltas;
+    if (parse_size(arg, &deltas) < 0 || deltas == 0 || deltas > INT_MAX)
+        errx(EXIT_FAILURE, "invalid number of deltas: %s", arg);
+    return (int)deltas;
+}
+
+static int parse_threads(const char *arg)
+{
+    size_t threads;
+    if (parse_size(arg, &threads) < 0 || threads == 0 || threads > INT_MAX)
+        errx(EXIT_FAILURE, "invalid number of compression threads: %s", arg);
+    return (int)threads;
+}
+
+static int parse_level(const char *arg)
+{
+    size_t level;
+    if (parse_size(arg, &level) < 0 || level > INT_MAX)
+        errx(EXIT_FAILURE, "invalid compression level: %s", arg);
+    return (int)level;
+}
+
+struct batch_repo {
+    struct repo repo;
+    const char *rootname;
+    const char *arch;
+    alpm_list_t *targets;
+    struct pkgcache *filecache;
+};
+
+struct batch {
+    struct batch_repo *repos;
+    size_t count;
+    bool files;
+    bool rebuild;
+};
+
+/* One repository per line: its database name, optionally followed by
+ * root=PATH and arch=ARCH to override --root and --arch */
+static void load_batch(struct batch *batch, const char *filename, const struct repo *defaults)
+{
+    _cleanup_fclose_ FILE *fp = fopen(filename, "r");
+    check_null(fp, "failed to open batch file %s", filename);
+
+    size_t size = 0;
+    for (size_t lineno = 1;; ++lineno) {
+        errno = 0;
+        char *line = NULL;
+        ssize_t nbytes_r = getline(&line, &(size_t){ 0 }, fp);
+        if (nbytes_r < 0) {
+            if (errno != 0)
+                err(EXIT_FAILURE, "failed to read batch file %s", filename);
+            free(line);
+            break;
+        }
+
+        char *comment = strchr(line, '#');
+        if (comment)
+            *comment = 0;
+
+        char *saveptr;
+        char *name = strtok_r(line, " \t\n", &saveptr);
+        if (!name) {
+            free(line);
+            continue;
+        }
+
+        if (batch->count == size) {
+            size = size ? size * 2 : 16;
+            batch->repos = realloc(batch->repos, size * sizeof(*batch->repos));
+            check_null(batch->repos, "failed to allocate batch");
+        }
+
+        struct batch_repo *entry = &batch->repos[batch->count++];
+        *entry = (struct batch_repo){
+            .repo = { .root = defaults->root, .pool = defaults->pool, .dirty = batch->rebuild },
+            .rootname = get_rootname(name),
+            .arch = config.arch
+        };
+
+        for (char *field; (field = strtok_r(NULL, " \t\n", &saveptr));) {
+            if (strncmp(field, "root=", 5) == 0)
+                entry->repo.root = field + 5;
+            else if (strncmp(field, "arch=", 5) == 0)
+                entry->arch = field + 5;
+            else
+                errx(EXIT_FAILURE, "%s:%zu: unknown option %s", filename, lineno, field);
+        }
+    }
+
+    if (batch->count == 0)
+        errx(EXIT_FAILURE, "batch file %s lists no databases", filename);
+}
+
+static void init_batch_repo(void *data, size_t idx)
+{
+    struct batch *batch = data;
+    struct batch_repo *entry = &batch->repos[idx];
+
+    init_repo(&entry->repo, entry->rootname, batch->files, !batch->rebuild);
+    entry->targets = load_manifest(&entry->repo, entry->rootname);
+}
+
+static void update_batch_repo(void *data, size_t idx)
+{
+    struct batch *batch = data;
+    struct batch_repo *entry = &batch->repos[idx];
+    struct repo *repo = &entry->repo;
+
+    stats_begin(PHASE_REDUCE);
+    reduce_repo(repo);
+    stats_end(PHASE_REDUCE);
+
+    stats_begin(PHASE_UPDATE);
+    update_repo(repo, entry->filecache);
+    stats_end(PHASE_UPDATE);
+
+    publish_repo(repo);
+    release_filecache(repo, entry->filecache);
+}
+
+/* Several repos drawing on one pool, say one per architecture, all
+ * updated off a single scan of it. The statcache covers the pool as a
+ * whole, so it's kept next to the batch file rather than in any one
+ * repo. */
+static void run_batch(const char *filename, const struct repo *defaults,
+                      bool files, bool rebuild)
+{
+    struct batch batch = { .files = files, .rebuild = rebuild };
+    load_batch(&batch, filename, defaults);
+
+    stats_begin(PHASE_INIT);
+    run_jobs(config.jobs, batch.count, init_batch_repo, &batch);
+    stats_end(PHASE_INIT);
+
+    stats_begin(PHASE_FILECACHE);
+    const int poolfd = batch.repos[0].repo.poolfd;
+    struct dirsnap poolsnap = {0};
+    check_posix(dirsnap_load(&poolsnap, poolfd, config.jobs),
+                "failed to read pool directory");
+
+    struct statcache statcache = {0};
+    _cleanup_free_ char *cachename = joinstring(filename, ".cache", NULL);
+    if (config.cache && statcache_load(&statcache, AT_FDCWD, cachename) < 0)
+        warn("failed to load %s, ignoring", cachename);
+
+    struct pool_view *views = calloc(batch.count, sizeof(struct pool_view));
+    check_null(views, "failed to allocate batch");
+    for (size_t i = 0; i < batch.count; ++i) {
+        struct batch_repo *entry = &batch.repos[i];
+
+        entry->repo.poolsnap = &poolsnap;
+        views[i] = (struct pool_view){
+            .repo = &entry->repo,
+            .targets = entry->targets,
+            .arch = entry->arch
+        };
+    }
+
+    get_filecaches(views, batch.count, poolfd, &poolsnap,
+                   config.cache ? &statcache : NULL);
+    for (size_t i = 0; i < batch.count; ++i)
+        batch.repos[i].filecache = views[i].filecache;
+    free(views);
+
+    if (statcache.dirty && statcache_write(&statcache, AT_FDCWD, cachename) < 0)
+        warn("failed to write %s", cachename);
+    statcache_free(&statcache);
+    stats_end(PHASE_FILECACHE);
+
+    run_jobs(config.jobs, batch.count, update_batch_repo, &batch);
+    dirsnap_free(&poolsnap);
+}
+
 int main(int argc, char *argv[])
 {
     const char *rootname;
-    bool files = false, rebuild = false, drop = false, list = false;
+    bool files = false, rebuild = false, drop = false, list = false, force = false;
+    enum query_type query = QUERY_NONE;
+    enum stats_format stats = STATS_NONE;
+    time_t watch_delay = -1;
+    const char *batchfile = NULL;
 
     setlocale(LC_ALL, "");
 
@@ -439,6 +1059,21 @@ int main(int argc, char *argv[])
         { "reflink",  no_argument,       0, 0x100 },
         { "rebuild",  no_argument,       0, 0x101 },
         { "elephant", no_argument,       0, 0x102 },
+        { "jobs",     required_argument, 0, 0x103 },
+        { "cache",    no_argument,       0, 0x104 },
+        { "block-size", required_argument, 0, 0x105 },
+        { "zstd",     no_argument,       0, 0x106 },
+        { "compression-level", required_argument, 0, 0x107 },
+        { "compression-threads", required_argument, 0, 0x108 },
+        { "verify-packages", no_argument, 0, 0x109 },
+        { "stats",    optional_argument, 0, 0x10a },
+        { "watch",    optional_argument, 0, 0x10b },
+        { "index",    no_argument,       0, 0x10c },
+        { "batch",    required_argument, 0, 0x10d },
+        { "stream",   no_argument,       0, 0x10e },
+        { "delta",    optional_argument, 0, 0x10f },
+        { "query",    required_argument, 0, 0x110 },
+        { "force",    no_argument,       0, 0x111 },
         { 0, 0, 0, 0 }
     };
 
@@ -502,63 +1137,186 @@ int main(int argc, char *argv[])
         case 0x102:
             elephant();
             break;
+        case 0x103:
+            config.jobs = parse_jobs(optarg);
+            break;
+        case 0x104:
+            config.cache = true;
+            break;
+        case 0x105:
+            if (parse_size(optarg, &archive_block_size) < 0 || archive_block_size == 0)
+                errx(EXIT_FAILURE, "invalid block size: %s", optarg);
+            break;
+        case 0x106:
+            config.compression = ARCHIVE_FILTER_ZSTD;
+            break;
+        case 0x107:
+            config.compression_level = parse_level(optarg);
+            break;
+        case 0x108:
+            config.compression_threads = parse_threads(optarg);
+            break;
+        case 0x109:
+            config.verify = true;
+            break;
+        case 0x10a:
+            if (!optarg)
+                stats = STATS_TEXT;
+            else if (streq(optarg, "json"))
+                stats = STATS_JSON;
+            else
+                errx(EXIT_FAILURE, "invalid stats format: %s", optarg);
+            break;
+        case 0x10b:
+            watch_delay = 2;
+            if (optarg && (parse_time(optarg, &watch_delay) < 0 || watch_delay > INT_MAX / 1000))
+                errx(EXIT_FAILURE, "invalid watch delay: %s", optarg);
+            break;
+        case 0x10c:
+            config.index = true;
+            break;
+        case 0x10d:
+            batchfile = optarg;
+            break;
+        case 0x10e:
+            config.stream = true;
+            break;
+        case 0x10f:
+            config.deltas = optarg ? parse_deltas(optarg) : 10;
+            break;
+        case 0x110:
+            query = parse_query(optarg);
+            break;
+        case 0x111:
+            force = true;
+            break;
         }
     }
 
     argv += optind;
     argc -= optind;
 
-    if (argc == 0)
-        errx(1, "incorrect number of arguments provided");
-
     if (!config.arch) {
         struct utsname uts;
         uname(&uts);
         config.arch = strdup(uts.machine);
     }
 
-    if (list && drop)
-        errx(EXIT_FAILURE, "List and drop operations are mutually exclusive");
+    if (batchfile) {
+        if (argc > 0)
+            errx(EXIT_FAILURE, "Databases come from the batch file, not the command line");
+        if (list || drop || query || watch_delay >= 0)
+            errx(EXIT_FAILURE, "Can't list, drop, query or watch in batch mode");
+        if (!repo.pool)
+            errx(EXIT_FAILURE, "Batch mode needs a shared pool, set with --pool");
+
+        run_batch(batchfile, &repo, files, rebuild);
+        stats_report(stderr, stats);
+        arena_release();
+        return 0;
+    }
+
+    if (argc == 0)
+        errx(1, "incorrect number of arguments provided");
+
+    if ((list && drop) || (query && (list || drop)))
+        errx(EXIT_FAILURE, "List, drop and query operations are mutually exclusive");
+
+    if (watch_delay >= 0 && (list || drop || query))
+        errx(EXIT_FAILURE, "Can't watch while performing a list, drop or query operation");
 
-    if (rebuild && (list || drop)) {
-        fprintf(stderr, "Can't rebuild while performing a list or drop operation.\n"
+    if (rebuild && (list || drop || query)) {
+        fprintf(stderr, "Can't rebuild while performing a list, drop or query operation.\n"
                         "Ignoring the --rebuild flag.\n");
         rebuild = false;
     }
 
     rootname = get_rootname(*argv++), --argc;
-    int ret = init_repo(&repo, rootname, files, !rebuild);
+    alpm_list_t *targets = parse_targets(argv, argc);
+
+    if ((query == QUERY_RDEPENDS || query == QUERY_PROVIDES || query == QUERY_REPLACES) && !targets)
+        errx(EXIT_FAILURE, "This query needs something to ask about");
+
+    stats_begin(PHASE_INIT);
+    init_repo(&repo, rootname, files, !rebuild && !list);
+    stats_end(PHASE_INIT);
     if (list) {
-        check_posix(ret, "failed to open database %s.db", rootname);
-        list_repo(&repo);
+        stats_begin(PHASE_INIT);
+        list_repo(&repo, targets);
+        stats_end(PHASE_INIT);
+        stats_report(stderr, stats);
+        arena_release();
         return 0;
     }
 
-    alpm_list_t *targets = parse_targets(argv, argc);
+    if (query) {
+        if (!repo.tracked)
+            errx(EXIT_FAILURE, "failed to open database %s", repo.dbname);
+
+        stats_begin(PHASE_UPDATE);
+        query_repo(&repo, query, targets);
+        stats_end(PHASE_UPDATE);
+        stats_report(stderr, stats);
+        arena_release();
+        return 0;
+    }
+
+    struct dirsnap poolsnap = {0};
+    stats_begin(PHASE_FILECACHE);
+    if (!drop) {
+        check_posix(dirsnap_load(&poolsnap, repo.poolfd, config.jobs),
+                    "failed to read pool directory");
+        repo.poolsnap = &poolsnap;
+    }
+
+    stats_end(PHASE_FILECACHE);
 
     if (drop) {
+        stats_begin(PHASE_UPDATE);
+        if (!force)
+            check_drop(&repo, targets);
         drop_from_repo(&repo, targets);
+        stats_end(PHASE_UPDATE);
     } else {
         if (argc == 0) {
             targets = load_manifest(&repo, rootname);
         }
 
-        struct pkgcache *filecache = get_filecache(repo.poolfd, targets, config.arch);
+        stats_begin(PHASE_FILECACHE);
+        struct statcache statcache = {0};
+        _cleanup_free_ char *cachename = joinstring(rootname, ".cache", NULL);
+        if (config.cache && statcache_load(&statcache, repo.rootfd, cachename) < 0)
+            warn("failed to load %s, ignoring", cachename);
+
+        if (config.cache)
+            repo.statcache = &statcache;
+
+        struct pkgcache *filecache = get_filecache(&repo, NULL, targets, config.arch);
         check_null(filecache, "failed to get filecache");
 
+        if (statcache.dirty && statcache_write(&statcache, repo.rootfd, cachename) < 0)
+            warn("failed to write %s", cachename);
+        statcache_free(&statcache);
+        repo.statcache = NULL;
+        stats_end(PHASE_FILECACHE);
+
+        stats_begin(PHASE_REDUCE);
         reduce_repo(&repo);
+        stats_end(PHASE_REDUCE);
+
+        stats_begin(PHASE_UPDATE);
         update_repo(&repo, filecache);
+        stats_end(PHASE_UPDATE);
     }
 
-    if (!repo.dirty) {
-        trace("repo does not need updating\n");
-    } else {
-        write_database(&repo, repo.dbname, DB_DESC | DB_DEPENDS);
+    publish_repo(&repo);
+    stats_report(stderr, stats);
 
-        if (repo.filesname) {
-            write_database(&repo, repo.filesname, DB_FILES);
-        }
+    if (watch_delay >= 0)
+        watch_repo(&repo, targets, rootname, watch_delay * 1000, stats);
 
-        link_db(&repo);
-    }
+    dirsnap_free(&poolsnap);
+
+    /* All the package metadata goes in one go */
+    arena_release();
 }
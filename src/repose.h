@@ -2,26 +2,48 @@
 
 #include <stdbool.h>
 #include "pkgcache.h"
+#include "dbindex.h"
 #include "util.h"
 
+struct statcache;
+struct dirsnap;
+
 struct repo {
     const char *root;
     const char *pool;
     int rootfd;
     int poolfd;
 
+    const char *rootname;
     char *dbname;
     char *filesname;
 
     bool dirty;
+    bool sign;
     struct pkgcache *cache;
+    struct statcache *statcache;
+    struct dirsnap *poolsnap;
+    struct dbindex index;
+
+    /* The name-version of every entry dropped since the last write, and
+     * whether that's all that changed since it */
+    alpm_list_t *removed;
+    bool tracked;
 };
 
 struct config {
     int verbose;
     int compression;
+    int compression_level;
+    int compression_threads;
+    int jobs;
+    int deltas;
     bool reflink;
     bool sign;
+    bool cache;
+    bool verify;
+    bool index;
+    bool stream;
     char *arch;
 };
 
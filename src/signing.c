@@ -9,6 +9,7 @@
 #include <locale.h>
 #include <errno.h>
 #include <err.h>
+#include <pthread.h>
 #include <gpgme.h>
 #include <gpg-error.h>
 
@@ -36,16 +37,20 @@ static inline char *sig_for(const char *file)
     return joinstring(file, ".sig", NULL);
 }
 
-static int init_gpgme(void)
+static pthread_once_t gpgme_once = PTHREAD_ONCE_INIT;
+static pthread_key_t ctx_key;
+static bool gpgme_ready = false;
+
+static void release_ctx(void *ctx)
+{
+    gpgme_release(ctx);
+}
+
+static void setup_gpgme(void)
 {
-    static int inited = false;
     gpgme_error_t err;
     gpgme_engine_info_t enginfo;
 
-    /* we already successfully initialized the library */
-    if (inited)
-        return 0;
-
     /* calling gpgme_check_version() returns the current version and runs
      * some internal library setup code */
     gpgme_check_version(NULL);
@@ -57,135 +62,230 @@ static int init_gpgme(void)
     /* check for OpenPGP support (should be a no-brainer, but be safe) */
     err = gpgme_engine_check_version(GPGME_PROTOCOL_OpenPGP);
     if (gpg_err_code(err) != GPG_ERR_NO_ERROR)
-        return -1;
+        return;
 
     err = gpgme_get_engine_info(&enginfo);
     if (gpg_err_code(err) != GPG_ERR_NO_ERROR)
-        return -1;
+        return;
 
-    inited = true;
-    return 0;
+    if (pthread_key_create(&ctx_key, release_ctx) != 0)
+        return;
+
+    gpgme_ready = true;
 }
 
-int gpgme_verify(int rootfd, const char *file)
+/* Package verification calls in from the scan workers, so library
+ * setup has to happen exactly once, whichever thread gets here first */
+static int init_gpgme(void)
 {
-    gpgme_error_t err;
-    gpgme_ctx_t ctx;
-    gpgme_data_t in, sig;
-    gpgme_verify_result_t result;
-    gpgme_signature_t sigs;
-    int rc = 0;
-
-    if (init_gpgme() < 0)
-        return -1;
+    pthread_once(&gpgme_once, setup_gpgme);
+    return gpgme_ready ? 0 : -1;
+}
 
-    _cleanup_free_ char *sigfile = sig_for(file);
-    _cleanup_close_ int sigfd = openat(rootfd, sigfile, O_RDONLY);
-    _cleanup_close_ int fd = openat(rootfd, file, O_RDONLY);
+/* Setting up a context costs more than most verifications, so every
+ * thread keeps its own around for the rest of its life */
+static gpgme_ctx_t get_ctx(void)
+{
+    gpgme_ctx_t ctx = pthread_getspecific(ctx_key);
+    if (ctx)
+        return ctx;
 
-    err = gpgme_new(&ctx);
+    gpgme_error_t err = gpgme_new(&ctx);
     if (gpg_err_code(err) != GPG_ERR_NO_ERROR)
         gpgme_err(EXIT_FAILURE, err, "failed to call gpgme_new()");
 
-    err = gpgme_data_new_from_fd(&in, fd);
-    if (err)
-        gpgme_err(EXIT_FAILURE, err, "error reading %s", file);
-
-    err = gpgme_data_new_from_fd(&sig, sigfd);
-    if (gpg_err_code(err) != GPG_ERR_NO_ERROR)
-        gpgme_err(EXIT_FAILURE, err, "error reading %s", sigfile);
+    pthread_setspecific(ctx_key, ctx);
+    return ctx;
+}
 
-    err = gpgme_op_verify(ctx, sig, in, NULL);
-    if (gpg_err_code(err) != GPG_ERR_NO_ERROR)
-        gpgme_err(EXIT_FAILURE, err, "failed to verify");
+static int check_result(gpgme_ctx_t ctx, const char *file)
+{
+    gpgme_verify_result_t result = gpgme_op_verify_result(ctx);
+    gpgme_signature_t sigs = result ? result->signatures : NULL;
 
-    result = gpgme_op_verify_result(ctx);
-    sigs = result->signatures;
-    if (gpgme_err_code(sigs->status) != GPG_ERR_NO_ERROR) {
+    if (!sigs) {
+        warnx("no signatures found for %s", file);
+        return -1;
+    } else if (gpgme_err_code(sigs->status) != GPG_ERR_NO_ERROR) {
         warnx("unexpected signature status: %s", gpgme_strerror(sigs->status));
-        rc = -1;
+        return -1;
     } else if (sigs->next) {
         warnx("unexpected number of signatures");
-        rc = -1;
+        return -1;
     } else if (sigs->summary == GPGME_SIGSUM_RED) {
         warnx("unexpected signature summary 0x%x", sigs->summary);
-        rc = -1;
+        return -1;
     } else if (sigs->wrong_key_usage) {
         warnx("unexpected wrong key usage");
-        rc = -1;
+        return -1;
     } else if (sigs->validity != GPGME_VALIDITY_FULL) {
         warnx("unexpected validity 0x%x", sigs->validity);
-        rc = -1;
+        return -1;
     } else if (gpgme_err_code(sigs->validity_reason) != GPG_ERR_NO_ERROR) {
         warnx("unexpected validity reason: %s", gpgme_strerror(sigs->validity_reason));
+        return -1;
+    }
+
+    return 0;
+}
+
+int gpgme_verify_fd(int fd, int sigfd, const char *file)
+{
+    gpgme_error_t err;
+    gpgme_data_t in, sig;
+    int rc;
+
+    if (init_gpgme() < 0)
+        return -1;
+
+    gpgme_ctx_t ctx = get_ctx();
+
+    err = gpgme_data_new_from_fd(&in, fd);
+    if (err)
+        gpgme_err(EXIT_FAILURE, err, "error reading %s", file);
+
+    err = gpgme_data_new_from_fd(&sig, sigfd);
+    if (gpg_err_code(err) != GPG_ERR_NO_ERROR)
+        gpgme_err(EXIT_FAILURE, err, "error reading signature for %s", file);
+
+    err = gpgme_op_verify(ctx, sig, in, NULL);
+    if (gpg_err_code(err) != GPG_ERR_NO_ERROR) {
+        warnx("failed to verify %s: %s", file, gpgme_strerror(err));
         rc = -1;
+    } else {
+        rc = check_result(ctx, file);
     }
 
     gpgme_data_release(in);
     gpgme_data_release(sig);
-    gpgme_release(ctx);
     return rc;
 }
 
-void gpgme_sign(int rootfd, const char *file, const char *key)
+int gpgme_verify(int rootfd, const char *file)
+{
+    _cleanup_free_ char *sigfile = sig_for(file);
+    _cleanup_close_ int sigfd = openat(rootfd, sigfile, O_RDONLY);
+    _cleanup_close_ int fd = openat(rootfd, file, O_RDONLY);
+
+    if (fd < 0 || sigfd < 0) {
+        warn("failed to open %s", fd < 0 ? file : sigfile);
+        return -1;
+    }
+
+    return gpgme_verify_fd(fd, sigfd, file);
+}
+
+/* Write a detached signature for file to file.sig. On failure, no
+ * signature is left behind, not even a partial one. */
+int gpgme_sign(int rootfd, const char *file, const char *key)
 {
     gpgme_error_t err;
     gpgme_ctx_t ctx;
-    gpgme_data_t in, out;
-    gpgme_sign_result_t result;
-
-    if (init_gpgme() < 0)
-        return;
+    gpgme_data_t in = NULL, out = NULL;
+    _cleanup_free_ char *sigfile = sig_for(file);
+    _cleanup_close_ int fd = -1, sigfd = -1;
+    int rc = -1;
 
-    err = gpgme_new(&ctx);
-    if (gpg_err_code(err) != GPG_ERR_NO_ERROR)
-        gpgme_err(EXIT_FAILURE, err, "failed to call gpgme_new()");
+    if (init_gpgme() < 0) {
+        warnx("failed to initialize gpgme to sign %s", file);
+        return -1;
+    }
 
+    ctx = get_ctx();
     if (key) {
         gpgme_key_t akey;
 
         err = gpgme_get_key(ctx, key, &akey, 1);
-        if (err)
-            gpgme_err(EXIT_FAILURE, err, "failed to set key %s", key);
+        if (err) {
+            warnx("failed to set key %s: %s", key, gpgme_strerror(err));
+            return -1;
+        }
 
         err = gpgme_signers_add(ctx, akey);
-        if (gpg_err_code(err) != GPG_ERR_NO_ERROR)
-            gpgme_err(EXIT_FAILURE, err, "failed to call gpgme_signers_add()");
-
         gpgme_key_unref(akey);
+        if (gpg_err_code(err) != GPG_ERR_NO_ERROR) {
+            warnx("failed to call gpgme_signers_add(): %s", gpgme_strerror(err));
+            goto cleanup;
+        }
     }
 
-    _cleanup_free_ char *sigfile = sig_for(file);
-    _cleanup_close_ int sigfd = openat(rootfd, sigfile, O_CREAT | O_WRONLY, 00644);
-    _cleanup_close_ int fd = openat(rootfd, file, O_RDONLY);
+    fd = openat(rootfd, file, O_RDONLY);
+    if (fd < 0) {
+        warn("failed to open %s", file);
+        goto cleanup;
+    }
+
+    sigfd = openat(rootfd, sigfile, O_CREAT | O_WRONLY | O_TRUNC, 00644);
+    if (sigfd < 0) {
+        warn("failed to open %s", sigfile);
+        goto cleanup;
+    }
 
     err = gpgme_data_new_from_fd(&in, fd);
-    if (err)
-        gpgme_err(EXIT_FAILURE, err, "error reading %s", file);
+    if (err) {
+        warnx("error reading %s: %s", file, gpgme_strerror(err));
+        goto discard;
+    }
 
     err = gpgme_data_new(&out);
-    if (gpg_err_code(err) != GPG_ERR_NO_ERROR)
-        gpgme_err(EXIT_FAILURE, err, "failed to call gpgme_data_new()");
+    if (gpg_err_code(err) != GPG_ERR_NO_ERROR) {
+        warnx("failed to call gpgme_data_new(): %s", gpgme_strerror(err));
+        goto discard;
+    }
 
     err = gpgme_op_sign(ctx, in, out, GPGME_SIG_MODE_DETACH);
-    if (err)
-        gpgme_err(EXIT_FAILURE, err, "signing failed");
+    if (err) {
+        warnx("signing %s failed: %s", file, gpgme_strerror(err));
+        goto discard;
+    }
 
-    result = gpgme_op_sign_result(ctx);
-    if (!result)
-        gpgme_err(EXIT_FAILURE, err, "signaure failed?");
+    if (!gpgme_op_sign_result(ctx)) {
+        warnx("signing %s produced no signature", file);
+        goto discard;
+    }
 
+    if (gpgme_data_seek(out, 0, SEEK_SET) < 0) {
+        warn("failed to read back the signature of %s", file);
+        goto discard;
+    }
+
+    ssize_t nbytes_r;
     char buf[BUFSIZ];
-    int ret;
+    while ((nbytes_r = gpgme_data_read(out, buf, sizeof(buf))) > 0) {
+        for (ssize_t written = 0; written < nbytes_r;) {
+            ssize_t nbytes_w = write(sigfd, buf + written, nbytes_r - written);
+            if (nbytes_w < 0) {
+                if (errno == EINTR)
+                    continue;
+                warn("failed to write %s", sigfile);
+                goto discard;
+            }
+            written += nbytes_w;
+        }
+    }
 
-    ret = gpgme_data_seek(out, 0, SEEK_SET);
-    if (ret)
-        return;
+    if (nbytes_r < 0) {
+        warn("failed to read back the signature of %s", file);
+        goto discard;
+    }
 
-    while ((ret = gpgme_data_read(out, buf, BUFSIZ)) > 0)
-        write(sigfd, buf, ret);
+    if (fsync(sigfd) < 0) {
+        warn("failed to sync %s", sigfile);
+        goto discard;
+    }
 
-    gpgme_data_release(out);
-    gpgme_data_release(in);
-    gpgme_release(ctx);
+    rc = 0;
+
+discard:
+    if (rc < 0)
+        unlinkat(rootfd, sigfile, 0);
+
+cleanup:
+    /* The context outlives this call: don't leave our key behind on it */
+    gpgme_signers_clear(ctx);
+    if (out)
+        gpgme_data_release(out);
+    if (in)
+        gpgme_data_release(in);
+    return rc;
 }
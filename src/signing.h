@@ -1,7 +1,8 @@
 #ifndef SIGNING_H
 #define SIGNING_H
 
-void gpgme_sign(int rootfd, const char *file, const char *key);
+int gpgme_sign(int rootfd, const char *file, const char *key);
 int gpgme_verify(int rootfd, const char *file);
+int gpgme_verify_fd(int fd, int sigfd, const char *file);
 
 #endif
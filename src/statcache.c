@@ -0,0 +1,350 @@
+#include "statcache.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <string.h>
+#include <errno.h>
+#include <err.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <archive.h>
+#include <archive_entry.h>
+
+#include "pkgcache.h"
+#include "buffer.h"
+#include "desc.h"
+#include "filelist.h"
+#include "ioctx.h"
+#include "util.h"
+
+static int entry_cmp(const void *p1, const void *p2)
+{
+    const struct statcache_entry *e1 = p1;
+    const struct statcache_entry *e2 = p2;
+    return strcmp(e1->filename, e2->filename);
+}
+
+static int entry_find(const void *key, const void *p)
+{
+    const struct statcache_entry *entry = p;
+    return strcmp(key, entry->filename);
+}
+
+static bool entry_matches(const struct statcache_entry *entry, const struct stat *st)
+{
+    return entry->size == st->st_size &&
+        entry->mtime == st->st_mtime &&
+        entry->ino == st->st_ino;
+}
+
+static struct statcache_entry *statcache_append(struct statcache *cache, const char *filename)
+{
+    if (cache->count == cache->size) {
+        size_t size = cache->size ? cache->size * 2 : 64;
+        struct statcache_entry *entries = realloc(cache->entries, size * sizeof(*entries));
+        check_null(entries, "failed to allocate statcache entries");
+
+        cache->entries = entries;
+        cache->size = size;
+    }
+
+    struct statcache_entry *entry = &cache->entries[cache->count++];
+    *entry = (struct statcache_entry){ .filename = strdup(filename) };
+    check_null(entry->filename, "failed to allocate statcache entry");
+    return entry;
+}
+
+static int parse_statcache_entry(struct statcache *cache, struct archive *archive,
+                                 struct archive_entry *ae)
+{
+    const int64_t len = archive_entry_size(ae);
+    if (len <= 0)
+        return -1;
+
+    char *data = malloc(len + 1);
+    check_null(data, "failed to allocate statcache record");
+
+    ssize_t nbytes_r = 0;
+    while (nbytes_r < len) {
+        ssize_t ret = archive_read_data(archive, data + nbytes_r, len - nbytes_r);
+        if (ret <= 0) {
+            free(data);
+            return -1;
+        }
+        nbytes_r += ret;
+    }
+    data[len] = 0;
+
+    intmax_t size, mtime, sig_mtime = 0;
+    uintmax_t ino;
+    char *record = memchr(data, '\n', len);
+
+    /* Caches written before signatures were verified lack the last field */
+    if (!record || sscanf(data, "%jd %jd %ju %jd", &size, &mtime, &ino, &sig_mtime) < 3) {
+        free(data);
+        return -1;
+    }
+
+    /* Drop the key line so the record begins at the desc data */
+    size_t record_len = len - (++record - data);
+    memmove(data, record, record_len + 1);
+
+    struct statcache_entry *entry = statcache_append(cache, archive_entry_pathname(ae));
+    entry->size = size;
+    entry->mtime = mtime;
+    entry->ino = ino;
+    entry->sig_mtime = sig_mtime;
+    entry->record = data;
+    entry->record_len = record_len;
+    return 0;
+}
+
+int statcache_load(struct statcache *cache, int dirfd, const char *filename)
+{
+    int ret = 0;
+    _cleanup_close_ int fd = openat(dirfd, filename, O_RDONLY);
+    if (fd < 0)
+        return errno == ENOENT ? 0 : -1;
+
+    struct archive *archive = archive_read_new();
+    archive_read_support_filter_all(archive);
+    archive_read_support_format_tar(archive);
+
+    if (ioctx_open_archive(archive, fd) < 0) {
+        ret = -1;
+        goto cleanup;
+    }
+
+    struct archive_entry *ae;
+    while (archive_read_next_header(archive, &ae) == ARCHIVE_OK) {
+        if (S_ISREG(archive_entry_mode(ae)) && parse_statcache_entry(cache, archive, ae) < 0) {
+            warnx("skipping corrupt statcache entry %s", archive_entry_pathname(ae));
+            cache->dirty = true;
+        }
+    }
+
+    qsort(cache->entries, cache->count, sizeof(*cache->entries), entry_cmp);
+
+cleanup:
+    archive_read_close(archive);
+    archive_read_free(archive);
+    return ret;
+}
+
+static int write_statcache_entry(struct archive *archive, struct archive_entry *ae,
+                                 const struct statcache_entry *entry)
+{
+    char key[100];
+    int key_len = snprintf(key, sizeof(key), "%jd %jd %ju %jd\n",
+                           (intmax_t)entry->size, (intmax_t)entry->mtime,
+                           (uintmax_t)entry->ino, (intmax_t)entry->sig_mtime);
+
+    archive_entry_set_pathname(ae, entry->filename);
+    archive_entry_set_filetype(ae, AE_IFREG);
+    archive_entry_set_perm(ae, 0644);
+    archive_entry_set_uname(ae, "repose");
+    archive_entry_set_gname(ae, "repose");
+    archive_entry_set_mtime(ae, entry->mtime, 0);
+    archive_entry_set_size(ae, key_len + entry->record_len);
+
+    int ret = 0;
+    if (archive_write_header(archive, ae) < ARCHIVE_OK ||
+        archive_write_data(archive, key, key_len) != key_len ||
+        archive_write_data(archive, entry->record, entry->record_len) != (ssize_t)entry->record_len)
+        ret = -1;
+
+    archive_entry_clear(ae);
+    return ret;
+}
+
+int statcache_write(struct statcache *cache, int dirfd, const char *filename)
+{
+    int ret = 0;
+    _cleanup_free_ char *tmpname = joinstring(filename, ".tmp", NULL);
+    _cleanup_close_ int fd = openat(dirfd, tmpname, O_CREAT | O_WRONLY | O_TRUNC, 0644);
+    if (fd < 0)
+        return -1;
+
+    struct archive *archive = archive_write_new();
+    struct archive_entry *ae = archive_entry_new();
+
+    archive_write_add_filter(archive, ARCHIVE_FILTER_NONE);
+    archive_write_set_format_pax_restricted(archive);
+
+    if (archive_write_open_fd(archive, fd) < 0) {
+        ret = -1;
+        goto cleanup;
+    }
+
+    for (size_t i = 0; i < cache->count; ++i) {
+        if (write_statcache_entry(archive, ae, &cache->entries[i]) < 0) {
+            ret = -1;
+            goto cleanup;
+        }
+    }
+
+    if (archive_write_close(archive) < 0 || fsync(fd) < 0) {
+        ret = -1;
+        goto cleanup;
+    }
+
+    /* Only replace the old cache once the new one is complete */
+    ret = renameat(dirfd, tmpname, dirfd, filename);
+    if (ret == 0)
+        cache->dirty = false;
+
+cleanup:
+    archive_entry_free(ae);
+    archive_write_free(archive);
+
+    if (ret < 0) {
+        const int saved_errno = errno;
+        unlinkat(dirfd, tmpname, 0);
+        errno = saved_errno;
+    }
+    return ret;
+}
+
+void statcache_free(struct statcache *cache)
+{
+    for (size_t i = 0; i < cache->count; ++i) {
+        free(cache->entries[i].filename);
+        free(cache->entries[i].record);
+    }
+    free(cache->entries);
+    *cache = (struct statcache){0};
+}
+
+struct statcache_entry *statcache_find(struct statcache *cache, const char *filename)
+{
+    if (!cache || !cache->count)
+        return NULL;
+
+    return bsearch(filename, cache->entries, cache->count, sizeof(*cache->entries), entry_find);
+}
+
+struct pkg *statcache_entry_load(struct statcache_entry *entry, const struct stat *st)
+{
+    if (!entry_matches(entry, st))
+        return NULL;
+
+    struct pkg *pkg = malloc(sizeof(pkg_t));
+    check_null(pkg, "failed to allocate package");
+    *pkg = (struct pkg){0};
+
+    struct desc_parser parser;
+    desc_parser_init(&parser);
+
+    if (desc_parser_feed(&parser, pkg, entry->record, entry->record_len) < 0 ||
+        !pkg->filename || !pkg->name || !pkg->version) {
+        package_free(pkg);
+        return NULL;
+    }
+
+    filelist_finish(pkg->files);
+    pkg->hash = pkgname_hash(pkg->name);
+    pkg->size = st->st_size;
+    pkg->mtime = st->st_mtime;
+    entry->seen = true;
+    return pkg;
+}
+
+/* Whether the signature with the given mtime was already verified
+ * against this exact package file */
+bool statcache_entry_verified(const struct statcache_entry *entry, const struct stat *st,
+                              time_t sig_mtime)
+{
+    return entry && entry_matches(entry, st) && entry->sig_mtime == sig_mtime;
+}
+
+/* Serialize the metadata read out of the package's .PKGINFO. This is
+ * the desc and depends data of a database entry, minus anything that
+ * comes from outside the package file itself, like the signature. */
+char *statcache_record(struct pkg *pkg, size_t *record_len)
+{
+    struct buffer buf = {0};
+
+    write_entry(&buf, "FILENAME",     pkg->filename);
+    write_entry(&buf, "NAME",         pkg->name);
+    write_entry(&buf, "BASE",         pkg->base);
+    write_entry(&buf, "VERSION",      pkg->version);
+    write_entry(&buf, "DESC",         pkg->desc);
+    write_entry(&buf, "GROUPS",       pkg->groups);
+    write_entry(&buf, "CSIZE",        pkg->size);
+    write_entry(&buf, "ISIZE",        pkg->isize);
+    write_entry(&buf, "SHA256SUM",    pkg->sha256sum);
+    write_entry(&buf, "URL",          pkg->url);
+    write_entry(&buf, "LICENSE",      pkg->licenses);
+    write_entry(&buf, "ARCH",         pkg->arch);
+    write_entry(&buf, "BUILDDATE",    pkg->builddate);
+    write_entry(&buf, "PACKAGER",     pkg->packager);
+    write_entry(&buf, "REPLACES",     pkg->replaces);
+    write_entry(&buf, "DEPENDS",      pkg->depends);
+    write_entry(&buf, "CONFLICTS",    pkg->conflicts);
+    write_entry(&buf, "PROVIDES",     pkg->provides);
+    write_entry(&buf, "OPTDEPENDS",   pkg->optdepends);
+    write_entry(&buf, "MAKEDEPENDS",  pkg->makedepends);
+    write_entry(&buf, "CHECKDEPENDS", pkg->checkdepends);
+    write_entry(&buf, "FILES",        pkg->files);
+
+    check_null(buf.data, "failed to serialize %s", pkg->filename);
+    *record_len = buf.len;
+    return buf.data;
+}
+
+struct statcache_entry *statcache_put(struct statcache *cache, struct statcache_entry *entry,
+                                      const char *filename, const struct stat *st,
+                                      char *record, size_t record_len)
+{
+    if (entry) {
+        free(entry->record);
+    } else {
+        entry = statcache_append(cache, filename);
+    }
+
+    entry->size = st->st_size;
+    entry->mtime = st->st_mtime;
+    entry->ino = st->st_ino;
+    entry->sig_mtime = 0;
+    entry->record = record;
+    entry->record_len = record_len;
+    entry->seen = true;
+    cache->dirty = true;
+    return entry;
+}
+
+void statcache_set_verified(struct statcache *cache, struct statcache_entry *entry,
+                            time_t sig_mtime)
+{
+    if (entry->sig_mtime != sig_mtime) {
+        entry->sig_mtime = sig_mtime;
+        cache->dirty = true;
+    }
+}
+
+/* Drop every entry that wasn't seen during the last scan and restore
+ * the sort order after new entries were appended. Surviving entries
+ * are reset for the next scan. */
+void statcache_finish(struct statcache *cache)
+{
+    size_t count = 0;
+
+    for (size_t i = 0; i < cache->count; ++i) {
+        struct statcache_entry *entry = &cache->entries[i];
+
+        if (!entry->seen) {
+            free(entry->filename);
+            free(entry->record);
+            cache->dirty = true;
+            continue;
+        }
+
+        entry->seen = false;
+        cache->entries[count++] = *entry;
+    }
+
+    cache->count = count;
+    qsort(cache->entries, cache->count, sizeof(*cache->entries), entry_cmp);
+}
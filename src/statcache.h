@@ -0,0 +1,46 @@
+#pragma once
+
+#include <stdbool.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include "package.h"
+
+/* A sidecar cache of parsed package metadata, keyed on the stat data
+ * of the package file it came from. A package whose size, mtime and
+ * inode still match can be rebuilt from its cached record without
+ * ever touching libarchive. The mtime of the last signature verified
+ * against the package is kept alongside, zero if there was none. */
+struct statcache_entry {
+    char *filename;
+    off_t size;
+    time_t mtime;
+    ino_t ino;
+    time_t sig_mtime;
+    char *record;
+    size_t record_len;
+    bool seen;
+};
+
+struct statcache {
+    struct statcache_entry *entries;
+    size_t count;
+    size_t size;
+    bool dirty;
+};
+
+int statcache_load(struct statcache *cache, int dirfd, const char *filename);
+int statcache_write(struct statcache *cache, int dirfd, const char *filename);
+void statcache_free(struct statcache *cache);
+
+struct statcache_entry *statcache_find(struct statcache *cache, const char *filename);
+struct pkg *statcache_entry_load(struct statcache_entry *entry, const struct stat *st);
+bool statcache_entry_verified(const struct statcache_entry *entry, const struct stat *st,
+                              time_t sig_mtime);
+
+char *statcache_record(struct pkg *pkg, size_t *record_len);
+struct statcache_entry *statcache_put(struct statcache *cache, struct statcache_entry *entry,
+                                      const char *filename, const struct stat *st,
+                                      char *record, size_t record_len);
+void statcache_set_verified(struct statcache *cache, struct statcache_entry *entry,
+                            time_t sig_mtime);
+void statcache_finish(struct statcache *cache);
@@ -0,0 +1,132 @@
+#include "stats.h"
+
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+struct phase_start {
+    struct timespec wall;
+    struct timespec cpu;
+};
+
+struct phase_times {
+    double wall;
+    double cpu;
+};
+
+static const char *phase_names[PHASE_MAX] = {
+    [PHASE_INIT]      = "init",
+    [PHASE_FILECACHE] = "filecache",
+    [PHASE_REDUCE]    = "reduce",
+    [PHASE_UPDATE]    = "update",
+    [PHASE_WRITE]     = "write",
+    [PHASE_SIGN]      = "sign",
+    [PHASE_PUBLISH]   = "publish",
+    [PHASE_INDEX]     = "index",
+    [PHASE_LINK]      = "link"
+};
+
+static const char *counter_names[STAT_MAX] = {
+    [STAT_PKGS_OPENED]        = "packages_opened",
+    [STAT_BYTES_DECOMPRESSED] = "bytes_decompressed",
+    [STAT_BYTES_WRITTEN]      = "bytes_written",
+    [STAT_BYTES_HASHED]       = "bytes_hashed",
+    [STAT_LINK_SYSCALLS]      = "link_syscalls"
+};
+
+/* Repos in a batch are updated side by side, so a phase can be entered
+ * on several threads at once. It's only timed from the first entry to
+ * the last exit: summing every thread's share would count the same
+ * stretch of wall time, and with it the process's CPU time, once per
+ * thread. */
+static struct phase_start starts[PHASE_MAX];
+static unsigned active[PHASE_MAX];
+static struct phase_times phases[PHASE_MAX];
+static pthread_mutex_t phases_lock = PTHREAD_MUTEX_INITIALIZER;
+uint64_t stats_counters[STAT_MAX];
+
+static double elapsed(const struct timespec *start, const struct timespec *end)
+{
+    return (double)(end->tv_sec - start->tv_sec) +
+        (double)(end->tv_nsec - start->tv_nsec) / 1e9;
+}
+
+void stats_begin(enum stats_phase phase)
+{
+    pthread_mutex_lock(&phases_lock);
+    if (active[phase]++ == 0) {
+        clock_gettime(CLOCK_MONOTONIC, &starts[phase].wall);
+        clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &starts[phase].cpu);
+    }
+    pthread_mutex_unlock(&phases_lock);
+}
+
+/* Time accumulates, so a phase may be entered more than once a run.
+ * CPU time is for the whole process, worker threads included, while
+ * the phase is in progress on any of them. */
+void stats_end(enum stats_phase phase)
+{
+    pthread_mutex_lock(&phases_lock);
+    if (--active[phase] == 0) {
+        struct timespec wall, cpu;
+        clock_gettime(CLOCK_MONOTONIC, &wall);
+        clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &cpu);
+
+        phases[phase].wall += elapsed(&starts[phase].wall, &wall);
+        phases[phase].cpu += elapsed(&starts[phase].cpu, &cpu);
+    }
+    pthread_mutex_unlock(&phases_lock);
+}
+
+/* Start counting afresh, so each update of a long-running process
+ * reports its own numbers */
+void stats_reset(void)
+{
+    pthread_mutex_lock(&phases_lock);
+    memset(phases, 0, sizeof(phases));
+    pthread_mutex_unlock(&phases_lock);
+
+    for (int i = 0; i < STAT_MAX; ++i)
+        __atomic_store_n(&stats_counters[i], 0, __ATOMIC_RELAXED);
+}
+
+static void report_text(FILE *out)
+{
+    fprintf(out, "%-20s %12s %12s\n", "phase", "wall (s)", "cpu (s)");
+    for (int i = 0; i < PHASE_MAX; ++i)
+        fprintf(out, "%-20s %12.6f %12.6f\n", phase_names[i], phases[i].wall, phases[i].cpu);
+
+    fputc('\n', out);
+    for (int i = 0; i < STAT_MAX; ++i)
+        fprintf(out, "%-20s %12ju\n", counter_names[i], (uintmax_t)stats_counters[i]);
+}
+
+static void report_json(FILE *out)
+{
+    fputs("{\"phases\":{", out);
+    for (int i = 0; i < PHASE_MAX; ++i) {
+        fprintf(out, "%s\"%s\":{\"wall_seconds\":%.6f,\"cpu_seconds\":%.6f}",
+                i ? "," : "", phase_names[i], phases[i].wall, phases[i].cpu);
+    }
+
+    fputs("},\"counters\":{", out);
+    for (int i = 0; i < STAT_MAX; ++i) {
+        fprintf(out, "%s\"%s\":%ju", i ? "," : "", counter_names[i],
+                (uintmax_t)stats_counters[i]);
+    }
+    fputs("}}\n", out);
+}
+
+void stats_report(FILE *out, enum stats_format format)
+{
+    switch (format) {
+    case STATS_TEXT:
+        report_text(out);
+        break;
+    case STATS_JSON:
+        report_json(out);
+        break;
+    case STATS_NONE:
+        break;
+    }
+}
@@ -0,0 +1,48 @@
+#pragma once
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+/* Where a run spends its time, and how much work it did getting there.
+ * Counters are bumped from the worker threads, so they're atomic;
+ * phases may be entered from several threads at once. */
+enum stats_phase {
+    PHASE_INIT,
+    PHASE_FILECACHE,
+    PHASE_REDUCE,
+    PHASE_UPDATE,
+    PHASE_WRITE,
+    PHASE_SIGN,
+    PHASE_PUBLISH,
+    PHASE_INDEX,
+    PHASE_LINK,
+    PHASE_MAX
+};
+
+enum stats_counter {
+    STAT_PKGS_OPENED,
+    STAT_BYTES_DECOMPRESSED,
+    STAT_BYTES_WRITTEN,
+    STAT_BYTES_HASHED,
+    STAT_LINK_SYSCALLS,
+    STAT_MAX
+};
+
+enum stats_format {
+    STATS_NONE,
+    STATS_TEXT,
+    STATS_JSON
+};
+
+void stats_begin(enum stats_phase phase);
+void stats_end(enum stats_phase phase);
+void stats_report(FILE *out, enum stats_format format);
+void stats_reset(void);
+
+extern uint64_t stats_counters[STAT_MAX];
+
+static inline void stats_add(enum stats_counter counter, uint64_t value)
+{
+    __atomic_fetch_add(&stats_counters[counter], value, __ATOMIC_RELAXED);
+}
@@ -8,10 +8,17 @@
 #include <err.h>
 #include <fcntl.h>
 #include <limits.h>
+#include <sys/stat.h>
 #include <archive.h>
+#include <openssl/evp.h>
+
+#include "stats.h"
+#include "ioctx.h"
 
 #define WHITESPACE " \t\n\r"
 
+size_t archive_block_size = 0x40000;
+
 static int oflags(const char *mode)
 {
     int m, o;
@@ -180,6 +187,54 @@ char *hex_representation(unsigned char *bytes, size_t size)
     return str;
 }
 
+/* Blocks come from the thread's pool and are read with pread: the file
+ * offset may have been moved by whoever read the file before us. */
+static int sha256_update_fd(EVP_MD_CTX *ctx, int fd)
+{
+    struct ioblock *block = ioblock_open(fd);
+    int ret = 0;
+
+    for (;;) {
+        const void *data;
+        ssize_t nbytes_r = ioblock_read(block, &data);
+        if (nbytes_r <= 0) {
+            ret = nbytes_r < 0 ? -1 : 0;
+            break;
+        }
+        if (!EVP_DigestUpdate(ctx, data, nbytes_r)) {
+            ret = -1;
+            break;
+        }
+    }
+
+    ioblock_close(block);
+    return ret;
+}
+
+char *sha256_fd(int fd)
+{
+    unsigned char output[EVP_MAX_MD_SIZE];
+    unsigned int output_len;
+    struct stat st;
+
+    if (fstat(fd, &st) < 0)
+        return NULL;
+
+    EVP_MD_CTX *ctx = EVP_MD_CTX_new();
+    if (!ctx)
+        return NULL;
+
+    int ok = EVP_DigestInit_ex(ctx, EVP_sha256(), NULL) &&
+        sha256_update_fd(ctx, fd) == 0 &&
+        EVP_DigestFinal_ex(ctx, output, &output_len);
+    EVP_MD_CTX_free(ctx);
+
+    if (ok)
+        stats_add(STAT_BYTES_HASHED, st.st_size);
+
+    return ok ? hex_representation(output, output_len) : NULL;
+}
+
 char *strstrip(char *s)
 {
     char *e;
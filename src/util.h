@@ -33,6 +33,9 @@
 
 struct archive;
 
+/* Block size used when libarchive reads straight from a file descriptor */
+extern size_t archive_block_size;
+
 static inline void freep(void *p)      { free(*(void **)p); }
 static inline void fclosep(FILE **fp)  { if (*fp) fclose(*fp); }
 static inline void closedirp(DIR **dp) { if (*dp) closedir(*dp); }
@@ -53,5 +56,6 @@ int parse_time(const char *str, time_t *out);
 
 char *strstrip(char *s);
 char *hex_representation(unsigned char *bytes, size_t size);
+char *sha256_fd(int fd);
 
 int archive_read(struct archive *archive, char **buf, size_t *buf_len);
@@ -0,0 +1,145 @@
+#include "watch.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <err.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/inotify.h>
+
+#include "pkgcache.h"
+#include "util.h"
+
+static const uint32_t watch_mask =
+    IN_CLOSE_WRITE | IN_MOVED_TO | IN_MOVED_FROM | IN_DELETE;
+
+int watch_init(struct watch *watch, const char *path)
+{
+    *watch = (struct watch){0};
+
+    watch->fd = inotify_init1(IN_CLOEXEC);
+    if (watch->fd < 0)
+        return -1;
+
+    if (inotify_add_watch(watch->fd, path, watch_mask | IN_ONLYDIR) < 0) {
+        close(watch->fd);
+        watch->fd = -1;
+        return -1;
+    }
+
+    return 0;
+}
+
+static size_t *probe(const struct watch *watch, const char *name)
+{
+    const size_t mask = watch->buckets - 1;
+
+    for (size_t i = pkgname_hash(name) & mask;; i = (i + 1) & mask) {
+        size_t *slot = &watch->table[i];
+        if (!*slot || streq(watch->names[*slot - 1], name))
+            return slot;
+    }
+}
+
+static void grow_table(struct watch *watch)
+{
+    free(watch->table);
+    watch->buckets = watch->buckets ? watch->buckets * 2 : 128;
+    watch->table = calloc(watch->buckets, sizeof(size_t));
+    check_null(watch->table, "failed to allocate watch events");
+
+    for (size_t i = 0; i < watch->count; ++i)
+        *probe(watch, watch->names[i]) = i + 1;
+}
+
+/* A burst of events mostly names the same few files over and over */
+static void add_name(struct watch *watch, const char *name)
+{
+    if ((watch->count + 1) * 4 > watch->buckets * 3)
+        grow_table(watch);
+
+    size_t *slot = probe(watch, name);
+    if (*slot)
+        return;
+
+    if (watch->count == watch->size) {
+        watch->size = watch->size ? watch->size * 2 : 64;
+        watch->names = realloc(watch->names, watch->size * sizeof(char *));
+        check_null(watch->names, "failed to allocate watch events");
+    }
+
+    char *copy = strdup(name);
+    check_null(copy, "failed to allocate watch events");
+
+    watch->names[watch->count++] = copy;
+    *slot = watch->count;
+}
+
+static int read_events(struct watch *watch)
+{
+    char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+
+    ssize_t len = read(watch->fd, buf, sizeof(buf));
+    if (len < 0)
+        return errno == EINTR || errno == EAGAIN ? 0 : -1;
+
+    for (char *ptr = buf; ptr < buf + len;) {
+        const struct inotify_event *event = (const struct inotify_event *)ptr;
+        ptr += sizeof(struct inotify_event) + event->len;
+
+        if (event->mask & IN_Q_OVERFLOW)
+            watch->overflow = true;
+        else if (event->len && (event->mask & watch_mask))
+            add_name(watch, event->name);
+    }
+
+    return 0;
+}
+
+/* Block until something changes, then keep collecting until the
+ * directory has been quiet for delay_ms. A batch of uploads shows up
+ * as one burst instead of one update per package. */
+int watch_wait(struct watch *watch, int delay_ms)
+{
+    struct pollfd pfd = { .fd = watch->fd, .events = POLLIN };
+    int timeout = -1;
+
+    for (;;) {
+        int ret = poll(&pfd, 1, timeout);
+        if (ret < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+
+        if (ret == 0) {
+            if (watch->count || watch->overflow)
+                return 0;
+            timeout = -1;
+            continue;
+        }
+
+        if (read_events(watch) < 0)
+            return -1;
+        timeout = delay_ms;
+    }
+}
+
+void watch_reset(struct watch *watch)
+{
+    for (size_t i = 0; i < watch->count; ++i)
+        free(watch->names[i]);
+    if (watch->table)
+        memset(watch->table, 0, watch->buckets * sizeof(size_t));
+    watch->count = 0;
+    watch->overflow = false;
+}
+
+void watch_free(struct watch *watch)
+{
+    watch_reset(watch);
+    free(watch->names);
+    free(watch->table);
+    closep(&watch->fd);
+}
@@ -0,0 +1,23 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/* Collects the names of files that were written, moved in, moved out
+ * or deleted in a directory, a burst at a time. */
+struct watch {
+    int fd;
+    char **names;
+    size_t count;
+    size_t size;
+    bool overflow;
+
+    /* Open addressed set of 1-based indices into names */
+    size_t *table;
+    size_t buckets;
+};
+
+int watch_init(struct watch *watch, const char *path);
+int watch_wait(struct watch *watch, int delay_ms);
+void watch_reset(struct watch *watch);
+void watch_free(struct watch *watch);
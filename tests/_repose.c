@@ -8,7 +8,10 @@ typedef struct __alpm_list_t {
     ...;
 } alpm_list_t;
 
+typedef uint64_t hash_t;
+
 struct pkg {
+    hash_t hash;
     char *filename;
     char *name;
     char *base;
@@ -33,7 +36,7 @@ struct pkg {
     alpm_list_t *optdepends;
     alpm_list_t *makedepends;
     alpm_list_t *checkdepends;
-    alpm_list_t *files;
+    struct filelist *files;
     ...;
 };
 
@@ -86,8 +89,80 @@ void pkginfo_parser_init(struct pkginfo_parser *parser);
 ssize_t pkginfo_parser_feed(struct pkginfo_parser *parser, struct pkg *pkg,
                             char *buf, size_t buf_len);
 
+// pkgcache
+struct pkgcache {
+    struct pkg **pkgs;
+    size_t entries;
+    ...;
+};
+
+hash_t pkgname_hash(const char *str);
+struct pkgcache *pkgcache_create(size_t size);
+void pkgcache_free(struct pkgcache *cache);
+struct pkgcache *pkgcache_add(struct pkgcache *cache, struct pkg *pkg, struct pkg **data);
+struct pkgcache *pkgcache_replace(struct pkgcache *cache, struct pkg *new, struct pkg *old);
+struct pkgcache *pkgcache_remove(struct pkgcache *cache, struct pkg *pkg, struct pkg **data);
+void pkgcache_sort(struct pkgcache *cache);
+struct pkg *pkgcache_find(struct pkgcache *cache, const char *name);
+struct pkg *pkgcache_find_hashed(struct pkgcache *cache, const char *name, hash_t hash);
+
+// package
+int load_package_files(struct pkg *pkg, int fd);
+
+// arena
+struct arena *arena_get(void);
+void *arena_alloc(struct arena *arena, size_t size);
+char *arena_strndup(struct arena *arena, const char *str, size_t len);
+char *arena_intern(struct arena *arena, const char *str, size_t len);
+void arena_retire(void);
+void arena_release_retired(void);
+size_t arena_footprint(void);
+void arena_release(void);
+
+// filelist
+struct filelist {
+    size_t count;
+    ...;
+};
+
+struct filelist_iter {
+    ...;
+};
+
+struct filelist *filelist_new(void);
+void filelist_free(struct filelist *list);
+struct filelist *filelist_copy(const struct filelist *list);
+void filelist_add(struct filelist *list, const char *path, size_t len);
+void filelist_finish(struct filelist *list);
+void filelist_iter_init(struct filelist_iter *iter, const struct filelist *list);
+const char *filelist_next(struct filelist_iter *iter);
+void filelist_iter_free(struct filelist_iter *iter);
+
 // utils
 char *joinstring(const char *root, ...);
 int parse_size(const char *str, size_t *out);
 int parse_time(const char *size, time_t *out);
 char *strstrip(char *s);
+char *sha256_fd(int fd);
+
+// query
+struct query_dep {
+    struct pkg *pkg;
+    const char *depend;
+};
+
+struct query_index {
+    ...;
+};
+
+void query_index_build(struct query_index *index, struct pkgcache *cache);
+void query_index_free(struct query_index *index);
+bool query_satisfied(const struct query_index *index, const char *depend,
+                     const alpm_list_t *without);
+alpm_list_t *query_providers(const struct query_index *index, const char *name);
+alpm_list_t *query_replacers(const struct query_index *index, const char *name);
+alpm_list_t *query_rdepends(const struct query_index *index, struct pkg *pkg);
+alpm_list_t *query_unresolved(const struct query_index *index, struct pkg *pkg);
+alpm_list_t *query_broken(const struct query_index *index, const alpm_list_t *dropped);
+alpm_list_t *alpm_list_add(alpm_list_t *list, void *data);
+void alpm_list_free(alpm_list_t *list);
@@ -2,4 +2,9 @@
 #include <repose.h>
 #include <desc.h>
 #include <pkginfo.h>
+#include <pkgcache.h>
+#include <package.h>
+#include <arena.h>
+#include <filelist.h>
 #include <util.h>
+#include <query.h>
@@ -5,7 +5,10 @@ import cffi
 CFLAGS = ['-std=c11', '-O0', '-g', '-D_GNU_SOURCE']
 SOURCES = ['../src/desc.c', '../src/pkginfo.c',
            '../src/package.c', '../src/pkgcache.c',
-           '../src/util.c', '../src/base64.c']
+           '../src/util.c', '../src/base64.c',
+           '../src/arena.c', '../src/filelist.c',
+           '../src/stats.c', '../src/ioctx.c', '../src/buffer.c',
+           '../src/query.c']
 
 
 def pytest_configure(config):
@@ -14,7 +17,7 @@ def pytest_configure(config):
         header = ffi.set_source('repose',
                                 header.read(),
                                 include_dirs=['../src'],
-                                libraries=['archive', 'alpm'],
+                                libraries=['archive', 'alpm', 'crypto'],
                                 sources=SOURCES,
                                 extra_compile_args=CFLAGS)
 
@@ -0,0 +1,58 @@
+import pytest
+from repose import lib, ffi
+
+
+@pytest.fixture
+def arena():
+    yield lib.arena_get()
+    lib.arena_release()
+
+
+def test_strndup(arena):
+    result = lib.arena_strndup(arena, b'Hello World', 5)
+    assert ffi.string(result) == b'Hello'
+
+
+def test_intern(arena):
+    first = lib.arena_intern(arena, b'x86_64', 6)
+    second = lib.arena_intern(arena, b'x86_64 linux', 6)
+    other = lib.arena_intern(arena, b'any', 3)
+
+    assert first == second
+    assert first != other
+    assert ffi.string(first) == b'x86_64'
+
+
+def test_intern_long(arena):
+    value = b'a' * 200
+    first = lib.arena_intern(arena, value, len(value))
+    second = lib.arena_intern(arena, value, len(value))
+
+    assert first != second
+    assert ffi.string(first) == value
+
+
+@pytest.mark.parametrize('size', [1, 100, 0x10000])
+def test_alloc(arena, size):
+    ptrs = [lib.arena_alloc(arena, size) for _ in range(64)]
+    for ptr in ptrs:
+        assert int(ffi.cast('uintptr_t', ptr)) % 8 == 0
+        ffi.memmove(ptr, b'\xff' * size, size)
+    assert len(set(int(ffi.cast('uintptr_t', ptr)) for ptr in ptrs)) == len(ptrs)
+
+
+def test_retire(arena):
+    for _ in range(100):
+        lib.arena_alloc(arena, 0x1000)
+    before = lib.arena_footprint()
+
+    lib.arena_retire()
+    fresh = lib.arena_get()
+    assert fresh != arena
+
+    kept = lib.arena_intern(fresh, b'x86_64', 6)
+    lib.arena_release_retired()
+
+    assert lib.arena_footprint() < before
+    assert ffi.string(kept) == b'x86_64'
+    assert lib.arena_intern(lib.arena_get(), b'x86_64', 6) == kept
@@ -1,7 +1,7 @@
 import pytest
 from datetime import datetime
 from repose import lib, ffi
-from wrappers import Parser, Package
+from wrappers import Parser, ParserError, Package
 
 
 REPOSE_DESC = '''%FILENAME%
@@ -58,6 +58,20 @@ git
 '''
 
 
+REPOSE_FILES = '''%FILES%
+usr/
+usr/bin/
+usr/bin/repose
+usr/share/
+usr/share/man/
+usr/share/man/man1/
+usr/share/man/man1/repose.1.gz
+usr/share/zsh/
+usr/share/zsh/site-functions/
+usr/share/zsh/site-functions/_repose
+'''
+
+
 class DescParser(Parser):
     def init_parser(self):
         parser = ffi.new('struct desc_parser*')
@@ -126,3 +140,27 @@ def test_parse_chunked(pkg, parser, chunksize):
     assert pkg.builddate == "Nov 28, 2015, 06:04:29"
     assert pkg.packager == 'Simon Gomizelj <simongmzlj@gmail.com>'
     assert pkg.licenses == ['GPL']
+
+
+def test_parse_files(pkg, parser):
+    parser.feed(pkg, REPOSE_FILES)
+    assert parser.entry == lib.PKG_FILES
+
+    assert pkg.files == REPOSE_FILES.splitlines()[1:]
+
+
+@pytest.mark.parametrize('chunksize', [1, 7, 100, 4096])
+def test_parse_files_chunked(pkg, parser, chunksize):
+    files = ['usr/share/locale/{}/LC_MESSAGES/repose.mo'.format(i)
+             for i in range(500)]
+    data = '%FILES%\n' + ''.join(path + '\n' for path in files)
+
+    for i in range(0, len(data), chunksize):
+        parser.feed(pkg, data[i:i+chunksize])
+
+    assert pkg.files == files
+
+
+def test_parse_stray_percent(pkg, parser):
+    with pytest.raises(ParserError):
+        parser.feed(pkg, '%DESC%\nA 100% broken description\n')
@@ -0,0 +1,51 @@
+import pytest
+from repose import lib, ffi
+from wrappers import filelist_paths
+
+
+def make_filelist(paths):
+    filelist = ffi.gc(lib.filelist_new(), lib.filelist_free)
+    for path in paths:
+        data = path.encode()
+        lib.filelist_add(filelist, data, len(data))
+    return filelist
+
+
+@pytest.mark.parametrize('paths', [
+    [],
+    ['usr/'],
+    ['usr/', 'usr/bin/', 'usr/bin/repose', 'usr/lib/', 'usr/lib/librepose.so'],
+    ['b/long/path/', 'a', 'b/long/path/x', 'b/long', ''],
+    ['usr/share/locale/{}/LC_MESSAGES/foo.mo'.format(i) for i in range(1000)],
+    ['x' * 300, 'x' * 300 + '/y', 'x' * 20],
+])
+def test_roundtrip(paths):
+    filelist = make_filelist(paths)
+
+    assert filelist.count == len(paths)
+    assert list(filelist_paths(filelist)) == paths
+
+
+def test_copy():
+    paths = ['usr/', 'usr/bin/', 'usr/bin/repose']
+    filelist = make_filelist(paths)
+    copy = ffi.gc(lib.filelist_copy(filelist), lib.filelist_free)
+
+    data = b'usr/bin/repose-tools'
+    lib.filelist_add(copy, data, len(data))
+
+    assert list(filelist_paths(filelist)) == paths
+    assert list(filelist_paths(copy)) == paths + ['usr/bin/repose-tools']
+
+
+def test_finish():
+    paths = ['usr/share/locale/{}/LC_MESSAGES/foo.mo'.format(i) for i in range(100)]
+    filelist = make_filelist(paths)
+    lib.filelist_finish(filelist)
+
+    data = b'usr/share/locale/zz/LC_MESSAGES/foo.mo'
+    lib.filelist_add(filelist, data, len(data))
+    copy = ffi.gc(lib.filelist_copy(filelist), lib.filelist_free)
+
+    assert list(filelist_paths(filelist)) == paths + [data.decode()]
+    assert list(filelist_paths(copy)) == paths + [data.decode()]
@@ -0,0 +1,49 @@
+import io
+import os
+import tarfile
+import pytest
+from repose import lib
+from wrappers import Package
+
+
+# What --stream reads back when it writes the files database
+PATHS = ['usr/', 'usr/bin/', 'usr/bin/repose', 'usr/share/', 'usr/share/repose']
+
+
+def make_package(path):
+    with tarfile.open(str(path), 'w:gz') as tar:
+        for name in ['.PKGINFO', '.MTREE'] + PATHS:
+            info = tarfile.TarInfo(name.rstrip('/'))
+            if name.endswith('/'):
+                info.type = tarfile.DIRTYPE
+                tar.addfile(info)
+            else:
+                data = os.urandom(4096)
+                info.size = len(data)
+                tar.addfile(info, io.BytesIO(data))
+    return path
+
+
+def load_files(path):
+    pkg = Package()
+    fd = os.open(str(path), os.O_RDONLY)
+    try:
+        return lib.load_package_files(pkg._struct, fd), pkg
+    finally:
+        os.close(fd)
+
+
+def test_stream_files(tmp_path):
+    ret, pkg = load_files(make_package(tmp_path / 'repose-1.0-1-x86_64.pkg.tar.gz'))
+    assert ret == 0
+    assert pkg.files == PATHS
+
+
+@pytest.mark.parametrize('keep', [0.3, 0.6, 0.9])
+def test_stream_truncated(tmp_path, keep):
+    path = make_package(tmp_path / 'repose-1.0-1-x86_64.pkg.tar.gz')
+    data = path.read_bytes()
+    path.write_bytes(data[:int(len(data) * keep)])
+
+    ret, _ = load_files(path)
+    assert ret == -1
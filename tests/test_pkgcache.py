@@ -0,0 +1,111 @@
+import pytest
+from repose import lib, ffi
+
+
+class Cache(object):
+    def __init__(self, size=0):
+        self._cache = ffi.gc(lib.pkgcache_create(size), lib.pkgcache_free)
+        self._names = {}
+
+    def new_pkg(self, name):
+        cname = ffi.new('char[]', name.encode())
+        pkg = ffi.new('struct pkg *')
+        pkg.name = cname
+        pkg.hash = lib.pkgname_hash(cname)
+        self._names[name] = (cname, pkg)
+        return pkg
+
+    def add(self, name):
+        self._cache = lib.pkgcache_add(self._cache, self.new_pkg(name), ffi.NULL)
+
+    def remove(self, name):
+        _, pkg = self._names[name]
+        self._cache = lib.pkgcache_remove(self._cache, pkg, ffi.NULL)
+
+    def find(self, name):
+        pkg = lib.pkgcache_find(self._cache, name.encode())
+        if pkg == ffi.NULL:
+            return None
+        return ffi.string(pkg.name).decode()
+
+    def names(self):
+        return [ffi.string(self._cache.pkgs[i].name).decode()
+                for i in range(self._cache.entries)]
+
+    def sort(self):
+        lib.pkgcache_sort(self._cache)
+
+
+@pytest.mark.parametrize('size', [0, 10, 1000])
+def test_add_and_find(size):
+    cache = Cache(size)
+    names = ['pkg{}'.format(i) for i in range(500)]
+    for name in names:
+        cache.add(name)
+
+    assert len(cache.names()) == len(names)
+    for name in names:
+        assert cache.find(name) == name
+    assert cache.find('missing') is None
+
+
+def test_remove():
+    cache = Cache()
+    names = ['pkg{}'.format(i) for i in range(300)]
+    for name in names:
+        cache.add(name)
+
+    removed = set(names[::3])
+    for name in removed:
+        cache.remove(name)
+
+    assert sorted(cache.names()) == sorted(set(names) - removed)
+    for name in names:
+        expected = None if name in removed else name
+        assert cache.find(name) == expected
+
+
+def test_replace():
+    cache = Cache()
+    cache.add('foo')
+    cache.add('bar')
+
+    _, old = cache._names['foo']
+    new = cache.new_pkg('foo')
+    cache._cache = lib.pkgcache_replace(cache._cache, new, old)
+
+    assert cache.names() == ['foo', 'bar']
+    assert lib.pkgcache_find(cache._cache, b'foo') == new
+
+
+def test_sort():
+    cache = Cache()
+    names = ['zsh', 'bash', 'pacman', 'linux', 'acl']
+    for name in names:
+        cache.add(name)
+
+    cache.sort()
+    assert cache.names() == sorted(names)
+    for name in names:
+        assert cache.find(name) == name
+
+
+def test_colliding_hashes():
+    cache = Cache()
+    names = ['pkg{}'.format(i) for i in range(200)]
+    for name in names:
+        pkg = cache.new_pkg(name)
+        pkg.hash = 42
+        cache._cache = lib.pkgcache_add(cache._cache, pkg, ffi.NULL)
+
+    for name in names:
+        assert lib.pkgcache_find_hashed(cache._cache, name.encode(), 42) != ffi.NULL
+    assert lib.pkgcache_find_hashed(cache._cache, b'missing', 42) == ffi.NULL
+
+    removed = set(names[::2])
+    for name in removed:
+        cache.remove(name)
+
+    for name in names:
+        pkg = lib.pkgcache_find_hashed(cache._cache, name.encode(), 42)
+        assert (pkg == ffi.NULL) == (name in removed)
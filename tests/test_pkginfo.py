@@ -80,6 +80,20 @@ def test_parse_chunked(pkg, parser, chunksize):
     assert pkg.licenses == ['GPL']
 
 
+@pytest.mark.parametrize('chunksize', [1, 7, 100, 4096])
+def test_parse_many_entries(pkg, parser, chunksize):
+    depends = ['lib{}-with-a-longer-name>=1.{}'.format(i, i) for i in range(500)]
+    pkginfo = 'pkgname = split-package\n'
+    pkginfo += ''.join('depend = {}\n'.format(dep) for dep in depends)
+    pkginfo += 'size = 1024\n'
+
+    for i in range(0, len(pkginfo), chunksize):
+        parser.feed(pkg, pkginfo[i:i+chunksize])
+
+    assert pkg.depends == depends
+    assert pkg.isize == 1024
+
+
 def test_pkginfo_with_backup(pkg, parser):
     parser.feed(pkg, '''pkgname = example
 backup = etc/example/conf
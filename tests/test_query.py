@@ -0,0 +1,173 @@
+import pytest
+from repose import lib, ffi
+from wrappers import Package
+from test_pkginfo import PKGINFOParser
+
+
+class Repo(object):
+    def __init__(self):
+        self._cache = ffi.gc(lib.pkgcache_create(0), lib.pkgcache_free)
+        self._pkgs = {}
+        self._index = None
+
+    def add(self, name, version='1.0-1', depends=(), provides=(), replaces=()):
+        pkginfo = 'pkgname = {}\npkgver = {}\n'.format(name, version)
+        pkginfo += ''.join('depend = {}\n'.format(dep) for dep in depends)
+        pkginfo += ''.join('provides = {}\n'.format(prov) for prov in provides)
+        pkginfo += ''.join('replaces = {}\n'.format(rep) for rep in replaces)
+
+        pkg = Package()
+        PKGINFOParser().feed(pkg, pkginfo)
+        pkg._struct.hash = lib.pkgname_hash(pkg._struct.name)
+        self._pkgs[name] = pkg
+        self._cache = lib.pkgcache_add(self._cache, pkg._struct, ffi.NULL)
+
+    @property
+    def index(self):
+        if self._index is None:
+            self._index = ffi.gc(ffi.new('struct query_index *'),
+                                 lib.query_index_free)
+            lib.query_index_build(self._index, self._cache)
+        return self._index
+
+    def pkglist(self, names):
+        node = ffi.NULL
+        for name in names:
+            node = lib.alpm_list_add(node, self._pkgs[name]._struct)
+        if node == ffi.NULL:
+            return node
+        return ffi.gc(node, lib.alpm_list_free)
+
+    def satisfied(self, depend, without=()):
+        return lib.query_satisfied(self.index, depend.encode(),
+                                   self.pkglist(without))
+
+    def providers(self, name):
+        return pkg_names(lib.query_providers(self.index, name.encode()))
+
+    def replacers(self, name):
+        return pkg_names(lib.query_replacers(self.index, name.encode()))
+
+    def rdepends(self, name):
+        pkg = self._pkgs[name]._struct
+        return query_deps(lib.query_rdepends(self.index, pkg))
+
+    def unresolved(self, name):
+        pkg = self._pkgs[name]._struct
+        return strings(lib.query_unresolved(self.index, pkg))
+
+    def broken(self, names):
+        return query_deps(lib.query_broken(self.index, self.pkglist(names)))
+
+
+def walk(node):
+    head = node
+    try:
+        while node != ffi.NULL:
+            yield node.data
+            node = node.next
+    finally:
+        lib.alpm_list_free(head)
+
+
+def pkg_names(node):
+    return sorted(ffi.string(ffi.cast('struct pkg *', data).name).decode()
+                  for data in walk(node))
+
+
+def strings(node):
+    return sorted(ffi.string(ffi.cast('char *', data)).decode()
+                  for data in walk(node))
+
+
+def query_deps(node):
+    deps = (ffi.cast('struct query_dep *', data) for data in walk(node))
+    return sorted((ffi.string(dep.pkg.name).decode(),
+                   ffi.string(dep.depend).decode()) for dep in deps)
+
+
+@pytest.fixture
+def repo():
+    repo = Repo()
+    repo.add('glibc', '2.28-4')
+    repo.add('openssl', '1.1.1-1', depends=['glibc'])
+    repo.add('libressl', '2.8.2-1', provides=['openssl=1.0.2'],
+             replaces=['openssl-compat'])
+    repo.add('curl', '7.62.0-1', depends=['openssl>=1.1', 'glibc', 'zlib'])
+    repo.add('git', '2.19.1-1', depends=['curl', 'openssl', 'perl-error'])
+    repo.add('bash', '4.4.023-1', provides=['sh'])
+    return repo
+
+
+def test_versioned_satisfied(repo):
+    assert repo.satisfied('glibc')
+    assert repo.satisfied('glibc>=2.28')
+    assert repo.satisfied('glibc=2.28')
+    assert repo.satisfied('glibc<3')
+    assert not repo.satisfied('glibc>2.28')
+    assert not repo.satisfied('glibc<2')
+    assert not repo.satisfied('zlib')
+
+
+def test_unversioned_provision(repo):
+    assert repo.providers('sh') == ['bash']
+    assert repo.satisfied('sh')
+    assert not repo.satisfied('sh>=1')
+
+
+def test_providers(repo):
+    assert repo.providers('openssl') == ['libressl', 'openssl']
+    assert repo.providers('openssl>=1.1') == ['openssl']
+    assert repo.providers('openssl<1.1') == ['libressl']
+    assert repo.providers('missing') == []
+
+
+def test_replacers(repo):
+    assert repo.replacers('openssl-compat') == ['libressl']
+    assert repo.replacers('openssl') == []
+
+
+def test_rdepends(repo):
+    assert repo.rdepends('glibc') == [('curl', 'glibc'), ('openssl', 'glibc')]
+    assert repo.rdepends('openssl') == [('curl', 'openssl>=1.1'),
+                                        ('git', 'openssl')]
+    assert repo.rdepends('libressl') == [('git', 'openssl')]
+    assert repo.rdepends('git') == []
+
+
+def test_unresolved(repo):
+    assert repo.unresolved('curl') == ['zlib']
+    assert repo.unresolved('git') == ['perl-error']
+    assert repo.unresolved('glibc') == []
+
+
+def test_satisfied_without(repo):
+    assert repo.satisfied('openssl', without=['openssl'])
+    assert not repo.satisfied('openssl>=1.1', without=['openssl'])
+
+
+def test_broken(repo):
+    # libressl still satisfies git, but not curl's version constraint
+    assert repo.broken(['openssl']) == [('curl', 'openssl>=1.1')]
+    assert repo.broken(['openssl', 'libressl']) == [('curl', 'openssl>=1.1'),
+                                                     ('git', 'openssl')]
+
+
+def test_broken_ignores_dropped_dependents(repo):
+    assert repo.broken(['curl', 'git']) == []
+    assert repo.broken(['openssl', 'curl']) == []
+
+
+def test_broken_ignores_unresolved(repo):
+    repo.add('zlib-user', depends=['zlib'])
+    assert repo.broken(['glibc']) == [('curl', 'glibc'), ('openssl', 'glibc')]
+
+
+def test_many_packages():
+    repo = Repo()
+    for i in range(2000):
+        repo.add('lib{}'.format(i), depends=['lib{}>=1.0'.format(i - 1)] if i else [])
+
+    assert repo.rdepends('lib0') == [('lib1', 'lib0>=1.0')]
+    assert repo.unresolved('lib1999') == []
+    assert repo.broken(['lib1000']) == [('lib1001', 'lib1000>=1.0')]
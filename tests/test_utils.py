@@ -1,5 +1,7 @@
 import pytest
 import errno
+import hashlib
+import os
 from repose import ffi, lib
 
 
@@ -52,3 +54,14 @@ def test_parse_time():
 
     assert lib.parse_time(arg, out) == 0
     assert out[0] == 1448690669
+
+
+@pytest.mark.parametrize('size', [0, 1, 0x40000 + 7])
+def test_sha256_fd(tmpdir, size):
+    data = os.urandom(size)
+    path = tmpdir.join('blob')
+    path.write_binary(data)
+
+    with open(str(path), 'rb') as blob:
+        result = lib.sha256_fd(blob.fileno())
+        assert ffi.string(result).decode() == hashlib.sha256(data).hexdigest()
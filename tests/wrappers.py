@@ -1,7 +1,7 @@
 import abc
 import weakref
 from datetime import datetime
-from repose import ffi
+from repose import ffi, lib
 
 
 class marshal_int(object):
@@ -46,6 +46,28 @@ class marshal_string_list(object):
         return list(marshal_list(attr))
 
 
+def filelist_paths(files):
+    it = ffi.new('struct filelist_iter *')
+    lib.filelist_iter_init(it, files)
+    try:
+        while True:
+            path = lib.filelist_next(it)
+            if path == ffi.NULL:
+                break
+            yield ffi.string(path).decode()
+    finally:
+        lib.filelist_iter_free(it)
+
+
+class marshal_filelist(object):
+    def __init__(self, field):
+        self.field = field
+
+    def __get__(self, obj, cls):
+        attr = getattr(obj._struct, self.field)
+        return list(filelist_paths(attr))
+
+
 class Package(object):
     def __init__(self, name=None, version=None):
         self.weakkeydict = weakref.WeakKeyDictionary()
@@ -68,6 +90,7 @@ class Package(object):
     depends = marshal_string_list('depends')
     desc = marshal_string('desc')
     filename = marshal_string('filename')
+    files = marshal_filelist('files')
     isize = marshal_int('isize')
     licenses = marshal_string_list('licenses')
     makedepends = marshal_string_list('makedepends')